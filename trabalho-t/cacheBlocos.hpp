@@ -0,0 +1,440 @@
+#ifndef cacheBlocos_hpp
+#define cacheBlocos_hpp
+
+#include "log.hpp"
+#include "filaES.hpp"
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Cache de blocos (buffer cache), usado quando a área de blocos da imagem não fica inteira na memória
+// (FsOptions.cacheBlocks). Cada bloco usado é lido do arquivo para um quadro de blockSize bytes, e no
+// máximo capacidade quadros ficam na memória, qualquer que seja o tamanho da imagem.
+//
+// Quem usa um bloco o fixa (fixarQuadro) e depois o solta (soltarQuadro); um quadro fixado nunca é
+// despejado. Quando não há quadro vazio, o ponteiro do relógio (CLOCK) percorre os quadros: um quadro
+// usado desde a última passagem perde a marca e ganha uma segunda chance, e o primeiro sem marca e sem
+// fixação é despejado. Um quadro fixado para escrita fica sujo e é gravado no arquivo antes de ser despejado.
+//
+// Com o diário, um bloco de metadados alterado na transação aberta não pode chegar à imagem antes do
+// commit (diario.hpp): o quadro dele fica preso até ser gravado pela confirmação. Para que os quadros
+// presos não cresçam com a transação, a sessão confirma a transação ao fim da operação em que eles
+// chegam à metade da capacidade (cachePressionado), mesmo antes do group commit. Se ainda assim todos
+// os quadros estiverem fixados ou presos no meio de uma operação, o cache ganha um quadro além da
+// capacidade; os excedentes são descartados por reduzirCache, depois de cada gravação.
+//
+// E/S em sequências: uma falta logo depois do fim da leitura anterior indica acesso sequencial, e a
+// leitura seguinte traz de uma vez, com preadv, uma janela de blocos consecutivos que dobra a cada
+// falta sequencial (leitura antecipada). Na gravação, os blocos sujos consecutivos vão juntos em uma
+// só chamada a pwritev: na confirmação, os do conjunto sujo; no despejo, os vizinhos do quadro
+// despejado que também podem ir para o arquivo. Janelas e sequências têm no máximo maximoSequencia
+// blocos (BYTES_SEQUENCIA bytes, limitados a IOV_MAX e à metade do cache).
+//
+// fixarQuadro e as funções de gravação tomam a trava do cache; soltarQuadro só decrementa o contador
+// atômico do quadro, que nunca é despejado com o contador acima de zero. Fora da trava, o quadro só é
+// acessado pelo ponteiro que fixarQuadro retornou, nunca pelo índice: o deque não muda os quadros de
+// lugar, mas o índice passa pelo mapa interno dele, que emplace_back pode realocar.
+
+// Tamanho máximo, em bytes, de uma leitura antecipada ou de uma gravação em sequência.
+const long BYTES_SEQUENCIA = 128 * 1024;
+
+// Quadro do cache: guarda o bloco de índice bloco (-1 = vazio).
+struct Quadro
+{
+  int bloco = -1;
+  atomic<int> fixacoes{0};
+  bool usado = false;
+  bool sujo = false;
+  bool preso = false;
+  vector<unsigned char> dados;
+};
+
+struct CacheBlocos
+{
+  // Quantidade de quadros (0 = cache desligado; a área de blocos fica inteira na memória).
+  int capacidade = 0;
+  int tamanhoBloco = 0;
+
+  // Arquivo da imagem, deslocamento do bloco 0 dentro dele e quantidade de blocos.
+  int fd = -1;
+  long inicio = 0;
+  int totalBlocos = 0;
+
+  // Leitura antecipada: bloco seguinte ao último lido do arquivo e tamanho da última janela.
+  int fimLeitura = -1;
+  long janela = 1;
+  long maximoSequencia = 1;
+
+  // Quadros da leitura e da gravação em andamento e os iovecs delas, reaproveitados entre chamadas.
+  vector<long> leitura;
+  vector<long> gravacao;
+  vector<iovec> vetores;
+
+  // Com o diário: quadros com metadados da transação aberta ficam presos até a gravação.
+  bool prenderMetadados = false;
+  int presos = 0;
+
+  // Os quadros ficam em um deque para não mudarem de lugar quando o cache cresce. O acesso por índice
+  // só pode ser feito com a trava.
+  deque<Quadro> quadros;
+  unordered_map<int, int> quadroDoBloco;
+  size_t ponteiro = 0;
+  mutex trava;
+
+  // Contadores: acertos e faltas de fixarQuadro, quadros despejados, blocos gravados ao despejar
+  // (o despejado e os vizinhos gravados junto) e blocos lidos antecipadamente.
+  atomic<uint64_t> acertos{0};
+  atomic<uint64_t> faltas{0};
+  atomic<uint64_t> despejos{0};
+  atomic<uint64_t> gravacoesDespejo{0};
+  atomic<uint64_t> antecipados{0};
+};
+
+/**
+ * @brief Prepara o cache de uma imagem montada. Os quadros são criados sob demanda, até capacidade.
+ * @param cache cache a ser preparado
+ * @param fd descritor do arquivo da imagem, aberto para leitura e escrita
+ * @param inicio deslocamento do bloco 0 no arquivo
+ * @param tamanhoBloco tamanho de cada bloco
+ * @param totalBlocos quantidade de blocos da imagem
+ * @param capacidade quantidade máxima de quadros
+ */
+void iniciarCache(CacheBlocos &cache, int fd, long inicio, int tamanhoBloco, int totalBlocos, int capacidade)
+{
+  cache.capacidade = capacidade;
+  cache.tamanhoBloco = tamanhoBloco;
+  cache.fd = fd;
+  cache.inicio = inicio;
+  cache.totalBlocos = totalBlocos;
+  cache.maximoSequencia = min(BYTES_SEQUENCIA / tamanhoBloco, (long)min(IOV_MAX, capacidade / 2));
+  cache.maximoSequencia = cache.maximoSequencia > 1 ? cache.maximoSequencia : 1;
+  cache.fimLeitura = -1;
+  cache.janela = 1;
+  cache.quadros.clear();
+  cache.quadroDoBloco.clear();
+  cache.quadroDoBloco.reserve(capacidade);
+  cache.ponteiro = 0;
+  cache.presos = 0;
+  cache.acertos = 0;
+  cache.faltas = 0;
+  cache.despejos = 0;
+  cache.gravacoesDespejo = 0;
+  cache.antecipados = 0;
+}
+
+// Posição do bloco b no arquivo.
+long posicaoBloco(const CacheBlocos &cache, int b)
+{
+  return cache.inicio + (long)b * cache.tamanhoBloco;
+}
+
+// Grava com uma só chamada a pwritev os quadros de cache.gravacao, que guardam blocos consecutivos,
+// e os deixa limpos. Com fila, a gravação é só enfileirada e os quadros não podem mudar até concluirFila.
+// Deve ser chamada com a trava do cache.
+void gravarSequencia(CacheBlocos &cache, FilaES *fila = NULL)
+{
+  if (cache.gravacao.empty())
+  {
+    return;
+  }
+  cache.vetores.clear();
+  for (long q : cache.gravacao)
+  {
+    cache.vetores.push_back({cache.quadros[q].dados.data(), (size_t)cache.tamanhoBloco});
+  }
+  long posicao = posicaoBloco(cache, cache.quadros[cache.gravacao[0]].bloco);
+  ssize_t tamanho = (ssize_t)cache.gravacao.size() * cache.tamanhoBloco;
+  if (fila != NULL)
+  {
+    enfileirarGravacao(*fila, cache.fd, posicao, cache.vetores.data(), cache.vetores.size());
+  }
+  else if (pwritev(cache.fd, cache.vetores.data(), cache.vetores.size(), posicao) != tamanho)
+  {
+    LOG_FS(LOG_ERRO, "Error writing file!\n");
+  }
+  for (long q : cache.gravacao)
+  {
+    cache.presos -= cache.quadros[q].preso;
+    cache.quadros[q].sujo = false;
+    cache.quadros[q].preso = false;
+  }
+  cache.gravacao.clear();
+}
+
+// Quadro do bloco b que pode ir para o arquivo agora (sujo, sem fixação e sem metadados presos), ou -1.
+long quadroGravavel(CacheBlocos &cache, int b)
+{
+  auto achado = cache.quadroDoBloco.find(b);
+  if (achado == cache.quadroDoBloco.end())
+  {
+    return -1;
+  }
+  Quadro &q = cache.quadros[achado->second];
+  bool pode = q.sujo && q.fixacoes.load() == 0 && !(q.preso && cache.prenderMetadados);
+  return pode ? achado->second : -1;
+}
+
+// Grava o quadro sujo que vai ser despejado junto com os vizinhos consecutivos que também podem ir
+// para o arquivo, em uma só sequência. Deve ser chamada com a trava do cache.
+void gravarComVizinhos(CacheBlocos &cache, long indice)
+{
+  int b = cache.quadros[indice].bloco;
+  int primeiro = b;
+  while (primeiro > 0 && b - primeiro + 1 < cache.maximoSequencia && quadroGravavel(cache, primeiro - 1) != -1)
+  {
+    primeiro--;
+  }
+  cache.gravacao.clear();
+  for (int c = primeiro; c < b; c++)
+  {
+    cache.gravacao.push_back(cache.quadroDoBloco[c]);
+  }
+  cache.gravacao.push_back(indice);
+  for (int c = b + 1; (long)cache.gravacao.size() < cache.maximoSequencia; c++)
+  {
+    long q = quadroGravavel(cache, c);
+    if (q == -1)
+    {
+      break;
+    }
+    cache.gravacao.push_back(q);
+  }
+  cache.gravacoesDespejo.fetch_add(cache.gravacao.size(), memory_order_relaxed);
+  gravarSequencia(cache);
+}
+
+// Escolhe pelo relógio um quadro que pode ser despejado, ou -1 se todos estiverem fixados ou presos.
+// Duas voltas bastam: a primeira tira a marca de uso dos quadros que a têm.
+long escolherVitima(CacheBlocos &cache)
+{
+  size_t quantidade = cache.quadros.size();
+  for (size_t passo = 0; passo < 2 * quantidade; passo++)
+  {
+    size_t atual = cache.ponteiro;
+    cache.ponteiro = (cache.ponteiro + 1) % quantidade;
+    Quadro &q = cache.quadros[atual];
+    if (q.fixacoes.load() > 0 || (q.preso && cache.prenderMetadados))
+    {
+      continue;
+    }
+    if (q.usado)
+    {
+      q.usado = false;
+      continue;
+    }
+    return atual;
+  }
+  return -1;
+}
+
+// Obtém um quadro para guardar o bloco b, fixado e ainda sem conteúdo: um quadro novo enquanto o cache
+// está abaixo da capacidade, senão o escolhido pelo relógio (gravado antes, se estiver sujo). Se nenhum
+// puder sair, um quadro além da capacidade quando crescer for true, ou -1. Deve ser chamada com a trava do cache.
+long obterQuadro(CacheBlocos &cache, int b, bool crescer)
+{
+  long indice = (long)cache.quadros.size() < cache.capacidade ? -1 : escolherVitima(cache);
+  if (indice == -1)
+  {
+    if ((long)cache.quadros.size() >= cache.capacidade && !crescer)
+    {
+      return -1;
+    }
+    indice = cache.quadros.size();
+    cache.quadros.emplace_back();
+    cache.quadros.back().dados.resize(cache.tamanhoBloco);
+  }
+  else
+  {
+    if (cache.quadros[indice].sujo)
+    {
+      gravarComVizinhos(cache, indice);
+    }
+    cache.quadroDoBloco.erase(cache.quadros[indice].bloco);
+    cache.despejos.fetch_add(1, memory_order_relaxed);
+    cache.presos -= cache.quadros[indice].preso;
+  }
+
+  Quadro &q = cache.quadros[indice];
+  q.bloco = b;
+  q.sujo = false;
+  q.preso = false;
+  q.usado = false;
+  q.fixacoes.fetch_add(1);
+  cache.quadroDoBloco[b] = indice;
+  return indice;
+}
+
+// Lê do bloco b em diante, com uma só chamada a preadv, os blocos dos quadros em cache.leitura.
+void lerSequencia(CacheBlocos &cache, int b)
+{
+  cache.vetores.clear();
+  for (long q : cache.leitura)
+  {
+    cache.vetores.push_back({cache.quadros[q].dados.data(), (size_t)cache.tamanhoBloco});
+  }
+  ssize_t tamanho = (ssize_t)cache.leitura.size() * cache.tamanhoBloco;
+  if (preadv(cache.fd, cache.vetores.data(), cache.vetores.size(), posicaoBloco(cache, b)) != tamanho)
+  {
+    LOG_FS(LOG_ERRO, "Error reading file!\n");
+  }
+}
+
+/**
+ * @brief Fixa o bloco b em um quadro, lendo-o do arquivo se ele não estiver no cache. Se a falta continuar
+ * uma leitura sequencial, os blocos seguintes que não estão no cache são lidos junto (leitura antecipada).
+ * @param cache cache da imagem
+ * @param b índice do bloco
+ * @param escrever o quadro fica sujo (o chamador vai alterá-lo)
+ * @param metadado o bloco guarda metadados (entradas de diretório ou ponteiros); só vale com escrever
+ * @return quadro fixado, que deve ser solto com soltarQuadro
+ */
+Quadro *fixarQuadro(CacheBlocos &cache, int b, bool escrever, bool metadado)
+{
+  lock_guard<mutex> guarda(cache.trava);
+  long indice;
+  auto achado = cache.quadroDoBloco.find(b);
+  if (achado != cache.quadroDoBloco.end())
+  {
+    indice = achado->second;
+    cache.quadros[indice].fixacoes.fetch_add(1);
+    cache.acertos.fetch_add(1, memory_order_relaxed);
+  }
+  else
+  {
+    cache.faltas.fetch_add(1, memory_order_relaxed);
+    indice = obterQuadro(cache, b, true);
+
+    // A janela dobra a cada falta sequencial e volta a um bloco quando o acesso salta.
+    cache.janela = b == cache.fimLeitura ? min(cache.janela * 2, cache.maximoSequencia) : 1;
+    cache.leitura.clear();
+    cache.leitura.push_back(indice);
+    for (int c = b + 1; (long)cache.leitura.size() < cache.janela && c < cache.totalBlocos && cache.quadroDoBloco.count(c) == 0; c++)
+    {
+      long extra = obterQuadro(cache, c, false);
+      if (extra == -1)
+      {
+        break;
+      }
+      cache.leitura.push_back(extra);
+    }
+    lerSequencia(cache, b);
+    for (size_t k = 1; k < cache.leitura.size(); k++)
+    {
+      cache.quadros[cache.leitura[k]].fixacoes.fetch_sub(1);
+    }
+    cache.antecipados.fetch_add(cache.leitura.size() - 1, memory_order_relaxed);
+    cache.fimLeitura = b + cache.leitura.size();
+  }
+
+  Quadro &q = cache.quadros[indice];
+  q.usado = true;
+  if (escrever)
+  {
+    q.sujo = true;
+    cache.presos += metadado && !q.preso;
+    q.preso = q.preso || metadado;
+  }
+  return &q;
+}
+
+// Indica se os quadros presos pela transação aberta chegaram à metade da capacidade (ou o cache já
+// cresceu além dela): a transação deve ser confirmada ao fim da operação, para liberá-los.
+bool cachePressionado(CacheBlocos &cache)
+{
+  if (cache.capacidade == 0 || !cache.prenderMetadados)
+  {
+    return false;
+  }
+  lock_guard<mutex> guarda(cache.trava);
+  return cache.presos >= (cache.capacidade + 1) / 2 || (long)cache.quadros.size() > cache.capacidade;
+}
+
+// Solta um quadro fixado por fixarQuadro.
+void soltarQuadro(Quadro *quadro)
+{
+  quadro->fixacoes.fetch_sub(1);
+}
+
+// Enfileira a gravação dos blocos de uma lista ordenada que estão no cache e sujos, e os solta da
+// transação aberta. Blocos consecutivos vão juntos, em uma gravação por sequência. Os quadros não podem
+// ser despejados até concluirFila, então nenhum bloco pode ser fixado antes disso.
+void gravarBlocosCache(CacheBlocos &cache, const vector<int> &blocos, FilaES &fila)
+{
+  lock_guard<mutex> guarda(cache.trava);
+  cache.gravacao.clear();
+  int anterior = -1;
+  for (int b : blocos)
+  {
+    auto achado = cache.quadroDoBloco.find(b);
+    if (achado == cache.quadroDoBloco.end() || !cache.quadros[achado->second].sujo)
+    {
+      continue;
+    }
+    if (b != anterior + 1 || (long)cache.gravacao.size() == cache.maximoSequencia)
+    {
+      gravarSequencia(cache, &fila);
+    }
+    cache.gravacao.push_back(achado->second);
+    anterior = b;
+  }
+  gravarSequencia(cache, &fila);
+}
+
+// Volta a sujar os quadros dos blocos da lista que ainda estão no cache, depois de uma gravação que falhou.
+void sujarQuadros(CacheBlocos &cache, const vector<int> &blocos)
+{
+  lock_guard<mutex> guarda(cache.trava);
+  for (int b : blocos)
+  {
+    auto achado = cache.quadroDoBloco.find(b);
+    if (achado != cache.quadroDoBloco.end())
+    {
+      cache.quadros[achado->second].sujo = true;
+    }
+  }
+}
+
+// Deixa todos os quadros limpos e soltos da transação, sem gravá-los: as alterações deles são descartadas.
+void descartarQuadros(CacheBlocos &cache)
+{
+  lock_guard<mutex> guarda(cache.trava);
+  for (Quadro &q : cache.quadros)
+  {
+    q.sujo = false;
+    q.preso = false;
+  }
+  cache.presos = 0;
+}
+
+// Descarta os quadros criados além da capacidade, gravando os que estiverem sujos.
+// Deve ser chamada sem nenhum quadro fixado (com a árvore travada com exclusividade).
+void reduzirCache(CacheBlocos &cache)
+{
+  lock_guard<mutex> guarda(cache.trava);
+  while ((long)cache.quadros.size() > cache.capacidade)
+  {
+    Quadro &q = cache.quadros.back();
+    if (q.sujo)
+    {
+      cache.gravacao.assign(1, cache.quadros.size() - 1);
+      gravarSequencia(cache);
+    }
+    cache.quadroDoBloco.erase(q.bloco);
+    cache.quadros.pop_back();
+  }
+  if (cache.ponteiro >= cache.quadros.size())
+  {
+    cache.ponteiro = 0;
+  }
+}
+
+#endif /* cacheBlocos_hpp */
@@ -0,0 +1,259 @@
+#ifndef caminho_hpp
+#define caminho_hpp
+
+#include "imagem.hpp"
+#include "mapaBlocos.hpp"
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+// Resolução de caminhos componente a componente, a partir da raiz.
+// Cada passo procura o nome no diretório atual através do cache de dentries da imagem;
+// quando o diretório ainda não foi carregado no cache, suas entradas são lidas uma única vez.
+// Assim cada componente custa O(1) (amortizado) e um caminho custa O(profundidade).
+// O cache é protegido por img.travaDentries; a lista de entradas de um diretório só é lida com o
+// diretório travado (ver travas.hpp).
+
+// Quantidade de entradas do diretório d. Cada entrada é um ponteiro com o índice do inode filho;
+// as posições a partir de SIZE não fazem parte da lista, mesmo que tenham valores antigos.
+int quantidadeEntradas(const Imagem &img, int d)
+{
+  return tamanhoInode(img, d);
+}
+
+// Bloco que guarda a entrada na posição pos do diretório d.
+// As entradas ficam em sequência nos blocos lógicos do diretório, ponteirosPorBloco() entradas
+// por bloco; os blocos são traduzidos pelo mapa de blocos (mapaBlocos.hpp), como os de um arquivo.
+// O primeiro bloco é alocado junto com o diretório e, no caso da raiz, é o bloco 0, que o mapa
+// de blocos trataria como não alocado.
+int blocoEntrada(Imagem &img, int d, int pos)
+{
+  long logico = pos / ponteirosPorBloco(img);
+  return logico == 0 ? ponteiroInode(img, d, 0) : blocoFisico(img, d, logico);
+}
+
+// Entrada na posição pos da lista de entradas do diretório d: o índice do inode filho.
+uint32_t entradaDiretorio(Imagem &img, int d, int pos)
+{
+  return ponteiroBloco(img, blocoEntrada(img, d, pos), pos % ponteirosPorBloco(img));
+}
+
+// Grava a entrada na posição pos da lista de entradas do diretório d e marca o bloco como alterado.
+void definirEntradaDiretorio(Imagem &img, int d, int pos, uint32_t filho)
+{
+  definirPonteiroBloco(img, blocoEntrada(img, d, pos), pos % ponteirosPorBloco(img), filho);
+  marcarDiretorioSujo(img, blocoEntrada(img, d, pos));
+}
+
+// Compara o nome guardado no inode (até 10 bytes, completado com 0x00) com um nome, sem criar strings.
+bool nomeIgual(const Imagem &img, int i, string_view nome)
+{
+  size_t tamanho = strnlen(nomeInode(img, i), 10);
+  return tamanho == nome.size() && memcmp(nomeInode(img, i), nome.data(), tamanho) == 0;
+}
+
+// Grava o nome no inode, truncado em 10 bytes e completado com 0x00.
+void copiarNome(Imagem &img, int i, string_view nome)
+{
+  size_t tamanho = nome.size() < 10 ? nome.size() : 10;
+  memcpy(nomeInode(img, i), nome.data(), tamanho);
+  memset(nomeInode(img, i) + tamanho, 0x00, 10 - tamanho);
+}
+
+// Monta a chave (pai, nome), com o nome truncado e completado com 0x00 como no inode.
+ChaveDentry chaveDentry(int pai, const char *nome, size_t tamanho)
+{
+  ChaveDentry chave;
+  chave.pai = pai;
+  memset(chave.nome, 0x00, 10);
+  memcpy(chave.nome, nome, tamanho < 10 ? tamanho : 10);
+  return chave;
+}
+
+// Registra no cache que o inode filho está na posição pos do diretório pai, com travaDentries já tomada.
+void guardarDentry(Imagem &img, int pai, int filho, int pos)
+{
+  ChaveDentry chave;
+  chave.pai = pai;
+  memcpy(chave.nome, nomeInode(img, filho), 10);
+  img.dentries.filhos[chave] = filho;
+  img.dentries.posicao[filho] = pos;
+}
+
+// Registra no cache que o inode filho está na posição pos do diretório pai.
+void inserirDentry(Imagem &img, int pai, int filho, int pos)
+{
+  unique_lock<shared_mutex> trava(img.travaDentries);
+  guardarDentry(img, pai, filho, pos);
+}
+
+// Retira do cache a entrada do inode filho no diretório pai.
+void removerDentry(Imagem &img, int pai, int filho)
+{
+  ChaveDentry chave;
+  chave.pai = pai;
+  memcpy(chave.nome, nomeInode(img, filho), 10);
+  unique_lock<shared_mutex> trava(img.travaDentries);
+  img.dentries.filhos.erase(chave);
+}
+
+// Deixa de considerar completas as entradas do diretório d, cujo inode foi liberado e pode ser reaproveitado.
+void esquecerDiretorio(Imagem &img, int d)
+{
+  unique_lock<shared_mutex> trava(img.travaDentries);
+  img.dentries.completo[d] = 0;
+}
+
+// Esvazia o cache de dentries.
+void limparDentries(Imagem &img)
+{
+  unique_lock<shared_mutex> trava(img.travaDentries);
+  img.dentries.filhos.clear();
+  fill(img.dentries.completo.begin(), img.dentries.completo.end(), 0);
+}
+
+// Lê todas as entradas do diretório d para o cache, com travaDentries já tomada.
+void carregarDiretorio(Imagem &img, int d)
+{
+  for (int i = 0; i < quantidadeEntradas(img, d); i++)
+  {
+    guardarDentry(img, d, entradaDiretorio(img, d, i), i);
+  }
+  img.dentries.completo[d] = 1;
+}
+
+/**
+ * @brief Procura um nome dentro de um diretório. O diretório precisa estar travado (ou a árvore, com exclusividade).
+ * @param img imagem montada
+ * @param d inode do diretório
+ * @param nome nome procurado (um componente do caminho)
+ * @param tamanho quantidade de caracteres do nome
+ * @return inode do filho, ou -1 se não existir
+ */
+int procurarFilho(Imagem &img, int d, const char *nome, size_t tamanho)
+{
+  if (tipoInode(img, d) != 0x01)
+  {
+    return -1;
+  }
+
+  ChaveDentry chave = chaveDentry(d, nome, tamanho);
+  {
+    shared_lock<shared_mutex> trava(img.travaDentries);
+    if (img.dentries.completo[d])
+    {
+      auto it = img.dentries.filhos.find(chave);
+      return it == img.dentries.filhos.end() ? -1 : it->second;
+    }
+  }
+
+  // Primeira busca no diretório: outra thread pode tê-lo carregado enquanto a trava estava livre.
+  unique_lock<shared_mutex> trava(img.travaDentries);
+  if (!img.dentries.completo[d])
+  {
+    carregarDiretorio(img, d);
+  }
+  auto it = img.dentries.filhos.find(chave);
+  return it == img.dentries.filhos.end() ? -1 : it->second;
+}
+
+/**
+ * @brief Resolve um caminho absoluto até o inode correspondente. Cada diretório fica travado para leitura
+ * enquanto o componente seguinte é procurado nele, e só é destravado depois que o filho for travado.
+ * Deve ser chamada com a árvore travada e sem nenhum inode travado pela thread.
+ * @param img imagem montada
+ * @param caminho caminho completo, ex: /dir/sub/arquivo.txt
+ * @param diretorio se true, o último componente também precisa ser um diretório
+ * @return inode do caminho (já destravado), ou -1 se algum componente não existir
+ */
+int resolverCaminho(Imagem &img, string_view caminho, bool diretorio = false)
+{
+  int atual = img.root;
+  shared_lock<shared_mutex> trava(img.travasInodes[atual]);
+  size_t inicio = 0;
+  while (inicio < caminho.size())
+  {
+    size_t fim = caminho.find('/', inicio);
+    if (fim == string_view::npos)
+    {
+      fim = caminho.size();
+    }
+    if (fim > inicio)
+    {
+      int filho = procurarFilho(img, atual, caminho.data() + inicio, fim - inicio);
+      if (filho == -1)
+      {
+        return -1;
+      }
+      shared_lock<shared_mutex> travaFilho(img.travasInodes[filho]);
+      trava.swap(travaFilho);
+      atual = filho;
+    }
+    inicio = fim + 1;
+  }
+  if (diretorio && tipoInode(img, atual) != 0x01)
+  {
+    return -1;
+  }
+  return atual;
+}
+
+/**
+ * @brief Indica se algum componente de um caminho, do primeiro ao último, é o inode procurado.
+ * Não trava os diretórios: deve ser chamada com a árvore travada com exclusividade.
+ * @param img imagem montada
+ * @param caminho caminho completo
+ * @param inode inode procurado
+ * @return true se o caminho passar pelo inode (os componentes que não existirem encerram a busca)
+ */
+bool caminhoPassaPor(Imagem &img, string_view caminho, int inode)
+{
+  int atual = img.root;
+  size_t inicio = 0;
+  while (inicio < caminho.size() && atual != -1)
+  {
+    size_t fim = caminho.find('/', inicio);
+    if (fim == string_view::npos)
+    {
+      fim = caminho.size();
+    }
+    if (fim > inicio)
+    {
+      atual = procurarFilho(img, atual, caminho.data() + inicio, fim - inicio);
+      if (atual == inode)
+      {
+        return true;
+      }
+    }
+    inicio = fim + 1;
+  }
+  return false;
+}
+
+/**
+ * @brief Resolve o diretório pai de um caminho e separa o último componente.
+ * @param img imagem montada
+ * @param caminho caminho completo, ex: /dir/sub/arquivo.txt
+ * @param nome recebe o último componente do caminho (uma visão sobre caminho), ex: arquivo.txt; vazio para a raiz,
+ * que não tem nome e não pode ser criada, removida nem movida
+ * @return inode do diretório pai (destravado, como em resolverCaminho), ou -1 se ele não existir ou não for um diretório
+ */
+int resolverPai(Imagem &img, string_view caminho, string_view &nome)
+{
+  while (caminho.size() > 1 && caminho.back() == '/')
+  {
+    caminho.remove_suffix(1);
+  }
+
+  size_t ultimaBarra = caminho.find_last_of('/');
+  if (ultimaBarra == string_view::npos)
+  {
+    return -1;
+  }
+  nome = caminho.substr(ultimaBarra + 1);
+
+  return resolverCaminho(img, caminho.substr(0, ultimaBarra), true);
+}
+
+#endif /* caminho_hpp */
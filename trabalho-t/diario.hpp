@@ -0,0 +1,407 @@
+#ifndef diario_hpp
+#define diario_hpp
+
+#include "imagem.hpp"
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Diário (journal) de metadados em modo ordenado, guardado em um arquivo ao lado da imagem.
+// Metadados são o mapa de bits, os inodes e os blocos com entradas de diretório; blocos de dados
+// dos arquivos não passam pelo diário.
+//
+// Uma transação agrupa todas as alterações feitas desde a anterior e é confirmada assim:
+//   1. os blocos de dados alterados são gravados no lugar e sincronizados (modo ordenado:
+//      nenhum metadado confirmado aponta para dados que ainda não chegaram ao disco);
+//   2. os metadados alterados são acrescentados ao diário com um registro de commit e o diário
+//      é sincronizado, o que torna a transação durável;
+//   3. os metadados são gravados no lugar, sem sincronizar.
+// Se a gravação ou a sincronização do passo 1 ou do passo 2 falhar, a confirmação é abandonada antes do
+// passo 3: as alterações continuam pendentes (os blocos de dados voltam a ficar marcados) e nada chega
+// à imagem sem um commit durável que o cubra.
+// Um bloco liberado na transação aberta só pode ser reaproveitado depois do commit dela
+// (Imagem::liberadosNaTransacao): até lá, os metadados no disco ainda apontam para ele, e o passo 1 não
+// pode gravar dados por cima.
+// Com o cache de blocos, os blocos de metadados alterados ficam presos no cache até o passo 3, em vez
+// de serem gravados no lugar quando o quadro deles é despejado (cacheBlocos.hpp).
+// O passo 3 só precisa chegar ao disco no checkpoint, que sincroniza a imagem e esvazia o diário
+// quando ele passa de LIMITE_DIARIO bytes ou quando a sessão é fechada. Se o programa parar
+// antes disso, ou se uma gravação do passo 3 ou o checkpoint falhar, o diário fica no disco e as
+// transações confirmadas são reaplicadas na abertura seguinte, com ou sem FsOptions.journal; uma transação
+// sem commit válido (gravada pela metade) é descartada, junto com tudo o que vem depois dela.
+// Se a reaplicação não chegar ao disco, a abertura falha e o diário é mantido.
+//
+// Formato de uma transação (inteiros little-endian; o deslocamento tem 64 bits e os demais 32):
+//   "EXTJ" sequência quantidade
+//   quantidade x (deslocamento na imagem, tamanho, bytes)
+//   "CMIT" sequência soma      (soma FNV-1a de tudo desde "EXTJ" até o último registro)
+
+const char MAGICA_TRANSACAO[4] = {'E', 'X', 'T', 'J'};
+const char MAGICA_COMMIT[4] = {'C', 'M', 'I', 'T'};
+
+// Tamanho do diário a partir do qual é feito um checkpoint.
+const long LIMITE_DIARIO = 64 * 1024;
+
+// Diário aberto de uma sessão.
+struct Diario
+{
+  int fd = -1;
+  string caminho;
+  uint32_t sequencia = 0;
+
+  // Bytes gravados no diário desde o último checkpoint.
+  long tamanho = 0;
+
+  // Uma gravação do passo 3 falhou: o diário é a única cópia desses metadados e não pode mais ser esvaziado.
+  bool lugarIncompleto = false;
+
+  // Transação sendo montada e blocos de dados gravados no passo 1; reaproveitados entre confirmações.
+  vector<unsigned char> transacao;
+  vector<int> dados;
+};
+
+// Caminho do diário da imagem fsFileName.
+string caminhoDiario(const string &fsFileName)
+{
+  return fsFileName + ".journal";
+}
+
+// Acrescenta ao buffer um inteiro de 32 bits em little-endian.
+void acrescentarInteiro(vector<unsigned char> &buffer, uint32_t valor)
+{
+  valor = htole32(valor);
+  buffer.insert(buffer.end(), (unsigned char *)&valor, (unsigned char *)&valor + 4);
+}
+
+// Acrescenta ao buffer um inteiro de 64 bits em little-endian.
+void acrescentarInteiro64(vector<unsigned char> &buffer, uint64_t valor)
+{
+  valor = htole64(valor);
+  buffer.insert(buffer.end(), (unsigned char *)&valor, (unsigned char *)&valor + 8);
+}
+
+// Soma FNV-1a de 32 bits, usada para validar uma transação.
+uint32_t somaDiario(const unsigned char *p, size_t tamanho)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < tamanho; i++)
+  {
+    h = (h ^ p[i]) * 16777619u;
+  }
+  return h;
+}
+
+/**
+ * @brief Reaplica na imagem as transações confirmadas que estão no diário. Deve ser chamada antes de a imagem ser montada.
+ * @param fdImagem descritor do arquivo da imagem, aberto para escrita
+ * @param caminho caminho do diário
+ * @return quantidade de transações reaplicadas (0 se o diário não existir ou estiver vazio), ou -1 se o diário
+ * não pôde ser lido ou a reaplicação não chegou à imagem; nesse caso o diário não pode ser descartado
+ */
+int reproduzirDiario(int fdImagem, const string &caminho)
+{
+  int fd = open(caminho.c_str(), O_RDONLY);
+  if (fd == -1)
+  {
+    return errno == ENOENT ? 0 : -1;
+  }
+
+  struct stat info;
+  struct stat infoImagem;
+  if (fstat(fd, &info) != 0 || fstat(fdImagem, &infoImagem) != 0)
+  {
+    close(fd);
+    LOG_FS(LOG_ERRO, "Error reading file!\n");
+    return -1;
+  }
+  if (info.st_size == 0)
+  {
+    close(fd);
+    return 0;
+  }
+  vector<unsigned char> conteudo(info.st_size);
+  if (pread(fd, conteudo.data(), conteudo.size(), 0) != info.st_size)
+  {
+    close(fd);
+    LOG_FS(LOG_ERRO, "Error reading file!\n");
+    return -1;
+  }
+  close(fd);
+
+  int reaplicadas = 0;
+  size_t pos = 0;
+  while (pos + 12 <= conteudo.size() && memcmp(&conteudo[pos], MAGICA_TRANSACAO, 4) == 0)
+  {
+    size_t inicio = pos;
+    uint32_t sequencia = lerLE32(&conteudo[pos + 4]);
+    uint32_t quantidade = lerLE32(&conteudo[pos + 8]);
+    pos += 12;
+
+    // Confere se todos os registros estão inteiros e dentro da imagem.
+    bool valida = true;
+    for (uint32_t i = 0; i < quantidade && valida; i++)
+    {
+      if (pos + 12 > conteudo.size())
+      {
+        valida = false;
+        break;
+      }
+      uint64_t deslocamento = lerLE64(&conteudo[pos]);
+      uint32_t tamanho = lerLE32(&conteudo[pos + 8]);
+      valida = pos + 12 + tamanho <= conteudo.size() && deslocamento + tamanho <= (uint64_t)infoImagem.st_size;
+      pos += 12 + tamanho;
+    }
+    if (!valida || pos + 12 > conteudo.size() || memcmp(&conteudo[pos], MAGICA_COMMIT, 4) != 0 ||
+        lerLE32(&conteudo[pos + 4]) != sequencia ||
+        lerLE32(&conteudo[pos + 8]) != somaDiario(&conteudo[inicio], pos - inicio))
+    {
+      break;
+    }
+
+    // Transação confirmada: grava cada registro na sua posição da imagem.
+    size_t registro = inicio + 12;
+    for (uint32_t i = 0; i < quantidade; i++)
+    {
+      uint64_t deslocamento = lerLE64(&conteudo[registro]);
+      uint32_t tamanho = lerLE32(&conteudo[registro + 8]);
+      if (pwrite(fdImagem, &conteudo[registro + 12], tamanho, deslocamento) != (ssize_t)tamanho)
+      {
+        LOG_FS(LOG_ERRO, "Error writing file!\n");
+        return -1;
+      }
+      registro += 12 + tamanho;
+    }
+    pos += 12;
+    reaplicadas++;
+  }
+
+  if (reaplicadas > 0)
+  {
+    if (fdatasync(fdImagem) != 0)
+    {
+      LOG_FS(LOG_ERRO, "Error syncing file!\n");
+      return -1;
+    }
+    LOG_FS(LOG_INFO, "%d transações reaplicadas a partir de %s\n", reaplicadas, caminho.c_str());
+  }
+  return reaplicadas;
+}
+
+/**
+ * @brief Abre (ou cria) o diário da imagem, descartando o conteúdo anterior. Deve ser chamada depois de reproduzirDiario.
+ * @param diario diário a ser aberto
+ * @param caminho caminho do diário
+ * @return true se o diário pôde ser aberto
+ */
+bool abrirDiario(Diario &diario, const string &caminho)
+{
+  diario.fd = open(caminho.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (diario.fd == -1)
+  {
+    return false;
+  }
+  diario.caminho = caminho;
+  diario.sequencia = 0;
+  diario.tamanho = 0;
+  diario.lugarIncompleto = false;
+  return true;
+}
+
+// Acrescenta à transação os intervalos marcados em um conjunto sujo, um registro por sequência contígua.
+uint32_t registrarConjunto(Diario &diario, Imagem &img, ConjuntoSujo &conjunto, long inicio, long tamanho)
+{
+  uint32_t registros = 0;
+  percorrerIntervalos(conjunto, inicio, tamanho, [&](long i, long t)
+                      {
+                        acrescentarInteiro64(diario.transacao, i);
+                        acrescentarInteiro(diario.transacao, t);
+                        diario.transacao.insert(diario.transacao.end(), img.dados + i, img.dados + i + t);
+                        registros++; });
+  return registros;
+}
+
+// Acrescenta à transação os blocos marcados em um conjunto sujo de blocos, como registrarConjunto.
+// Com o cache de blocos, os bytes de cada bloco vêm do seu quadro.
+uint32_t registrarBlocos(Diario &diario, Imagem &img, ConjuntoSujo &conjunto)
+{
+  if (img.cache.capacidade == 0)
+  {
+    return registrarConjunto(diario, img, conjunto, offsetBlocos(img), img.blockSize);
+  }
+  uint32_t registros = 0;
+  percorrerIntervalos(conjunto, 0, 1, [&](long primeiro, long quantidade)
+                      {
+                        acrescentarInteiro64(diario.transacao, offsetBlocos(img) + primeiro * img.blockSize);
+                        acrescentarInteiro(diario.transacao, quantidade * img.blockSize);
+                        for (long b = primeiro; b < primeiro + quantidade; b++)
+                        {
+                          BlocoFixado bloco(img, b, LER_BLOCO);
+                          diario.transacao.insert(diario.transacao.end(), bloco.dados, bloco.dados + img.blockSize);
+                        }
+                        registros++; });
+  return registros;
+}
+
+/**
+ * @brief Sincroniza a imagem e esvazia o diário: a partir daqui as transações já confirmadas não precisam mais dele.
+ * @param img imagem montada
+ * @param diario diário aberto
+ * @return false se a imagem não pôde ser sincronizada ou o diário esvaziado (ele continua com as transações)
+ */
+bool checkpointDiario(Imagem &img, Diario &diario)
+{
+  if (diario.tamanho == 0)
+  {
+    return true;
+  }
+  if (diario.lugarIncompleto)
+  {
+    LOG_FS(LOG_ERRO, "Metadados confirmados não gravados no lugar; o diário será reaplicado na próxima abertura\n");
+    return false;
+  }
+  if (fdatasync(fileno(img.arquivo)) != 0)
+  {
+    LOG_FS(LOG_ERRO, "Error syncing file!\n");
+    return false;
+  }
+  if (ftruncate(diario.fd, 0) != 0)
+  {
+    LOG_FS(LOG_ERRO, "Error resizing file!\n");
+    return false;
+  }
+  diario.tamanho = 0;
+  return true;
+}
+
+/**
+ * @brief Confirma em uma única transação todas as alterações pendentes da imagem (ver o início do arquivo).
+ * Várias operações feitas entre duas confirmações dividem as mesmas duas sincronizações.
+ * @param img imagem montada (não mapeada)
+ * @param diario diário aberto
+ * @return false se a transação não pôde ser confirmada (as alterações continuam pendentes e nada foi gravado no lugar)
+ */
+bool confirmarTransacao(Imagem &img, Diario &diario)
+{
+  if (img.bitMapSujo.indices.empty() && img.inodesSujos.indices.empty() &&
+      img.blocosSujos.indices.empty() && img.diretoriosSujos.indices.empty())
+  {
+    return true;
+  }
+
+  // 1. Dados no lugar. Um bloco que também guarda entradas de diretório nesta transação
+  // vai pelo diário, para não sobrescrever antes do commit um diretório ainda em uso.
+  vector<int> &dados = img.blocosSujos.indices;
+  dados.erase(remove_if(dados.begin(), dados.end(), [&](int b)
+                        {
+                          if (img.diretoriosSujos.marcado[b])
+                          {
+                            img.blocosSujos.marcado[b] = 0;
+                            return true;
+                          }
+                          return false; }),
+              dados.end());
+  if (!dados.empty())
+  {
+    diario.dados.assign(dados.begin(), dados.end());
+    gravarBlocosSujos(img, img.blocosSujos);
+    bool gravados = concluirFila(img.fila);
+    if (!gravados || fdatasync(fileno(img.arquivo)) != 0)
+    {
+      LOG_FS(LOG_ERRO, "Error syncing file!\n");
+      remarcarBlocos(img, img.blocosSujos, diario.dados);
+      return false;
+    }
+  }
+
+  // 2. Metadados no diário, seguidos do commit.
+  diario.transacao.clear();
+  diario.transacao.insert(diario.transacao.end(), MAGICA_TRANSACAO, MAGICA_TRANSACAO + 4);
+  acrescentarInteiro(diario.transacao, diario.sequencia);
+  acrescentarInteiro(diario.transacao, 0);
+  uint32_t registros = registrarConjunto(diario, img, img.bitMapSujo, offsetBitMap(img), 1);
+  registros += registrarConjunto(diario, img, img.inodesSujos, offsetInodes(img), img.tamanhoInodeDisco);
+  registros += registrarBlocos(diario, img, img.diretoriosSujos);
+  uint32_t quantidade = htole32(registros);
+  memcpy(&diario.transacao[8], &quantidade, 4);
+  uint32_t soma = somaDiario(diario.transacao.data(), diario.transacao.size());
+  diario.transacao.insert(diario.transacao.end(), MAGICA_COMMIT, MAGICA_COMMIT + 4);
+  acrescentarInteiro(diario.transacao, diario.sequencia);
+  acrescentarInteiro(diario.transacao, soma);
+
+  // Sem o commit durável, nada vai para o lugar. Um registro gravado pela metade é sobrescrito pela próxima
+  // tentativa e, se ela não vier, é descartado na reaplicação, porque não tem commit válido.
+  ssize_t tamanho = diario.transacao.size();
+  if (pwrite(diario.fd, diario.transacao.data(), tamanho, diario.tamanho) != tamanho)
+  {
+    LOG_FS(LOG_ERRO, "Error writing file!\n");
+    return false;
+  }
+  if (fdatasync(diario.fd) != 0)
+  {
+    LOG_FS(LOG_ERRO, "Error syncing file!\n");
+    return false;
+  }
+  TRACE_FS(TRACE_TRANSACAO, -1, diario.sequencia, tamanho);
+  diario.tamanho += tamanho;
+  diario.sequencia++;
+
+  // O mapa de bits confirmado já mostra livres os blocos liberados nesta transação, que podem ser reaproveitados.
+  fill(img.liberadosNaTransacao.begin(), img.liberadosNaTransacao.end(), 0);
+
+  // 3. Metadados no lugar; chegam ao disco no próximo checkpoint.
+  gravarConjunto(img, img.bitMapSujo, offsetBitMap(img), 1);
+  gravarConjunto(img, img.inodesSujos, offsetInodes(img), img.tamanhoInodeDisco);
+  gravarBlocosSujos(img, img.diretoriosSujos);
+  if (!concluirFila(img.fila))
+  {
+    diario.lugarIncompleto = true;
+  }
+  if (img.cache.capacidade != 0)
+  {
+    reduzirCache(img.cache);
+  }
+
+  if (diario.tamanho >= LIMITE_DIARIO)
+  {
+    checkpointDiario(img, diario);
+  }
+  return true;
+}
+
+/**
+ * @brief Confirma as alterações pendentes, faz o checkpoint e apaga o diário. Se a última transação não puder
+ * ser confirmada, as alterações dela são descartadas em vez de gravadas no lugar sem commit; se o checkpoint
+ * falhar, o diário fica no disco e é reaplicado na próxima abertura.
+ * @param img imagem montada
+ * @param diario diário aberto
+ * @return false se alguma alteração não pôde ser confirmada ou o checkpoint falhou
+ */
+bool fecharDiario(Imagem &img, Diario &diario)
+{
+  if (diario.fd == -1)
+  {
+    return true;
+  }
+  bool confirmada = confirmarTransacao(img, diario);
+  if (!confirmada)
+  {
+    LOG_FS(LOG_ERRO, "Alterações não confirmadas descartadas!\n");
+    descartarAlteracoes(img);
+  }
+  bool esvaziado = checkpointDiario(img, diario);
+  close(diario.fd);
+  diario.fd = -1;
+  if (esvaziado)
+  {
+    unlink(diario.caminho.c_str());
+  }
+  return confirmada && esvaziado;
+}
+
+#endif /* diario_hpp */
@@ -0,0 +1,268 @@
+#ifndef extent_hpp
+#define extent_hpp
+
+#include "imagem.hpp"
+#include "alocador.hpp"
+
+using namespace std;
+
+// Formato de inode com extents, opcional para arquivos (FsOptions.extents).
+// Um inode nesse formato tem IS_DIR = 0x02 e usa os nove ponteiros (DIRECT_BLOCKS,
+// INDIRECT_BLOCKS e DOUBLE_INDIRECT_BLOCKS, nessa ordem) para guardar a quantidade de extents
+// (ponteiro 0) e até MAX_EXTENTS pares (primeiro bloco, quantidade de blocos) nos ponteiros
+// 1 a 8. Cada extent é uma sequência de blocos consecutivos, então um arquivo gravado de uma
+// vez ocupa poucas sequências e é lido e gravado com poucas operações grandes. Os valores têm
+// a largura dos ponteiros do formato da imagem (formato.hpp).
+
+const unsigned char TIPO_EXTENTS = 0x02;
+const int MAX_EXTENTS = 4;
+
+// Quantidade de extents do inode.
+int quantidadeExtents(const Imagem &img, int inodeIndex)
+{
+  uint32_t quantidade = ponteiroInode(img, inodeIndex, 0);
+  return quantidade < (uint32_t)MAX_EXTENTS ? quantidade : MAX_EXTENTS;
+}
+
+// Primeiro bloco e quantidade de blocos do extent e.
+uint32_t inicioExtent(const Imagem &img, int inodeIndex, int e)
+{
+  return ponteiroInode(img, inodeIndex, 1 + 2 * e);
+}
+
+uint32_t tamanhoExtent(const Imagem &img, int inodeIndex, int e)
+{
+  return ponteiroInode(img, inodeIndex, 2 + 2 * e);
+}
+
+// Indica se o inode está no formato com extents.
+bool usaExtents(const Imagem &img, int inodeIndex)
+{
+  return tipoInode(img, inodeIndex) == TIPO_EXTENTS;
+}
+
+/**
+ * @brief Aloca a maior sequência de blocos livres consecutivos com até maximo blocos. Prefere a primeira
+ * sequência com maximo blocos a partir do cursor do grupo da thread; se não houver, usa a maior sequência livre da imagem.
+ * @param img imagem montada
+ * @param maximo quantidade de blocos desejada
+ * @param tamanho recebe a quantidade de blocos alocados
+ * @return primeiro bloco da sequência, ou -1 se não houver bloco livre
+ */
+int alocarSequencia(Imagem &img, int maximo, int &tamanho)
+{
+  TravaGrupos travas(img);
+  int b = reservarSequencia(img, maximo);
+  if (b != -1)
+  {
+    tamanho = maximo;
+    return b;
+  }
+
+  int melhor = -1;
+  tamanho = 0;
+  int i = procurarLivre(img, 0, img.numBlocks);
+  while (i != -1)
+  {
+    int fim = procurarUsado(img, i, img.numBlocks);
+    if (fim - i > tamanho)
+    {
+      melhor = i;
+      tamanho = fim - i;
+    }
+    i = procurarLivre(img, fim, img.numBlocks);
+  }
+  if (melhor == -1)
+  {
+    return -1;
+  }
+  for (int j = 0; j < tamanho; j++)
+  {
+    marcarBlocoUsado(img, melhor + j);
+  }
+  avancarCursor(img, melhor + tamanho);
+  return melhor;
+}
+
+// Libera os blocos de todos os extents do inode.
+void liberarExtents(Imagem &img, int inodeIndex)
+{
+  for (int e = 0; e < quantidadeExtents(img, inodeIndex); e++)
+  {
+    for (uint32_t j = 0; j < tamanhoExtent(img, inodeIndex, e); j++)
+    {
+      liberarBloco(img, inicioExtent(img, inodeIndex, e) + j);
+    }
+  }
+}
+
+// Acrescenta a blocos os blocos de todos os extents do inode, sem liberá-los.
+void coletarExtents(Imagem &img, int inodeIndex, vector<int> &blocos)
+{
+  for (int e = 0; e < quantidadeExtents(img, inodeIndex); e++)
+  {
+    for (uint32_t j = 0; j < tamanhoExtent(img, inodeIndex, e); j++)
+    {
+      blocos.push_back(inicioExtent(img, inodeIndex, e) + j);
+    }
+  }
+}
+
+/**
+ * @brief Aloca os blocos de um arquivo em até MAX_EXTENTS sequências e os grava no inode, que passa a usar o formato com extents.
+ * @param img imagem montada
+ * @param inodeIndex inode reservado para o arquivo, com os ponteiros zerados
+ * @param blocos quantidade de blocos do arquivo
+ * @return false se os blocos livres estiverem fragmentados demais (nada fica alocado nesse caso)
+ */
+bool alocarExtents(Imagem &img, int inodeIndex, int blocos)
+{
+  int quantidade = 0;
+  int restantes = blocos;
+  while (restantes > 0 && quantidade < MAX_EXTENTS)
+  {
+    // O tamanho de um extent também precisa caber em um ponteiro.
+    int tamanho;
+    int b = alocarSequencia(img, restantes < (long)maiorPonteiro(img) ? restantes : maiorPonteiro(img), tamanho);
+    if (b == -1)
+    {
+      break;
+    }
+    definirPonteiro(img, inodeIndex, 1 + 2 * quantidade, b);
+    definirPonteiro(img, inodeIndex, 2 + 2 * quantidade, tamanho);
+    quantidade++;
+    definirPonteiro(img, inodeIndex, 0, quantidade);
+    restantes -= tamanho;
+  }
+
+  if (restantes > 0)
+  {
+    liberarExtents(img, inodeIndex);
+    for (int k = 0; k < 1 + 2 * MAX_EXTENTS; k++)
+    {
+      definirPonteiro(img, inodeIndex, k, 0);
+    }
+    return false;
+  }
+  definirTipo(img, inodeIndex, TIPO_EXTENTS);
+  marcarInodeSujo(img, inodeIndex);
+  return true;
+}
+
+/**
+ * @brief Procura o extent que contém um bloco lógico do arquivo.
+ * @param img imagem montada
+ * @param inodeIndex inode no formato com extents
+ * @param logico índice do bloco dentro do arquivo
+ * @param fisico recebe o bloco físico correspondente
+ * @return quantidade de blocos consecutivos a partir de fisico até o fim do extent, ou 0 se o bloco não estiver mapeado
+ */
+int procurarExtent(Imagem &img, int inodeIndex, long logico, int &fisico)
+{
+  long inicio = 0;
+  for (int e = 0; e < quantidadeExtents(img, inodeIndex); e++)
+  {
+    long tamanho = tamanhoExtent(img, inodeIndex, e);
+    if (logico >= inicio && logico < inicio + tamanho)
+    {
+      fisico = inicioExtent(img, inodeIndex, e) + (logico - inicio);
+      return tamanho - (logico - inicio);
+    }
+    inicio += tamanho;
+  }
+  return 0;
+}
+
+/**
+ * @brief Libera os blocos lógicos a partir de blocos: extents inteiros além desse ponto são descartados e o extent
+ * que o contém é encurtado.
+ * @param img imagem montada
+ * @param inodeIndex inode no formato com extents
+ * @param blocos quantidade de blocos que o arquivo mantém
+ */
+void encolherExtents(Imagem &img, int inodeIndex, long blocos)
+{
+  long inicio = 0;
+  int quantidade = 0;
+  for (int e = 0; e < quantidadeExtents(img, inodeIndex); e++)
+  {
+    long tamanho = tamanhoExtent(img, inodeIndex, e);
+    long manter = blocos - inicio;
+    if (manter < 0)
+    {
+      manter = 0;
+    }
+    for (long j = manter; j < tamanho; j++)
+    {
+      liberarBloco(img, inicioExtent(img, inodeIndex, e) + j);
+    }
+    if (manter < tamanho)
+    {
+      definirPonteiro(img, inodeIndex, 2 + 2 * e, manter);
+    }
+    if (manter > 0)
+    {
+      quantidade = e + 1;
+    }
+    inicio += tamanho;
+  }
+  for (int k = 1 + 2 * quantidade; k < 1 + 2 * MAX_EXTENTS; k++)
+  {
+    definirPonteiro(img, inodeIndex, k, 0);
+  }
+  definirPonteiro(img, inodeIndex, 0, quantidade);
+  marcarInodeSujo(img, inodeIndex);
+}
+
+/**
+ * @brief Aumenta um arquivo no formato com extents até blocos blocos. O último extent cresce enquanto o bloco
+ * seguinte a ele estiver livre; o restante vai para novos extents.
+ * @param img imagem montada
+ * @param inodeIndex inode no formato com extents
+ * @param blocos nova quantidade de blocos do arquivo
+ * @return false se faltarem blocos livres ou extents (o arquivo volta ao tamanho anterior nesse caso)
+ */
+bool crescerExtents(Imagem &img, int inodeIndex, long blocos)
+{
+  long atual = 0;
+  int quantidade = quantidadeExtents(img, inodeIndex);
+  for (int e = 0; e < quantidade; e++)
+  {
+    atual += tamanhoExtent(img, inodeIndex, e);
+  }
+  long original = atual;
+
+  while (atual < blocos)
+  {
+    if (quantidade > 0)
+    {
+      int e = quantidade - 1;
+      uint32_t tamanho = tamanhoExtent(img, inodeIndex, e);
+      uint32_t seguinte = inicioExtent(img, inodeIndex, e) + tamanho;
+      if (tamanho < maiorPonteiro(img) && seguinte < img.numBlocks && reservarBloco(img, seguinte))
+      {
+        definirPonteiro(img, inodeIndex, 2 + 2 * e, tamanho + 1);
+        atual++;
+        continue;
+      }
+    }
+
+    int tamanho;
+    long desejado = blocos - atual < (long)maiorPonteiro(img) ? blocos - atual : maiorPonteiro(img);
+    int b = quantidade < MAX_EXTENTS ? alocarSequencia(img, desejado, tamanho) : -1;
+    if (b == -1)
+    {
+      encolherExtents(img, inodeIndex, original);
+      return false;
+    }
+    definirPonteiro(img, inodeIndex, 1 + 2 * quantidade, b);
+    definirPonteiro(img, inodeIndex, 2 + 2 * quantidade, tamanho);
+    quantidade++;
+    definirPonteiro(img, inodeIndex, 0, quantidade);
+    atual += tamanho;
+  }
+  marcarInodeSujo(img, inodeIndex);
+  return true;
+}
+
+#endif /* extent_hpp */
@@ -0,0 +1,359 @@
+#ifndef filaES_hpp
+#define filaES_hpp
+
+#include "log.hpp"
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <vector>
+
+#ifndef FS_IO_URING
+#define FS_IO_URING 0
+#endif
+
+#if FS_IO_URING
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+// Fila das gravações de uma confirmação (gravarImagem, confirmarTransacao). As gravações no lugar de
+// uma confirmação são muitas e independentes (bytes do mapa de bits, inodes, sequências de blocos),
+// então são enfileiradas e enviadas juntas por concluirFila, em vez de uma chamada ao sistema cada.
+//
+// Com io_uring (FS_IO_URING na compilação e FsOptions.ioUring na montagem), concluirFila coloca todas
+// no anel de submissão e as envia e espera com uma só chamada a io_uring_enter (uma por anel cheio).
+// Sem ele, ou se o kernel não permitir criar o anel, cada gravação vira uma chamada a pwritev, na mesma
+// ordem. O anel é usado direto pelas chamadas ao sistema, sem liburing.
+//
+// Os buffers enfileirados não podem mudar nem ser liberados até concluirFila. A fila é usada só pela
+// confirmação, com a árvore travada com exclusividade. As leituras não passam pela fila: quem lê um
+// bloco espera por ele na hora (cacheBlocos.hpp), e o envio seria uma chamada do mesmo jeito.
+
+// Quantidade de entradas do anel de submissão.
+const unsigned ENTRADAS_ANEL = 256;
+
+// Gravação enfileirada: quantidade iovecs a partir de vetores[primeiro], na posição do arquivo.
+struct PedidoES
+{
+  int fd;
+  long posicao;
+  size_t primeiro;
+  int quantidade;
+  ssize_t tamanho;
+};
+
+#if FS_IO_URING
+// Anel do io_uring mapeado na memória do processo: ponteiros para os campos dos anéis de submissão
+// (sq) e de conclusão (cq) e o vetor de entradas de submissão.
+struct AnelES
+{
+  int fd = -1;
+  unsigned *sqCabeca = NULL;
+  unsigned *sqCauda = NULL;
+  unsigned *sqMascara = NULL;
+  unsigned *sqIndices = NULL;
+  io_uring_sqe *entradas = NULL;
+  unsigned *cqCabeca = NULL;
+  unsigned *cqCauda = NULL;
+  unsigned *cqMascara = NULL;
+  io_uring_cqe *conclusoes = NULL;
+  unsigned quantidade = 0;
+
+  void *sqMapa = NULL;
+  size_t sqTamanho = 0;
+  void *cqMapa = NULL;
+  size_t cqTamanho = 0;
+  size_t entradasTamanho = 0;
+};
+#endif
+
+struct FilaES
+{
+  vector<PedidoES> pedidos;
+  vector<iovec> vetores;
+
+#if FS_IO_URING
+  AnelES anel;
+#endif
+
+  // Chamadas ao sistema feitas para enviar as gravações (io_uring_enter ou pwritev) e gravações enviadas.
+  uint64_t envios = 0;
+  uint64_t gravacoes = 0;
+};
+
+#if FS_IO_URING
+// Desfaz os mapeamentos e fecha o anel.
+void fecharAnel(AnelES &anel)
+{
+  if (anel.entradas != NULL)
+  {
+    munmap(anel.entradas, anel.entradasTamanho);
+  }
+  if (anel.cqMapa != NULL && anel.cqMapa != anel.sqMapa)
+  {
+    munmap(anel.cqMapa, anel.cqTamanho);
+  }
+  if (anel.sqMapa != NULL)
+  {
+    munmap(anel.sqMapa, anel.sqTamanho);
+  }
+  if (anel.fd != -1)
+  {
+    close(anel.fd);
+  }
+  anel = AnelES();
+}
+
+// Cria o anel com io_uring_setup e mapeia as suas três regiões. Retorna false se o kernel não permitir.
+bool abrirAnel(AnelES &anel, unsigned entradas)
+{
+  io_uring_params parametros;
+  memset(&parametros, 0, sizeof(parametros));
+  anel.fd = syscall(__NR_io_uring_setup, entradas, &parametros);
+  if (anel.fd < 0)
+  {
+    anel.fd = -1;
+    return false;
+  }
+
+  anel.sqTamanho = parametros.sq_off.array + parametros.sq_entries * sizeof(unsigned);
+  anel.cqTamanho = parametros.cq_off.cqes + parametros.cq_entries * sizeof(io_uring_cqe);
+  bool unico = parametros.features & IORING_FEAT_SINGLE_MMAP;
+  if (unico)
+  {
+    anel.sqTamanho = anel.cqTamanho = anel.sqTamanho > anel.cqTamanho ? anel.sqTamanho : anel.cqTamanho;
+  }
+  anel.sqMapa = mmap(NULL, anel.sqTamanho, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, anel.fd, IORING_OFF_SQ_RING);
+  anel.cqMapa = unico ? anel.sqMapa : mmap(NULL, anel.cqTamanho, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, anel.fd, IORING_OFF_CQ_RING);
+  anel.entradasTamanho = parametros.sq_entries * sizeof(io_uring_sqe);
+  void *entradasMapa = mmap(NULL, anel.entradasTamanho, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, anel.fd, IORING_OFF_SQES);
+  if (anel.sqMapa == MAP_FAILED || anel.cqMapa == MAP_FAILED || entradasMapa == MAP_FAILED)
+  {
+    anel.sqMapa = anel.sqMapa == MAP_FAILED ? NULL : anel.sqMapa;
+    anel.cqMapa = anel.cqMapa == MAP_FAILED ? NULL : anel.cqMapa;
+    anel.entradas = entradasMapa == MAP_FAILED ? NULL : (io_uring_sqe *)entradasMapa;
+    fecharAnel(anel);
+    return false;
+  }
+
+  unsigned char *sq = (unsigned char *)anel.sqMapa;
+  unsigned char *cq = (unsigned char *)anel.cqMapa;
+  anel.sqCabeca = (unsigned *)(sq + parametros.sq_off.head);
+  anel.sqCauda = (unsigned *)(sq + parametros.sq_off.tail);
+  anel.sqMascara = (unsigned *)(sq + parametros.sq_off.ring_mask);
+  anel.sqIndices = (unsigned *)(sq + parametros.sq_off.array);
+  anel.entradas = (io_uring_sqe *)entradasMapa;
+  anel.cqCabeca = (unsigned *)(cq + parametros.cq_off.head);
+  anel.cqCauda = (unsigned *)(cq + parametros.cq_off.tail);
+  anel.cqMascara = (unsigned *)(cq + parametros.cq_off.ring_mask);
+  anel.conclusoes = (io_uring_cqe *)(cq + parametros.cq_off.cqes);
+  anel.quantidade = parametros.sq_entries;
+  return true;
+}
+#endif
+
+/**
+ * @brief Prepara a fila de gravações de uma imagem montada.
+ * @param fila fila a ser preparada
+ * @param usarAnel tenta criar o anel do io_uring (sem efeito em binários compilados sem FS_IO_URING)
+ * @return true se as gravações vão pelo io_uring
+ */
+bool iniciarFila(FilaES &fila, bool usarAnel)
+{
+  fila.pedidos.clear();
+  fila.vetores.clear();
+  fila.envios = 0;
+  fila.gravacoes = 0;
+#if FS_IO_URING
+  if (usarAnel && !abrirAnel(fila.anel, ENTRADAS_ANEL))
+  {
+    LOG_FS(LOG_AVISO, "io_uring indisponível; as gravações serão síncronas\n");
+  }
+  return fila.anel.fd != -1;
+#else
+  (void)usarAnel;
+  return false;
+#endif
+}
+
+// Indica se as gravações da fila vão pelo io_uring.
+bool filaUsaAnel(const FilaES &fila)
+{
+#if FS_IO_URING
+  return fila.anel.fd != -1;
+#else
+  (void)fila;
+  return false;
+#endif
+}
+
+// Enfileira a gravação de quantidade buffers (iovecs) consecutivos na posição do arquivo fd.
+void enfileirarGravacao(FilaES &fila, int fd, long posicao, const iovec *vetores, int quantidade)
+{
+  PedidoES pedido = {fd, posicao, fila.vetores.size(), quantidade, 0};
+  for (int i = 0; i < quantidade; i++)
+  {
+    fila.vetores.push_back(vetores[i]);
+    pedido.tamanho += vetores[i].iov_len;
+  }
+  fila.pedidos.push_back(pedido);
+}
+
+// Grava um pedido com pwritev. Retorna false se a gravação falhou ou ficou incompleta.
+bool gravarPedido(FilaES &fila, const PedidoES &pedido)
+{
+  fila.envios++;
+  if (pwritev(pedido.fd, &fila.vetores[pedido.primeiro], pedido.quantidade, pedido.posicao) != pedido.tamanho)
+  {
+    LOG_FS(LOG_ERRO, "Error writing file!\n");
+    return false;
+  }
+  return true;
+}
+
+#if FS_IO_URING
+// Retira do anel de conclusão os pedidos terminados e retorna quantos foram retirados. Com refazer,
+// um pedido que falhou ou ficou incompleto é refeito com pwritev, e gravados fica false se a regravação também falhar.
+unsigned colherConclusoes(FilaES &fila, bool refazer, bool &gravados)
+{
+  AnelES &anel = fila.anel;
+  unsigned colhidos = 0;
+  unsigned cabeca = *anel.cqCabeca;
+  while (cabeca != __atomic_load_n(anel.cqCauda, __ATOMIC_ACQUIRE))
+  {
+    io_uring_cqe &conclusao = anel.conclusoes[cabeca & *anel.cqMascara];
+    const PedidoES &pedido = fila.pedidos[conclusao.user_data];
+    if (refazer && conclusao.res != pedido.tamanho && !gravarPedido(fila, pedido))
+    {
+      gravados = false;
+    }
+    cabeca++;
+    colhidos++;
+  }
+  __atomic_store_n(anel.cqCabeca, cabeca, __ATOMIC_RELEASE);
+  return colhidos;
+}
+
+// Envia pelo anel os pedidos [inicio, fim), no máximo anel.quantidade, e espera todos terminarem com uma
+// chamada a io_uring_enter. Um pedido que falhar ou ficar incompleto é refeito com pwritev. Retorna false
+// se algum deles não pôde ser gravado nem assim.
+bool enviarPeloAnel(FilaES &fila, size_t inicio, size_t fim)
+{
+  AnelES &anel = fila.anel;
+  bool gravados = true;
+  unsigned cabecaInicial = __atomic_load_n(anel.sqCabeca, __ATOMIC_ACQUIRE);
+  unsigned cauda = *anel.sqCauda;
+  for (size_t i = inicio; i < fim; i++)
+  {
+    const PedidoES &pedido = fila.pedidos[i];
+    unsigned posicao = cauda & *anel.sqMascara;
+    io_uring_sqe &entrada = anel.entradas[posicao];
+    memset(&entrada, 0, sizeof(entrada));
+    entrada.opcode = IORING_OP_WRITEV;
+    entrada.fd = pedido.fd;
+    entrada.off = pedido.posicao;
+    entrada.addr = (uint64_t)(uintptr_t)&fila.vetores[pedido.primeiro];
+    entrada.len = pedido.quantidade;
+    entrada.user_data = i;
+    anel.sqIndices[posicao] = posicao;
+    cauda++;
+  }
+  __atomic_store_n(anel.sqCauda, cauda, __ATOMIC_RELEASE);
+
+  unsigned enviar = fim - inicio;
+  unsigned concluidos = 0;
+  while (concluidos < fim - inicio)
+  {
+    fila.envios++;
+    int enviados = syscall(__NR_io_uring_enter, anel.fd, enviar, (fim - inicio) - concluidos, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (enviados < 0 && errno != EINTR)
+    {
+      break;
+    }
+    enviar -= enviados > 0 ? enviados : 0;
+    concluidos += colherConclusoes(fila, true, gravados);
+  }
+
+  if (concluidos < fim - inicio)
+  {
+    // O anel parou de aceitar envios. Os pedidos que o kernel já recebeu podem estar em andamento e
+    // terminar depois de uma regravação, então todos são esperados antes (pelo anel de conclusão, se
+    // io_uring_enter não puder esperar). Depois os pedidos deste envio são refeitos de forma síncrona
+    // (gravar de novo o mesmo conteúdo na mesma posição não muda o resultado), e os próximos não usam mais o anel.
+    unsigned recebidos = __atomic_load_n(anel.sqCabeca, __ATOMIC_ACQUIRE) - cabecaInicial;
+    while (concluidos < recebidos)
+    {
+      concluidos += colherConclusoes(fila, false, gravados);
+      if (concluidos < recebidos &&
+          syscall(__NR_io_uring_enter, anel.fd, 0, recebidos - concluidos, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+      {
+        sched_yield();
+      }
+    }
+    LOG_FS(LOG_AVISO, "io_uring falhou; as gravações serão síncronas\n");
+    gravados = true;
+    for (size_t i = inicio; i < fim; i++)
+    {
+      gravados = gravarPedido(fila, fila.pedidos[i]) && gravados;
+    }
+    fecharAnel(anel);
+  }
+  return gravados;
+}
+#endif
+
+/**
+ * @brief Envia as gravações enfileiradas e espera todas terminarem; depois disso os buffers podem mudar.
+ * Uma gravação que falha não interrompe as outras.
+ * @param fila fila de gravações
+ * @return false se alguma gravação falhou ou ficou incompleta
+ */
+bool concluirFila(FilaES &fila)
+{
+  fila.gravacoes += fila.pedidos.size();
+  bool gravados = true;
+#if FS_IO_URING
+  if (fila.anel.fd != -1)
+  {
+    for (size_t inicio = 0; inicio < fila.pedidos.size() && fila.anel.fd != -1; inicio += fila.anel.quantidade)
+    {
+      size_t fim = inicio + fila.anel.quantidade < fila.pedidos.size() ? inicio + fila.anel.quantidade : fila.pedidos.size();
+      gravados = enviarPeloAnel(fila, inicio, fim) && gravados;
+      if (fila.anel.fd == -1)
+      {
+        for (size_t i = fim; i < fila.pedidos.size(); i++)
+        {
+          gravados = gravarPedido(fila, fila.pedidos[i]) && gravados;
+        }
+      }
+    }
+    fila.pedidos.clear();
+    fila.vetores.clear();
+    return gravados;
+  }
+#endif
+  for (const PedidoES &pedido : fila.pedidos)
+  {
+    gravados = gravarPedido(fila, pedido) && gravados;
+  }
+  fila.pedidos.clear();
+  fila.vetores.clear();
+  return gravados;
+}
+
+// Envia o que estiver pendente e fecha o anel, se houver.
+void fecharFila(FilaES &fila)
+{
+  concluirFila(fila);
+#if FS_IO_URING
+  fecharAnel(fila.anel);
+#endif
+}
+
+#endif /* filaES_hpp */
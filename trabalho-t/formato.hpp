@@ -0,0 +1,85 @@
+#ifndef formato_hpp
+#define formato_hpp
+
+#include "fs.h"
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+// Formatos de imagem.
+//
+// v1 (fs.h): [blockSize:1][numBlocks:1][numInodes:1][mapa de bits][INODE x numInodes][root:1][blocos]
+//   Campos de um byte: no máximo 255 blocos e inodes, ponteiros de um byte e arquivos de até 255 bytes.
+//
+// v2: [superbloco:32][mapa de bits][INODE_V2 x numInodes][blocos]
+//   Superbloco (inteiros little-endian):
+//     0  magica "\0EX3"   o primeiro byte 0x00 distingue do v1, cujo blockSize nunca é 0
+//     4  versao (2)
+//     8  blockSize
+//     12 numBlocks
+//     16 numInodes
+//     20 root
+//     24 reservado
+//   Ponteiros de blocos (nos inodes, nas tabelas indiretas e nas entradas de diretório) têm
+//   32 bits e SIZE tem 64 bits. O mapa de bits tem o mesmo formato do v1.
+//   blockSize, numBlocks e numInodes vão até MAIOR_CAMPO_V2: o motor usa int para índices de blocos e inodes.
+//
+// O restante do código não acessa INODE nem INODE_V2 diretamente: usa as funções de acesso de
+// imagem.hpp, que leem e gravam os campos na largura do formato montado.
+
+const unsigned char MAGICA_V2[4] = {0x00, 'E', 'X', '3'};
+const uint32_t VERSAO_V2 = 2;
+const long TAMANHO_SUPERBLOCO_V1 = 3;
+const long TAMANHO_SUPERBLOCO_V2 = 32;
+const uint32_t MAIOR_CAMPO_V2 = INT32_MAX;
+
+// Inode do formato v2, gravado em little-endian. Os campos têm a mesma ordem de INODE; a posição
+// de IS_USED, IS_DIR e NAME é a mesma nos dois formatos.
+typedef struct
+{
+  unsigned char IS_USED;
+  unsigned char IS_DIR;
+  char NAME[10];
+  uint32_t RESERVADO;
+  uint64_t SIZE;
+  uint32_t DIRECT_BLOCKS[3];
+  uint32_t INDIRECT_BLOCKS[3];
+  uint32_t DOUBLE_INDIRECT_BLOCKS[3];
+  uint32_t RESERVADO2;
+} INODE_V2;
+
+static_assert(sizeof(INODE) == 22, "INODE do formato v1 precisa ter 22 bytes");
+static_assert(sizeof(INODE_V2) == 64, "INODE_V2 precisa ter 64 bytes");
+
+// Os nove ponteiros de um inode, na ordem em que aparecem: 3 diretos, 3 indiretos e 3 duplamente indiretos.
+const int PONTEIRO_INDIRETO = 3;
+const int PONTEIRO_DUPLO = 6;
+
+// Leitura e gravação de inteiros little-endian em posições sem alinhamento.
+uint32_t lerLE32(const unsigned char *p)
+{
+  uint32_t valor;
+  memcpy(&valor, p, 4);
+  return le32toh(valor);
+}
+
+uint64_t lerLE64(const unsigned char *p)
+{
+  uint64_t valor;
+  memcpy(&valor, p, 8);
+  return le64toh(valor);
+}
+
+void gravarLE32(unsigned char *p, uint32_t valor)
+{
+  valor = htole32(valor);
+  memcpy(p, &valor, 4);
+}
+
+void gravarLE64(unsigned char *p, uint64_t valor)
+{
+  valor = htole64(valor);
+  memcpy(p, &valor, 8);
+}
+
+#endif /* formato_hpp */
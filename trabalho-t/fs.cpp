@@ -1,4 +1,64 @@
 #include "auxFunction.hpp"
+#include "fsHandle.h"
+#include "lote.hpp"
+#include "diario.hpp"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+
+// Sessão aberta por openFs: a imagem montada fica residente até closeFs.
+// As operações podem ser chamadas por várias threads ao mesmo tempo (ver travas.hpp).
+struct FsHandle
+{
+	Imagem imagem;
+
+	// Diário de metadados (fd == -1 quando a sessão foi aberta sem journal).
+	Diario diario;
+	int groupCommit = 0;
+	atomic<int> operacoesPendentes{0};
+};
+
+// Grava as alterações pendentes: pelo diário, se houver, ou direto na imagem. Espera as operações
+// em andamento terminarem, para gravar um estado em que nenhuma está pela metade.
+// Retorna false se a transação do diário não pôde ser confirmada (as alterações continuam pendentes).
+static bool gravarSessao(FsHandle *fs)
+{
+	unique_lock<shared_mutex> arvore(fs->imagem.travaArvore);
+	bool gravada = true;
+	if (fs->diario.fd != -1)
+	{
+		gravada = confirmarTransacao(fs->imagem, fs->diario);
+	}
+	else
+	{
+		gravarImagem(fs->imagem);
+	}
+	fs->operacoesPendentes = 0;
+	return gravada;
+}
+
+// Chamada ao fim de cada operação, já sem nenhuma trava: com group commit, confirma a transação a cada groupCommit
+// operações. Com o cache de blocos, confirma também quando os metadados presos pela transação o pressionam.
+static void operacaoConcluida(FsHandle *fs)
+{
+	int pendentes = ++fs->operacoesPendentes;
+	if (fs->diario.fd != -1 && ((fs->groupCommit > 0 && pendentes >= fs->groupCommit) || cachePressionado(fs->imagem.cache)))
+	{
+		gravarSessao(fs);
+	}
+}
+
+// Abre a sessão usada pelas funções de fs.h; encerra o programa se o arquivo não puder ser aberto.
+static FsHandle *abrirOuSair(const string &fsFileName)
+{
+	FsHandle *fs = openFs(fsFileName);
+	if (fs == NULL)
+	{
+		LOG_FS(LOG_ERRO, "Error opening file!\n");
+		exit(1);
+	}
+	return fs;
+}
 
 /**
  * @brief Inicializa um sistema de arquivos que simula EXT3
@@ -13,7 +73,7 @@ void initFs(string fsFileName, int blockSize, int numBlocks, int numInodes)
 	FILE *arquivo = fopen(fsFileName.c_str(), "wb+");
 	if (arquivo == NULL)
 	{
-		printf("Error opening file!\n");
+		LOG_FS(LOG_ERRO, "Error opening file!\n");
 		exit(1);
 	}
 
@@ -24,26 +84,42 @@ void initFs(string fsFileName, int blockSize, int numBlocks, int numInodes)
 }
 
 /**
- * @brief Adiciona um novo arquivo dentro do sistema de arquivos que simula EXT3. O sistema já deve ter sido inicializado.
- * @param fsFileName arquivo que contém um sistema de arquivos que simula EXT3.
- * @param filePath caminho completo novo arquivo dentro sistema de arquivos que simula EXT3.
- * @param fileContent conteúdo do novo arquivo
+ * @brief Inicializa um sistema de arquivos no formato v2 (ver fsHandle.h)
  */
-void addFile(string fsFileName, string filePath, string fileContent)
+void initFsV2(const string &fsFileName, uint32_t blockSize, uint32_t numBlocks, uint32_t numInodes)
 {
-	// Arquivo a ser aberto no modo r+
-	FILE *arquivo = fopen(fsFileName.c_str(), "r+");
+	if (blockSize < 4 || blockSize % 4 != 0 || numBlocks < 1 || numInodes < 1 ||
+	    blockSize > MAIOR_CAMPO_V2 || numBlocks > MAIOR_CAMPO_V2 || numInodes > MAIOR_CAMPO_V2)
+	{
+		LOG_FS(LOG_ERRO, "Geometria inválida!\n");
+		return;
+	}
+
+	FILE *arquivo = fopen(fsFileName.c_str(), "wb+");
 	if (arquivo == NULL)
 	{
-		printf("Error opening file!\n");
+		LOG_FS(LOG_ERRO, "Error opening file!\n");
 		exit(1);
 	}
 
-	adicionarArquivo(arquivo, filePath, fileContent);
+	inicializarV2(arquivo, blockSize, numBlocks, numInodes);
 
 	fclose(arquivo);
 }
 
+/**
+ * @brief Adiciona um novo arquivo dentro do sistema de arquivos que simula EXT3. O sistema já deve ter sido inicializado.
+ * @param fsFileName arquivo que contém um sistema de arquivos que simula EXT3.
+ * @param filePath caminho completo novo arquivo dentro sistema de arquivos que simula EXT3.
+ * @param fileContent conteúdo do novo arquivo
+ */
+void addFile(string fsFileName, string filePath, string fileContent)
+{
+	FsHandle *fs = abrirOuSair(fsFileName);
+	addFile(fs, filePath, fileContent);
+	closeFs(fs);
+}
+
 /**
  * @brief Adiciona um novo diretório dentro do sistema de arquivos que simula EXT3. O sistema já deve ter sido inicializado.
  * @param fsFileName arquivo que contém um sistema sistema de arquivos que simula EXT3.
@@ -51,17 +127,9 @@ void addFile(string fsFileName, string filePath, string fileContent)
  */
 void addDir(string fsFileName, string dirPath)
 {
-	// Arquivo a ser aberto no modo r+
-	FILE *arquivo = fopen(fsFileName.c_str(), "r+");
-	if (arquivo == NULL)
-	{
-		printf("Error opening file!\n");
-		exit(1);
-	}
-
-	adicionarDiretorio(arquivo, dirPath);
-
-	fclose(arquivo);
+	FsHandle *fs = abrirOuSair(fsFileName);
+	addDir(fs, dirPath);
+	closeFs(fs);
 }
 
 /**
@@ -71,17 +139,9 @@ void addDir(string fsFileName, string dirPath)
  */
 void remove(string fsFileName, string path)
 {
-    // Arquivo a ser aberto no modo r+
-    FILE *arquivo = fopen(fsFileName.c_str(), "r+");
-    if (arquivo == NULL)
-    {
-        printf("Error opening file!\n");
-        exit(1);
-    }
-
-    remover(arquivo, path);
-
-    fclose(arquivo);
+	FsHandle *fs = abrirOuSair(fsFileName);
+	remove(fs, path);
+	closeFs(fs);
 }
 
 /**
@@ -92,15 +152,364 @@ void remove(string fsFileName, string path)
  */
 void move(string fsFileName, string oldPath, string newPath)
 {
-    // Arquivo a ser aberto no modo r+
-    FILE *arquivo = fopen(fsFileName.c_str(), "r+");
-    if (arquivo == NULL)
-    {
-        printf("Error opening file!\n");
-        exit(1);
-    }
+	FsHandle *fs = abrirOuSair(fsFileName);
+	move(fs, oldPath, newPath);
+	closeFs(fs);
+}
+
+/**
+ * @brief Abre (monta) um sistema de arquivos que simula EXT3 já inicializado.
+ * @param fsFileName arquivo que contém um sistema sistema de arquivos que simula EXT3.
+ * @param options opções de montagem.
+ * @return handle da sessão, ou NULL se o arquivo não puder ser aberto ou lido, ou se a reaplicação do diário falhar.
+ */
+FsHandle *openFs(const string &fsFileName, FsOptions options)
+{
+	// Arquivo a ser aberto no modo r+
+	FILE *arquivo = fopen(fsFileName.c_str(), "r+");
+	if (arquivo == NULL)
+	{
+		return NULL;
+	}
+
+	// Com o diário, a imagem mapeada poderia ir para o disco antes do commit; com o cache de blocos,
+	// o cache de páginas do sistema já faz o papel do mapeamento.
+	if ((options.journal || options.cacheBlocks > 0) && options.useMmap)
+	{
+		fclose(arquivo);
+		return NULL;
+	}
+
+	// Transações confirmadas e ainda não aplicadas (sessão anterior interrompida ou checkpoint que falhou) vão para
+	// a imagem antes de montá-la, com ou sem diário nesta sessão: sem isso, a sessão gravaria por cima metadados
+	// que a próxima abertura com diário voltaria a sobrescrever com as transações antigas. Se a reaplicação falhar,
+	// o diário é a única cópia delas e a imagem não é montada.
+	if (reproduzirDiario(fileno(arquivo), caminhoDiario(fsFileName)) == -1)
+	{
+		fclose(arquivo);
+		return NULL;
+	}
+	if (!options.journal)
+	{
+		unlink(caminhoDiario(fsFileName).c_str());
+	}
+
+	FsHandle *fs = new FsHandle();
+	bool montada;
+	if (options.useMmap)
+	{
+		montada = montarImagemMapeada(fs->imagem, arquivo);
+	}
+	else if (options.cacheBlocks > 0)
+	{
+		montada = montarImagemComCache(fs->imagem, arquivo, options.cacheBlocks);
+	}
+	else
+	{
+		montada = montarImagem(fs->imagem, arquivo);
+	}
+	if (montada && options.journal)
+	{
+		montada = abrirDiario(fs->diario, caminhoDiario(fsFileName));
+		fs->imagem.liberadosNaTransacao.assign(palavrasBitMap(fs->imagem), 0);
+	}
+	if (!montada)
+	{
+		fclose(arquivo);
+		delete fs;
+		return NULL;
+	}
+	fs->groupCommit = options.groupCommit;
+	fs->imagem.usarExtents = options.extents;
+	fs->imagem.indexarDiretorios = options.hashedDirs;
+	fs->imagem.cache.prenderMetadados = options.journal;
+	iniciarFila(fs->imagem.fila, options.ioUring);
+	return fs;
+}
+
+void addFile(FsHandle *fs, const string &filePath, const string &fileContent)
+{
+	adicionarArquivo(fs->imagem, filePath, fileContent);
+	operacaoConcluida(fs);
+}
 
-    mover(arquivo, oldPath, newPath);
+void addDir(FsHandle *fs, const string &dirPath)
+{
+	adicionarDiretorio(fs->imagem, dirPath);
+	operacaoConcluida(fs);
+}
+
+void remove(FsHandle *fs, const string &path)
+{
+	remover(fs->imagem, path);
+	operacaoConcluida(fs);
+}
 
-    fclose(arquivo);
-}
\ No newline at end of file
+void move(FsHandle *fs, const string &oldPath, const string &newPath)
+{
+	mover(fs->imagem, oldPath, newPath);
+	operacaoConcluida(fs);
+}
+
+long readAt(FsHandle *fs, const string &filePath, uint64_t offset, void *buffer, size_t length)
+{
+	AcessoInode acesso;
+	int inodeIndex = procurarArquivo(fs->imagem, filePath, false, acesso);
+	if (inodeIndex == -1)
+	{
+		return -1;
+	}
+	return lerArquivo(fs->imagem, inodeIndex, offset, (unsigned char *)buffer, length);
+}
+
+bool readFile(FsHandle *fs, const string &filePath, string &content)
+{
+	AcessoInode acesso;
+	int inodeIndex = procurarArquivo(fs->imagem, filePath, false, acesso);
+	if (inodeIndex == -1)
+	{
+		return false;
+	}
+	content.resize(tamanhoInode(fs->imagem, inodeIndex));
+	lerArquivo(fs->imagem, inodeIndex, 0, (unsigned char *)&content[0], content.size());
+	return true;
+}
+
+bool writeAt(FsHandle *fs, const string &filePath, uint64_t offset, const void *buffer, size_t length)
+{
+	bool gravou;
+	{
+		AcessoInode acesso;
+		int inodeIndex = procurarArquivo(fs->imagem, filePath, true, acesso);
+		if (inodeIndex == -1)
+		{
+			return false;
+		}
+		gravou = gravarArquivo(fs->imagem, inodeIndex, offset, (const unsigned char *)buffer, length);
+	}
+	operacaoConcluida(fs);
+	return gravou;
+}
+
+bool append(FsHandle *fs, const string &filePath, const void *buffer, size_t length)
+{
+	bool gravou;
+	{
+		AcessoInode acesso;
+		int inodeIndex = procurarArquivo(fs->imagem, filePath, true, acesso);
+		if (inodeIndex == -1)
+		{
+			return false;
+		}
+		gravou = gravarArquivo(fs->imagem, inodeIndex, tamanhoInode(fs->imagem, inodeIndex), (const unsigned char *)buffer, length);
+	}
+	operacaoConcluida(fs);
+	return gravou;
+}
+
+bool truncate(FsHandle *fs, const string &filePath, uint64_t length)
+{
+	bool redimensionou;
+	{
+		AcessoInode acesso;
+		int inodeIndex = procurarArquivo(fs->imagem, filePath, true, acesso);
+		if (inodeIndex == -1)
+		{
+			return false;
+		}
+		redimensionou = redimensionarArquivo(fs->imagem, inodeIndex, length);
+	}
+	operacaoConcluida(fs);
+	return redimensionou;
+}
+
+// Preenche st com as informações do inode i.
+static void preencherStat(Imagem &img, int i, FsStat *st)
+{
+	size_t tamanhoNome = strnlen(nomeInode(img, i), 10);
+	memcpy(st->name, nomeInode(img, i), tamanhoNome);
+	st->name[tamanhoNome] = '\0';
+	st->inode = i;
+	st->isDir = tipoInode(img, i) == 0x01;
+	st->size = tamanhoInode(img, i);
+	st->blocks = contarBlocos(img, i);
+
+	// O primeiro bloco da raiz é o bloco 0, que o mapa de blocos não conta.
+	if (st->isDir && ponteiroInode(img, i, 0) == 0)
+	{
+		st->blocks++;
+	}
+}
+
+bool stat(FsHandle *fs, const string &path, FsStat *st)
+{
+	// O pai continua travado enquanto o nome é copiado.
+	AcessoInode acesso;
+	int inodeIndex = acessarInode(fs->imagem, path, false, true, acesso);
+	if (inodeIndex == -1)
+	{
+		// Consultar se um caminho existe é uso normal de stat: o resultado basta, sem erro no log.
+		LOG_FS(LOG_DEPURACAO, "Arquivo ou diretório não encontrado!\n");
+		return false;
+	}
+	preencherStat(fs->imagem, inodeIndex, st);
+	return true;
+}
+
+long listDir(FsHandle *fs, const string &dirPath, uint64_t offset, FsStat *entries, size_t capacity)
+{
+	Imagem &img = fs->imagem;
+	AcessoInode acesso;
+	int d = acessarInode(img, dirPath, false, false, acesso);
+	if (d == -1 || tipoInode(img, d) != 0x01)
+	{
+		LOG_FS(LOG_ERRO, "Diretório não encontrado!\n");
+		return -1;
+	}
+
+	// O diretório travado protege os nomes dos filhos; cada filho é travado enquanto o resto é lido.
+	uint64_t entradas = quantidadeEntradas(img, d);
+	long preenchidas = 0;
+	for (uint64_t pos = offset; pos < entradas && (size_t)preenchidas < capacity; pos++)
+	{
+		int filho = entradaDiretorio(img, d, pos);
+		shared_lock<shared_mutex> travaFilho(img.travasInodes[filho]);
+		preencherStat(img, filho, &entries[preenchidas]);
+		preenchidas++;
+	}
+	return preenchidas;
+}
+
+/**
+ * @brief Aplica um log de operações no sistema de arquivos montado e grava as alterações uma única vez, ao final.
+ * @param fs handle retornado por openFs.
+ * @param logFileName arquivo com o log de operações.
+ * @param entries se não for NULL, recebe o tempo de cada operação aplicada.
+ * @return quantidade de operações aplicadas, ou -1 se o log não puder ser aberto.
+ */
+int applyBatch(FsHandle *fs, const string &logFileName, vector<FsBatchEntry> *entries)
+{
+	ifstream log(logFileName);
+	if (!log.is_open())
+	{
+		LOG_FS(LOG_ERRO, "Error opening file!\n");
+		return -1;
+	}
+
+	int aplicadas = 0;
+	int numeroLinha = 0;
+	string linha;
+	while (getline(log, linha))
+	{
+		numeroLinha++;
+		OperacaoLote operacao = lerOperacao(linha);
+		if (operacao.tipo == OPERACAO_NENHUMA)
+		{
+			continue;
+		}
+		if (operacao.tipo == OPERACAO_INVALIDA)
+		{
+			LOG_FS(LOG_AVISO, "Operação inválida na linha %d!\n", numeroLinha);
+			continue;
+		}
+
+		auto inicio = chrono::steady_clock::now();
+		switch (operacao.tipo)
+		{
+		case OPERACAO_ADD_FILE:
+			adicionarArquivo(fs->imagem, operacao.primeiro, operacao.segundo);
+			break;
+		case OPERACAO_ADD_DIR:
+			adicionarDiretorio(fs->imagem, operacao.primeiro);
+			break;
+		case OPERACAO_REMOVE:
+			remover(fs->imagem, operacao.primeiro);
+			break;
+		default:
+			mover(fs->imagem, operacao.primeiro, operacao.segundo);
+			break;
+		}
+		auto fim = chrono::steady_clock::now();
+
+		operacaoConcluida(fs);
+
+		if (entries != NULL)
+		{
+			entries->push_back({numeroLinha, nomeOperacao(operacao.tipo), chrono::duration<double, nano>(fim - inicio).count()});
+		}
+		aplicadas++;
+	}
+
+	// Todas as operações compartilham uma única gravação.
+	gravarSessao(fs);
+	return aplicadas;
+}
+
+/**
+ * @brief Grava no arquivo as alterações pendentes da sessão, mantendo-a aberta.
+ * @param fs handle retornado por openFs.
+ */
+bool flushFs(FsHandle *fs)
+{
+	return gravarSessao(fs);
+}
+
+/**
+ * @brief Obtém os contadores do cache de blocos. A taxa de acerto é hits / (hits + misses).
+ * @param fs handle retornado por openFs.
+ * @param stats recebe os contadores.
+ * @return false se a sessão não usa o cache de blocos.
+ */
+bool cacheStats(FsHandle *fs, FsCacheStats *stats)
+{
+	CacheBlocos &cache = fs->imagem.cache;
+	if (cache.capacidade == 0)
+	{
+		return false;
+	}
+	stats->hits = cache.acertos;
+	stats->misses = cache.faltas;
+	stats->evictions = cache.despejos;
+	stats->writebacks = cache.gravacoesDespejo;
+	stats->readahead = cache.antecipados;
+	lock_guard<mutex> guarda(cache.trava);
+	stats->frames = cache.quadros.size();
+	return true;
+}
+
+/**
+ * @brief Obtém os contadores das gravações da sessão (ver fsHandle.h).
+ */
+void writeStats(FsHandle *fs, FsWriteStats *stats)
+{
+	shared_lock<shared_mutex> arvore(fs->imagem.travaArvore);
+	stats->ioUring = filaUsaAnel(fs->imagem.fila);
+	stats->submits = fs->imagem.fila.envios;
+	stats->writes = fs->imagem.fila.gravacoes;
+}
+
+/**
+ * @brief Grava as alterações pendentes e encerra a sessão. O handle não pode mais ser usado.
+ * @param fs handle retornado por openFs.
+ */
+void closeFs(FsHandle *fs)
+{
+	fecharDiario(fs->imagem, fs->diario);
+	desmontarImagem(fs->imagem);
+	delete fs;
+}
+
+void setLogLevel(int level)
+{
+	nivelLog = level;
+}
+
+void enableTrace(size_t capacity)
+{
+	habilitarTrace(capacity);
+}
+
+long dumpTrace(const string &fileName)
+{
+	return despejarTrace(fileName.c_str());
+}
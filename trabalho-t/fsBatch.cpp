@@ -0,0 +1,39 @@
+// Aplica um log de operações sobre uma imagem em uma única sessão e mostra o tempo de cada operação.
+// Uso: fsBatch <imagem> <log>
+#include "fsHandle.h"
+
+#include <cstdio>
+#include <vector>
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        printf("Uso: %s <imagem> <log>\n", argv[0]);
+        return 1;
+    }
+
+    FsHandle *fs = openFs(argv[1]);
+    if (fs == NULL)
+    {
+        printf("Error opening file!\n");
+        return 1;
+    }
+
+    std::vector<FsBatchEntry> entries;
+    int aplicadas = applyBatch(fs, argv[2], &entries);
+    closeFs(fs);
+    if (aplicadas == -1)
+    {
+        return 1;
+    }
+
+    double total = 0;
+    for (const FsBatchEntry &entry : entries)
+    {
+        printf("%6d %-8s %12.0f ns\n", entry.line, entry.operation, entry.latencyNs);
+        total += entry.latencyNs;
+    }
+    printf("%d operacoes, %.0f ns no total, %.0f ns/op\n", aplicadas, total, aplicadas > 0 ? total / aplicadas : 0.0);
+    return 0;
+}
@@ -0,0 +1,260 @@
+#ifndef fsHandle_h
+#define fsHandle_h
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Sessão sobre um sistema de arquivos que simula EXT3.
+ * A imagem é aberta e lida uma única vez por openFs(); as operações seguintes
+ * trabalham sobre a cópia residente em memória e apenas o que foi alterado é
+ * gravado de volta no arquivo por flushFs() ou closeFs(). Com cacheBlocks, só
+ * os metadados são lidos na abertura e os blocos passam por um cache de tamanho fixo.
+ * As operações de uma mesma sessão podem ser chamadas por várias threads ao mesmo tempo:
+ * operações em diretórios e arquivos diferentes rodam em paralelo; remover um diretório,
+ * mudar um diretório de pai, flushFs e applyBatch (ao gravar) esperam as demais terminarem.
+ * openFs e closeFs não podem ser chamadas junto com outras operações da mesma sessão.
+ */
+typedef struct FsHandle FsHandle;
+
+/**
+ * Opções de montagem da sessão.
+ */
+typedef struct {
+    bool useMmap = false;              // mapeia a imagem com mmap em vez de copiá-la para a memória
+    bool journal = false;              // confirma os metadados por um diário em <fsFileName>.journal (não pode ser usado com useMmap); blocos liberados só são reaproveitados depois do commit seguinte
+    int groupCommit = 0;               // com journal: operações por transação (0 = só em flushFs, applyBatch e closeFs; com cacheBlocks, também quando os metadados da transação ocupam metade do cache)
+    bool extents = false;              // grava arquivos novos como sequências de blocos contíguos (extents)
+    bool hashedDirs = false;           // remove entradas de diretório em O(1) pelo índice de nomes, sem preservar a ordem das entradas
+    int cacheBlocks = 0;               // mantém na memória no máximo cacheBlocks blocos, lidos sob demanda (0 = imagem inteira; não pode ser usado com useMmap)
+    bool ioUring = false;              // envia as gravações de cada flush juntas pelo io_uring (binários com FS_IO_URING; sem ele, ou se o kernel não permitir, são síncronas)
+} FsOptions;
+
+/**
+ * @brief Inicializa um sistema de arquivos no formato v2: superbloco com mágica e versão, campos de
+ * 32 bits, ponteiros de 32 bits e SIZE de 64 bits. openFs reconhece os dois formatos.
+ * @param fsFileName nome do arquivo que contém sistema de arquivos que simula EXT3 (caminho do arquivo no sistema de arquivos local)
+ * @param blockSize tamanho em bytes do bloco (múltiplo de 4)
+ * @param numBlocks quantidade de blocos
+ * @param numInodes quantidade de inodes
+ */
+void initFsV2(const std::string &fsFileName, uint32_t blockSize, uint32_t numBlocks, uint32_t numInodes);
+
+/**
+ * @brief Abre (monta) um sistema de arquivos que simula EXT3 já inicializado.
+ * @param fsFileName arquivo que contém um sistema sistema de arquivos que simula EXT3.
+ * @param options opções de montagem.
+ * Se houver um diário de uma sessão anterior, as transações confirmadas que ficaram nele são reaplicadas
+ * antes da montagem, com ou sem options.journal (sem ele, o diário é apagado em seguida).
+ * @return handle da sessão, ou NULL se o arquivo não puder ser aberto ou lido, ou se a reaplicação do diário falhar.
+ */
+FsHandle *openFs(const std::string &fsFileName, FsOptions options = FsOptions());
+
+/**
+ * @brief Adiciona um novo arquivo dentro do sistema de arquivos montado.
+ * @param fs handle retornado por openFs.
+ * @param filePath caminho completo novo arquivo dentro sistema de arquivos que simula EXT3.
+ * @param fileContent conteúdo do novo arquivo
+ */
+void addFile(FsHandle *fs, const std::string &filePath, const std::string &fileContent);
+
+/**
+ * @brief Adiciona um novo diretório dentro do sistema de arquivos montado.
+ * @param fs handle retornado por openFs.
+ * @param dirPath caminho completo novo diretório dentro sistema de arquivos que simula EXT3.
+ */
+void addDir(FsHandle *fs, const std::string &dirPath);
+
+/**
+ * @brief Remove um arquivo ou diretório (recursivamente) do sistema de arquivos montado.
+ * @param fs handle retornado por openFs.
+ * @param path caminho completo do arquivo ou diretório a ser removido.
+ */
+void remove(FsHandle *fs, const std::string &path);
+
+/**
+ * @brief Move um arquivo ou diretório no sistema de arquivos montado.
+ * @param fs handle retornado por openFs.
+ * @param oldPath caminho completo do arquivo ou diretório a ser movido.
+ * @param newPath novo caminho completo do arquivo ou diretório.
+ */
+void move(FsHandle *fs, const std::string &oldPath, const std::string &newPath);
+
+/**
+ * @brief Lê até length bytes de um arquivo, a partir de offset, direto para o buffer do chamador (como pread).
+ * @param fs handle retornado por openFs.
+ * @param filePath caminho completo do arquivo.
+ * @param offset posição do primeiro byte a ser lido.
+ * @param buffer buffer com pelo menos length bytes.
+ * @param length quantidade de bytes desejada.
+ * @return quantidade de bytes lidos (0 a partir do fim do arquivo), ou -1 se o arquivo não existir ou for um diretório.
+ */
+long readAt(FsHandle *fs, const std::string &filePath, uint64_t offset, void *buffer, size_t length);
+
+/**
+ * @brief Lê o conteúdo inteiro de um arquivo.
+ * @param fs handle retornado por openFs.
+ * @param filePath caminho completo do arquivo.
+ * @param content recebe o conteúdo; a capacidade já reservada é reaproveitada entre chamadas.
+ * @return false se o arquivo não existir ou for um diretório.
+ */
+bool readFile(FsHandle *fs, const std::string &filePath, std::string &content);
+
+/**
+ * @brief Grava length bytes em um arquivo existente a partir de offset (como pwrite). Só os blocos alcançados
+ * são alterados; se a gravação passar do fim, o arquivo cresce e o trecho entre o fim antigo e offset fica com 0x00.
+ * @param fs handle retornado por openFs.
+ * @param filePath caminho completo do arquivo.
+ * @param offset posição do primeiro byte a ser gravado.
+ * @param buffer bytes a serem gravados.
+ * @param length quantidade de bytes.
+ * @return false se o arquivo não existir, for um diretório ou não puder crescer.
+ */
+bool writeAt(FsHandle *fs, const std::string &filePath, uint64_t offset, const void *buffer, size_t length);
+
+/**
+ * @brief Acrescenta length bytes ao fim de um arquivo existente, alocando apenas os blocos novos.
+ * @param fs handle retornado por openFs.
+ * @param filePath caminho completo do arquivo.
+ * @param buffer bytes a serem acrescentados.
+ * @param length quantidade de bytes.
+ * @return false se o arquivo não existir, for um diretório ou não puder crescer.
+ */
+bool append(FsHandle *fs, const std::string &filePath, const void *buffer, size_t length);
+
+/**
+ * @brief Muda o tamanho de um arquivo existente. Os blocos depois do novo fim voltam ao mapa de bits;
+ * se o arquivo crescer, o conteúdo acrescentado é lido como 0x00.
+ * @param fs handle retornado por openFs.
+ * @param filePath caminho completo do arquivo.
+ * @param length novo tamanho em bytes.
+ * @return false se o arquivo não existir, for um diretório ou não puder crescer.
+ */
+bool truncate(FsHandle *fs, const std::string &filePath, uint64_t length);
+
+/**
+ * Informações de um arquivo ou diretório, preenchidas por stat e listDir.
+ */
+typedef struct {
+    char name[11];                     // nome (até 10 caracteres), terminado em '\0'
+    int inode;                         // índice do inode
+    bool isDir;                        // true para diretórios
+    uint64_t size;                     // tamanho em bytes, ou quantidade de entradas de um diretório
+    uint64_t blocks;                   // blocos ocupados, incluindo as tabelas de ponteiros
+} FsStat;
+
+/**
+ * @brief Obtém as informações de um arquivo ou diretório.
+ * @param fs handle retornado por openFs.
+ * @param path caminho completo do arquivo ou diretório.
+ * @param st recebe as informações.
+ * @return false se o caminho não existir.
+ */
+bool stat(FsHandle *fs, const std::string &path, FsStat *st);
+
+/**
+ * @brief Lista as entradas de um diretório a partir de uma posição, no estilo de readdir: cada chamada preenche
+ * até capacity entradas do buffer do chamador, sem alocar memória; para percorrer o diretório inteiro,
+ * chame de novo com offset somado à quantidade retornada até que ela seja 0.
+ * @param fs handle retornado por openFs.
+ * @param dirPath caminho completo do diretório.
+ * @param offset posição da primeira entrada desejada.
+ * @param entries buffer com pelo menos capacity entradas.
+ * @param capacity quantidade de entradas do buffer.
+ * @return quantidade de entradas preenchidas (0 a partir do fim da lista), ou -1 se o diretório não existir.
+ */
+long listDir(FsHandle *fs, const std::string &dirPath, uint64_t offset, FsStat *entries, size_t capacity);
+
+/**
+ * Tempo gasto por uma operação aplicada por applyBatch.
+ */
+typedef struct {
+    int line;                          // linha do log (a partir de 1)
+    const char *operation;             // addFile, addDir, remove ou move
+    double latencyNs;                  // tempo da operação, em nanossegundos
+} FsBatchEntry;
+
+/**
+ * @brief Aplica um log de operações no sistema de arquivos montado e grava as alterações uma única vez, ao final.
+ * O log tem uma operação por linha: "addFile <caminho> <conteúdo>", "addDir <caminho>",
+ * "remove <caminho>" ou "move <caminho antigo> <caminho novo>". Linhas vazias ou começadas por '#' são ignoradas,
+ * e linhas inválidas são informadas e puladas.
+ * @param fs handle retornado por openFs.
+ * @param logFileName arquivo com o log de operações.
+ * @param entries se não for NULL, recebe o tempo de cada operação aplicada.
+ * @return quantidade de operações aplicadas, ou -1 se o log não puder ser aberto.
+ */
+int applyBatch(FsHandle *fs, const std::string &logFileName, std::vector<FsBatchEntry> *entries = NULL);
+
+/**
+ * Contadores do cache de blocos de uma sessão aberta com cacheBlocks.
+ */
+typedef struct {
+    uint64_t hits;                     // acessos a blocos que já estavam no cache
+    uint64_t misses;                   // acessos que leram o bloco do arquivo
+    uint64_t evictions;                // blocos despejados para dar lugar a outros
+    uint64_t writebacks;               // blocos alterados gravados no arquivo ao serem despejados (com os vizinhos gravados junto)
+    uint64_t readahead;                // blocos lidos antecipadamente, junto com uma falta sequencial
+    uint64_t frames;                   // quadros (blocos) na memória agora
+} FsCacheStats;
+
+/**
+ * @brief Obtém os contadores do cache de blocos. A taxa de acerto é hits / (hits + misses).
+ * @param fs handle retornado por openFs.
+ * @param stats recebe os contadores.
+ * @return false se a sessão não usa o cache de blocos.
+ */
+bool cacheStats(FsHandle *fs, FsCacheStats *stats);
+
+/**
+ * Contadores das gravações das alterações na imagem (flushFs, closeFs e commits do diário).
+ */
+typedef struct {
+    bool ioUring;                      // as gravações vão pelo io_uring (false: uma chamada a pwritev cada)
+    uint64_t submits;                  // chamadas ao sistema feitas para enviá-las
+    uint64_t writes;                   // gravações enviadas
+} FsWriteStats;
+
+/**
+ * @brief Obtém os contadores das gravações da sessão.
+ * @param fs handle retornado por openFs.
+ * @param stats recebe os contadores.
+ */
+void writeStats(FsHandle *fs, FsWriteStats *stats);
+
+/**
+ * @brief Grava no arquivo as alterações pendentes da sessão, mantendo-a aberta.
+ * @param fs handle retornado por openFs.
+ * @return false se, com journal, a transação não pôde ser gravada no diário; as alterações continuam
+ * pendentes, nada foi gravado no lugar e flushFs pode ser chamada de novo.
+ */
+bool flushFs(FsHandle *fs);
+
+/**
+ * @brief Grava as alterações pendentes e encerra a sessão. O handle não pode mais ser usado.
+ * @param fs handle retornado por openFs.
+ */
+void closeFs(FsHandle *fs);
+
+/**
+ * @brief Escolhe quais mensagens do motor são impressas: 0 erros, 1 também avisos, 2 também informações,
+ * 3 também depuração (-1 nenhuma). Níveis acima do compilado (FS_LOG_LEVEL no CMake) não têm efeito.
+ * @param level nível de log.
+ */
+void setLogLevel(int level);
+
+/**
+ * @brief Habilita o trace binário das operações, guardando os últimos capacity registros em um buffer circular.
+ * Só tem efeito em binários compilados com FS_TRACE.
+ * @param capacity quantidade de registros guardados (0 desabilita o trace).
+ */
+void enableTrace(size_t capacity);
+
+/**
+ * @brief Grava os registros do trace (32 bytes cada, ver log.hpp), do mais antigo ao mais recente.
+ * @param fileName arquivo de destino.
+ * @return quantidade de registros gravados, ou -1 se o arquivo não puder ser criado.
+ */
+long dumpTrace(const std::string &fileName);
+
+#endif /* fsHandle_h */
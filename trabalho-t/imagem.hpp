@@ -0,0 +1,911 @@
+#ifndef imagem_hpp
+#define imagem_hpp
+
+#include "fs.h"
+#include "formato.hpp"
+#include "log.hpp"
+#include "cacheBlocos.hpp"
+#include "filaES.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Conjunto de posições alteradas (inodes, bytes do mapa de bits ou blocos).
+// Guarda uma marca por posição, para não repetir índices, e a lista das posições
+// marcadas, para que a gravação percorra apenas o que mudou. marcar pode ser chamada por
+// várias operações ao mesmo tempo; as demais funções, só com a árvore travada com exclusividade.
+// A marca é atômica, então marcar de novo uma posição (o caso comum no mapa de bits, em que um
+// byte cobre oito blocos) não toma a trava da lista.
+struct ConjuntoSujo
+{
+  vector<atomic<unsigned char>> marcado;
+  vector<int> indices;
+  mutex trava;
+
+  void iniciar(int tamanho)
+  {
+    marcado = vector<atomic<unsigned char>>(tamanho);
+    indices.clear();
+  }
+
+  void marcar(int i)
+  {
+    if (marcado[i].load(memory_order_relaxed) == 0 && marcado[i].exchange(1) == 0)
+    {
+      lock_guard<mutex> guarda(trava);
+      indices.push_back(i);
+    }
+  }
+
+  void limpar()
+  {
+    for (int i : indices)
+    {
+      marcado[i] = 0;
+    }
+    indices.clear();
+  }
+};
+
+// Chave do cache de entradas de diretório: (inode do diretório pai, nome do filho).
+// O nome é guardado como no inode (10 bytes completados com 0x00), sem alocar strings.
+struct ChaveDentry
+{
+  int pai;
+  char nome[10];
+
+  bool operator==(const ChaveDentry &outra) const
+  {
+    return pai == outra.pai && memcmp(nome, outra.nome, 10) == 0;
+  }
+};
+
+// Hash FNV-1a sobre o inode pai e os bytes do nome.
+struct HashDentry
+{
+  size_t operator()(const ChaveDentry &chave) const
+  {
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < 4; i++)
+    {
+      h = (h ^ ((chave.pai >> (8 * i)) & 0xFF)) * 1099511628211ULL;
+    }
+    for (int i = 0; i < 10; i++)
+    {
+      h = (h ^ (unsigned char)chave.nome[i]) * 1099511628211ULL;
+    }
+    return h;
+  }
+};
+
+// Cache de entradas de diretório (dentries): (pai, nome) -> inode do filho.
+// completo[d] indica que todas as entradas do diretório d estão no cache, então uma
+// busca que falha nele não precisa percorrer os blocos do diretório.
+// posicao[f] é a posição do inode f na lista de entradas do seu pai, válida enquanto o pai estiver completo.
+struct CacheDentries
+{
+  unordered_map<ChaveDentry, int, HashDentry> filhos;
+  vector<unsigned char> completo;
+  vector<int> posicao;
+};
+
+// Última tabela de ponteiros usada na tradução de blocos de um inode (mapaBlocos.hpp): a tabela cobre
+// os blocos lógicos [primeiro, primeiro + ponteirosPorBloco()). Os dois valores ficam em uma só palavra
+// atômica (primeiro nos 32 bits altos, tabela + 1 nos baixos; 0 = nenhuma tabela), porque várias
+// leituras do mesmo inode atualizam a tradução ao mesmo tempo e precisam ver sempre um par consistente.
+typedef atomic<uint64_t> TraducaoInode;
+
+// Vetores de trabalho da remoção (pilha da subárvore, inodes e blocos coletados), reaproveitados
+// entre operações para não alocar memória a cada uma. Ficam na imagem e são emprestados a cada
+// operação (VetoresEmprestados), porque arquivos de diretórios diferentes podem ser removidos ao mesmo tempo.
+struct VetoresRemocao
+{
+  vector<int> pilha;
+  vector<int> inodes;
+  vector<int> blocos;
+};
+
+// Grupo de alocação de blocos (alocador.hpp): um trecho [inicio, fim) da área de blocos, com a sua
+// parte do mapa de bits protegida pela própria trava e o seu cursor de busca.
+struct GrupoBlocos
+{
+  mutex trava;
+  int inicio = 0;
+  int fim = 0;
+  int proximo = 0;
+};
+
+// Menor quantidade de blocos de um grupo de alocação.
+const long BLOCOS_MINIMOS_GRUPO = 1024;
+
+// Quantidade de montagens feitas pelo processo, usada para numerar cada montagem.
+atomic<uint64_t> montagens{0};
+
+// Imagem montada de um sistema de arquivos que simula EXT3.
+// A imagem inteira fica em uma única região contígua de memória (dados): uma cópia lida do
+// arquivo com uma só chamada de leitura ou, quando a imagem é mapeada com mmap, o próprio
+// conteúdo do arquivo. O mapa de bits, os inodes e a área de blocos são visões tipadas sobre
+// essa região; os blocos são acessados por BlocoFixado, com passo de blockSize bytes.
+// Com o cache de blocos (cacheBlocos.hpp), só o superbloco, o mapa de bits e os inodes ficam na
+// região; cada bloco é lido para um quadro do cache quando BlocoFixado o fixa.
+// As operações alteram apenas as visões e marcam o que alteraram, que é gravado
+// (ou sincronizadas com msync) por gravarImagem(), que grava só os intervalos marcados.
+struct Imagem
+{
+  FILE *arquivo = NULL;
+
+  // Superbloco
+  uint32_t blockSize = 0;
+  uint32_t numBlocks = 0;
+  uint32_t numInodes = 0;
+  uint32_t root = 0;
+  int bitMapSize = 0;
+
+  // Formato da imagem (formato.hpp): versão, tamanho de cada inode no arquivo e largura em bytes
+  // dos ponteiros de blocos e das entradas de diretório.
+  int versao = 1;
+  int tamanhoInodeDisco = sizeof(INODE);
+  int larguraPonteiro = 1;
+
+  // Região contígua com o conteúdo da imagem e visões sobre ela.
+  unsigned char *dados = NULL;
+  size_t tamanhoDados = 0;
+  unsigned char *bitMap = NULL;
+  unsigned char *tabelaInodes = NULL;
+  unsigned char *blocos = NULL;
+
+  // Grupos de alocação de blocos, com blocosPorGrupo blocos cada (o último pode ter menos).
+  // montagem identifica esta montagem para o grupo de cada thread (alocador.hpp), e threadsAlocando
+  // conta as threads que já alocaram nela, para distribuí-las entre os grupos.
+  vector<GrupoBlocos> grupos;
+  int blocosPorGrupo = 0;
+  uint64_t montagem = 0;
+  atomic<int> threadsAlocando{0};
+
+  // Com o diário: blocos liberados desde o último commit (bit 1 = liberado, nas mesmas palavras de 64 blocos
+  // do mapa de bits; vazio sem o diário). Os metadados no disco ainda apontam para eles, então o alocador
+  // os trata como usados até o commit, como o mapa de bits confirmado do ext3: um bloco reaproveitado
+  // como dados seria gravado no lugar antes do commit, por cima de um diretório ou tabela ainda em uso.
+  // Cada palavra é protegida pela trava do grupo dos seus blocos, como o mapa de bits.
+  vector<uint64_t> liberadosNaTransacao;
+
+  // Inodes livres (bit 1 = livre), montado uma vez por montagem e mantido pelo alocador de inodes.
+  // Nenhuma palavra antes de primeiraPalavraInodes tem inode livre.
+  vector<uint64_t> inodesLivres;
+  int primeiraPalavraInodes = 0;
+
+  // Cache usado na resolução de caminhos.
+  CacheDentries dentries;
+
+  // Cache de tradução de blocos lógicos, um por inode.
+  vector<TraducaoInode> traducoes;
+
+  // Arquivos novos são gravados no formato com extents (extent.hpp).
+  bool usarExtents = false;
+
+  // Entradas removidas de um diretório são substituídas pela última, em vez de as seguintes serem deslocadas.
+  bool indexarDiretorios = false;
+
+  // Travas para o uso da imagem por várias threads (o protocolo está descrito em travas.hpp):
+  // a árvore de diretórios, um leitor/escritor por inode, o alocador de inodes e o cache de dentries.
+  // As travas do alocador de blocos ficam nos grupos.
+  shared_mutex travaArvore;
+  vector<shared_mutex> travasInodes;
+  mutex travaInodesLivres;
+  shared_mutex travaDentries;
+
+  // Vetores de remoção que não estão emprestados a nenhuma operação, protegidos por travaVetores.
+  // São tantos quanto o maior número de operações que já os usaram ao mesmo tempo, e são liberados com a imagem.
+  mutex travaVetores;
+  vector<unique_ptr<VetoresRemocao>> vetoresLivres;
+
+  // true quando dados aponta para o arquivo mapeado com mmap.
+  bool mapeada = false;
+
+  // Cache da área de blocos (capacidade 0 quando a imagem está inteira em dados).
+  CacheBlocos cache;
+
+  // Gravações de uma confirmação, enviadas juntas (filaES.hpp).
+  FilaES fila;
+
+  // Cópia em memória usada quando a imagem não está mapeada.
+  vector<unsigned char> copia;
+
+  // Inodes, bytes do mapa de bits e blocos alterados desde a última gravação.
+  // Os blocos com entradas de diretório ficam separados dos blocos de dados dos arquivos,
+  // porque com o diário (diario.hpp) eles são metadados e passam pelo diário.
+  ConjuntoSujo inodesSujos;
+  ConjuntoSujo bitMapSujo;
+  ConjuntoSujo blocosSujos;
+  ConjuntoSujo diretoriosSujos;
+};
+
+// Deslocamentos de cada região dentro do arquivo.
+// v1: [blockSize][numBlocks][numInodes][mapa de bits][inodes][root][blocos]
+// v2: [superbloco][mapa de bits][inodes][blocos]
+long offsetBitMap(const Imagem &img)
+{
+  return img.versao == 2 ? TAMANHO_SUPERBLOCO_V2 : TAMANHO_SUPERBLOCO_V1;
+}
+
+long offsetInodes(const Imagem &img)
+{
+  return offsetBitMap(img) + img.bitMapSize;
+}
+
+// Só no v1: no v2 o root fica no superbloco.
+long offsetRoot(const Imagem &img)
+{
+  return offsetInodes(img) + (long)img.tamanhoInodeDisco * img.numInodes;
+}
+
+long offsetBlocos(const Imagem &img)
+{
+  return offsetRoot(img) + (img.versao == 2 ? 0 : 1);
+}
+
+// Tamanho total do arquivo da imagem.
+long tamanhoImagem(const Imagem &img)
+{
+  return offsetBlocos(img) + (long)img.blockSize * img.numBlocks;
+}
+
+// Forma de acesso a um bloco: leitura, ou escrita de dados de arquivo ou de metadados (entradas de
+// diretório e tabelas de ponteiros), que com o diário ficam no cache até o commit.
+enum AcessoBloco
+{
+  LER_BLOCO,
+  GRAVAR_DADOS,
+  GRAVAR_METADADOS,
+};
+
+// Acesso ao bloco de índice b: dados aponta para o início dele enquanto o objeto existir.
+// Com o cache de blocos, o bloco fica fixado em um quadro até o fim do escopo; sem ele, dados aponta
+// direto para a área de blocos e nada mais é feito.
+struct BlocoFixado
+{
+  Quadro *quadro = NULL;
+  unsigned char *dados;
+
+  BlocoFixado(Imagem &img, int b, AcessoBloco acesso)
+  {
+    if (img.cache.capacidade == 0)
+    {
+      dados = img.blocos + (size_t)b * img.blockSize;
+      return;
+    }
+    quadro = fixarQuadro(img.cache, b, acesso != LER_BLOCO, acesso == GRAVAR_METADADOS);
+    dados = quadro->dados.data();
+  }
+
+  ~BlocoFixado()
+  {
+    if (quadro != NULL)
+    {
+      soltarQuadro(quadro);
+    }
+  }
+
+  BlocoFixado(const BlocoFixado &) = delete;
+  BlocoFixado &operator=(const BlocoFixado &) = delete;
+};
+
+// Vetores de remoção emprestados da imagem até o fim do escopo; voltam para ela, com a capacidade
+// que ganharam, para a próxima operação.
+struct VetoresEmprestados
+{
+  Imagem &img;
+  unique_ptr<VetoresRemocao> vetores;
+
+  VetoresEmprestados(Imagem &img) : img(img)
+  {
+    lock_guard<mutex> guarda(img.travaVetores);
+    if (img.vetoresLivres.empty())
+    {
+      vetores.reset(new VetoresRemocao());
+      return;
+    }
+    vetores = move(img.vetoresLivres.back());
+    img.vetoresLivres.pop_back();
+  }
+
+  ~VetoresEmprestados()
+  {
+    lock_guard<mutex> guarda(img.travaVetores);
+    img.vetoresLivres.push_back(move(vetores));
+  }
+
+  VetoresRemocao *operator->() { return vetores.get(); }
+
+  VetoresEmprestados(const VetoresEmprestados &) = delete;
+  VetoresEmprestados &operator=(const VetoresEmprestados &) = delete;
+};
+
+// Acesso aos campos dos inodes e aos ponteiros guardados em blocos, na largura do formato
+// montado. IS_USED, IS_DIR e NAME ficam na mesma posição nos dois formatos.
+
+// Início do inode i na tabela de inodes.
+unsigned char *inodeBruto(const Imagem &img, int i)
+{
+  return img.tabelaInodes + (size_t)i * img.tamanhoInodeDisco;
+}
+
+bool inodeUsado(const Imagem &img, int i)
+{
+  return inodeBruto(img, i)[offsetof(INODE, IS_USED)] != 0x00;
+}
+
+void definirUsado(Imagem &img, int i, bool usado)
+{
+  inodeBruto(img, i)[offsetof(INODE, IS_USED)] = usado ? 0x01 : 0x00;
+}
+
+// Tipo do inode (campo IS_DIR): 0x00 arquivo, 0x01 diretório, 0x02 arquivo com extents.
+unsigned char tipoInode(const Imagem &img, int i)
+{
+  return inodeBruto(img, i)[offsetof(INODE, IS_DIR)];
+}
+
+void definirTipo(Imagem &img, int i, unsigned char tipo)
+{
+  inodeBruto(img, i)[offsetof(INODE, IS_DIR)] = tipo;
+}
+
+// Nome do inode: 10 bytes completados com 0x00.
+char *nomeInode(const Imagem &img, int i)
+{
+  return (char *)inodeBruto(img, i) + offsetof(INODE, NAME);
+}
+
+// Tamanho em bytes do arquivo (ou quantidade de entradas do diretório). No v1, SIZE é um char, mas o valor não tem sinal.
+uint64_t tamanhoInode(const Imagem &img, int i)
+{
+  if (img.versao == 2)
+  {
+    return lerLE64(inodeBruto(img, i) + offsetof(INODE_V2, SIZE));
+  }
+  return (unsigned char)inodeBruto(img, i)[offsetof(INODE, SIZE)];
+}
+
+void definirTamanho(Imagem &img, int i, uint64_t tamanho)
+{
+  if (img.versao == 2)
+  {
+    gravarLE64(inodeBruto(img, i) + offsetof(INODE_V2, SIZE), tamanho);
+    return;
+  }
+  inodeBruto(img, i)[offsetof(INODE, SIZE)] = tamanho;
+}
+
+// Maior tamanho que o campo SIZE consegue guardar.
+uint64_t maiorTamanho(const Imagem &img)
+{
+  return img.versao == 2 ? UINT64_MAX : 0xFF;
+}
+
+// Ponteiro k do inode i (0 a 2 diretos, 3 a 5 indiretos, 6 a 8 duplamente indiretos).
+uint32_t ponteiroInode(const Imagem &img, int i, int k)
+{
+  if (img.versao == 2)
+  {
+    return lerLE32(inodeBruto(img, i) + offsetof(INODE_V2, DIRECT_BLOCKS) + 4 * k);
+  }
+  return inodeBruto(img, i)[offsetof(INODE, DIRECT_BLOCKS) + k];
+}
+
+void definirPonteiro(Imagem &img, int i, int k, uint32_t valor)
+{
+  if (img.versao == 2)
+  {
+    gravarLE32(inodeBruto(img, i) + offsetof(INODE_V2, DIRECT_BLOCKS) + 4 * k, valor);
+    return;
+  }
+  inodeBruto(img, i)[offsetof(INODE, DIRECT_BLOCKS) + k] = valor;
+}
+
+// Quantidade de ponteiros (ou entradas de diretório) que cabem em um bloco.
+int ponteirosPorBloco(const Imagem &img)
+{
+  return img.blockSize / img.larguraPonteiro;
+}
+
+// Maior valor que um ponteiro (ou um contador guardado no lugar de um ponteiro) consegue guardar.
+uint32_t maiorPonteiro(const Imagem &img)
+{
+  return img.versao == 2 ? UINT32_MAX : 0xFF;
+}
+
+// Ponteiro k guardado no bloco b (tabela de ponteiros ou lista de entradas de diretório).
+uint32_t ponteiroBloco(Imagem &img, int b, long k)
+{
+  BlocoFixado bloco(img, b, LER_BLOCO);
+  if (img.versao == 2)
+  {
+    return lerLE32(bloco.dados + 4 * k);
+  }
+  return bloco.dados[k];
+}
+
+void definirPonteiroBloco(Imagem &img, int b, long k, uint32_t valor)
+{
+  BlocoFixado bloco(img, b, GRAVAR_METADADOS);
+  if (img.versao == 2)
+  {
+    gravarLE32(bloco.dados + 4 * k, valor);
+    return;
+  }
+  bloco.dados[k] = valor;
+}
+
+/**
+ * @brief Preenche os campos do superbloco a partir do início da imagem, nos formatos v1 ou v2.
+ * @param img imagem a ser preenchida
+ * @param superbloco início do arquivo da imagem
+ * @param disponivel quantidade de bytes lidos a partir de superbloco
+ * @return false se o superbloco v2 estiver incompleto, tiver versão desconhecida ou campos além de MAIOR_CAMPO_V2
+ */
+bool lerSuperbloco(Imagem &img, const unsigned char *superbloco, long disponivel)
+{
+  if (superbloco[0] != 0x00)
+  {
+    img.versao = 1;
+    img.blockSize = superbloco[0];
+    img.numBlocks = superbloco[1];
+    img.numInodes = superbloco[2];
+    img.tamanhoInodeDisco = sizeof(INODE);
+    img.larguraPonteiro = 1;
+  }
+  else
+  {
+    if (disponivel < TAMANHO_SUPERBLOCO_V2 || memcmp(superbloco, MAGICA_V2, 4) != 0 || lerLE32(superbloco + 4) != VERSAO_V2)
+    {
+      return false;
+    }
+    if (lerLE32(superbloco + 8) > MAIOR_CAMPO_V2 || lerLE32(superbloco + 12) > MAIOR_CAMPO_V2 ||
+        lerLE32(superbloco + 16) > MAIOR_CAMPO_V2)
+    {
+      LOG_FS(LOG_ERRO, "Geometria inválida!\n");
+      return false;
+    }
+    img.versao = 2;
+    img.blockSize = lerLE32(superbloco + 8);
+    img.numBlocks = lerLE32(superbloco + 12);
+    img.numInodes = lerLE32(superbloco + 16);
+    img.root = lerLE32(superbloco + 20);
+    img.tamanhoInodeDisco = sizeof(INODE_V2);
+    img.larguraPonteiro = 4;
+    if (img.blockSize < 4 || img.blockSize % 4 != 0 || img.root >= img.numInodes)
+    {
+      return false;
+    }
+  }
+  img.bitMapSize = (img.numBlocks + 7) / 8;
+  return true;
+}
+
+// Aponta as visões do mapa de bits, dos inodes e dos blocos para a região de dados
+// e monta o estado em memória derivado delas.
+void apontarVisoes(Imagem &img)
+{
+  img.bitMap = img.dados + offsetBitMap(img);
+  img.tabelaInodes = img.dados + offsetInodes(img);
+  if (img.versao == 1)
+  {
+    img.root = img.dados[offsetRoot(img)];
+  }
+  img.blocos = img.cache.capacidade == 0 ? img.dados + offsetBlocos(img) : NULL;
+  img.inodesLivres.assign((img.numInodes + 63) / 64, 0);
+  for (int i = 0; i < (int)img.numInodes; i++)
+  {
+    if (!inodeUsado(img, i))
+    {
+      img.inodesLivres[i / 64] |= 1ULL << (i % 64);
+    }
+  }
+  img.primeiraPalavraInodes = 0;
+
+  // Grupos de alocação: até um por processador, com pelo menos BLOCOS_MINIMOS_GRUPO blocos cada e
+  // começando em múltiplos de 64 blocos, para que cada palavra do mapa de bits pertença a um só grupo.
+  long processadores = thread::hardware_concurrency() > 0 ? thread::hardware_concurrency() : 1;
+  long porGrupo = ((long)img.numBlocks + processadores - 1) / processadores;
+  porGrupo = porGrupo < BLOCOS_MINIMOS_GRUPO ? BLOCOS_MINIMOS_GRUPO : (porGrupo + 63) / 64 * 64;
+  long quantidadeGrupos = ((long)img.numBlocks + porGrupo - 1) / porGrupo;
+  img.grupos = vector<GrupoBlocos>(quantidadeGrupos > 0 ? quantidadeGrupos : 1);
+  for (size_t k = 0; k < img.grupos.size(); k++)
+  {
+    img.grupos[k].inicio = k * porGrupo;
+    img.grupos[k].fim = (long)(k + 1) * porGrupo < (long)img.numBlocks ? (k + 1) * porGrupo : img.numBlocks;
+    img.grupos[k].proximo = img.grupos[k].inicio;
+  }
+  img.blocosPorGrupo = porGrupo;
+  img.montagem = ++montagens;
+  img.threadsAlocando = 0;
+
+  img.dentries.filhos.clear();
+  img.dentries.completo.assign(img.numInodes, 0);
+  img.dentries.posicao.assign(img.numInodes, -1);
+  img.traducoes = vector<TraducaoInode>(img.numInodes);
+  img.travasInodes = vector<shared_mutex>(img.numInodes);
+
+  img.inodesSujos.iniciar(img.numInodes);
+  img.bitMapSujo.iniciar(img.bitMapSize);
+  img.blocosSujos.iniciar(img.numBlocks);
+  img.diretoriosSujos.iniciar(img.numBlocks);
+}
+
+// Marca o inode i como alterado.
+void marcarInodeSujo(Imagem &img, int i)
+{
+  img.inodesSujos.marcar(i);
+}
+
+// Marca como alterado o byte do mapa de bits que contém o bit do bloco indicado.
+void marcarBitMapSujo(Imagem &img, int blocoIndex)
+{
+  img.bitMapSujo.marcar(blocoIndex / 8);
+}
+
+// Marca o bloco de dados i como alterado.
+void marcarBlocoSujo(Imagem &img, int i)
+{
+  img.blocosSujos.marcar(i);
+}
+
+// Marca como alterado o bloco i, que guarda entradas de um diretório.
+void marcarDiretorioSujo(Imagem &img, int i)
+{
+  img.diretoriosSujos.marcar(i);
+}
+
+// Marca como alterado o bloco i, que guarda uma tabela de ponteiros (também é metadado).
+void marcarTabelaSuja(Imagem &img, int i)
+{
+  img.diretoriosSujos.marcar(i);
+}
+
+/**
+ * @brief Copia tamanho bytes de blocos consecutivos, a partir do byte dentro do bloco b.
+ * @param img imagem montada
+ * @param b primeiro bloco
+ * @param dentro posição do primeiro byte a partir do início de b (pode passar de um bloco)
+ * @param destino buffer com pelo menos tamanho bytes
+ * @param tamanho quantidade de bytes
+ */
+void lerBlocos(Imagem &img, int b, long dentro, unsigned char *destino, size_t tamanho)
+{
+  if (img.cache.capacidade == 0)
+  {
+    memcpy(destino, img.blocos + (size_t)b * img.blockSize + dentro, tamanho);
+    return;
+  }
+  b += dentro / img.blockSize;
+  dentro %= img.blockSize;
+  for (size_t copiados = 0; copiados < tamanho; b++, dentro = 0)
+  {
+    size_t resto = img.blockSize - dentro;
+    size_t copiar = resto < tamanho - copiados ? resto : tamanho - copiados;
+    BlocoFixado bloco(img, b, LER_BLOCO);
+    memcpy(destino + copiados, bloco.dados + dentro, copiar);
+    copiados += copiar;
+  }
+}
+
+/**
+ * @brief Grava tamanho bytes de dados de arquivo em blocos consecutivos, a partir do byte dentro do bloco b,
+ * e marca como alterados os blocos alcançados.
+ * @param img imagem montada
+ * @param b primeiro bloco
+ * @param dentro posição do primeiro byte a partir do início de b (pode passar de um bloco)
+ * @param origem bytes a serem gravados, ou NULL para gravar 0x00
+ * @param tamanho quantidade de bytes
+ */
+void gravarBlocos(Imagem &img, int b, long dentro, const unsigned char *origem, size_t tamanho)
+{
+  if (tamanho == 0)
+  {
+    return;
+  }
+  b += dentro / img.blockSize;
+  dentro %= img.blockSize;
+
+  // Sem cache, o trecho inteiro é contíguo na memória e é copiado de uma vez.
+  if (img.cache.capacidade == 0)
+  {
+    unsigned char *destino = img.blocos + (size_t)b * img.blockSize + dentro;
+    if (origem != NULL)
+    {
+      memcpy(destino, origem, tamanho);
+    }
+    else
+    {
+      memset(destino, 0x00, tamanho);
+    }
+    for (long fim = b + (dentro + tamanho + img.blockSize - 1) / img.blockSize; b < fim; b++)
+    {
+      marcarBlocoSujo(img, b);
+    }
+    return;
+  }
+
+  for (size_t copiados = 0; copiados < tamanho; b++, dentro = 0)
+  {
+    size_t resto = img.blockSize - dentro;
+    size_t copiar = resto < tamanho - copiados ? resto : tamanho - copiados;
+    BlocoFixado bloco(img, b, GRAVAR_DADOS);
+    if (origem != NULL)
+    {
+      memcpy(bloco.dados + dentro, origem + copiados, copiar);
+    }
+    else
+    {
+      memset(bloco.dados + dentro, 0x00, copiar);
+    }
+    marcarBlocoSujo(img, b);
+    copiados += copiar;
+  }
+}
+
+/**
+ * @brief Lê a imagem inteira para a memória com uma única leitura posicionada. O arquivo continua aberto e
+ * pertence à imagem até desmontarImagem().
+ * @param img imagem a ser preenchida
+ * @param arquivo arquivo aberto no modo r+ que contém um sistema de arquivos que simula EXT3.
+ * @return true se a imagem foi lida por completo
+ */
+bool montarImagem(Imagem &img, FILE *arquivo)
+{
+  img.arquivo = arquivo;
+
+  // Superbloco: os 3 primeiros bytes do arquivo (v1) ou os 32 primeiros (v2).
+  unsigned char superbloco[TAMANHO_SUPERBLOCO_V2];
+  ssize_t lidos = pread(fileno(arquivo), superbloco, TAMANHO_SUPERBLOCO_V2, 0);
+  if (lidos < TAMANHO_SUPERBLOCO_V1 || !lerSuperbloco(img, superbloco, lidos))
+  {
+    return false;
+  }
+
+  // Superbloco, mapa de bits, inodes, root e blocos em uma só região.
+  img.copia.resize(tamanhoImagem(img));
+  ssize_t tamanho = img.copia.size();
+  if (pread(fileno(arquivo), img.copia.data(), tamanho, 0) != tamanho)
+  {
+    return false;
+  }
+
+  img.dados = img.copia.data();
+  img.tamanhoDados = img.copia.size();
+  img.mapeada = false;
+  apontarVisoes(img);
+  return true;
+}
+
+/**
+ * @brief Mapeia a imagem com mmap. Nada é copiado: as visões apontam direto para o arquivo, e os blocos
+ * só são lidos quando usados. O estado em memória montado por apontarVisoes ainda custa
+ * O(numInodes + numBlocks): a tabela de inodes é percorrida inteira (e lida do arquivo) para achar
+ * os inodes livres, e as estruturas por inode e os conjuntos sujos por bloco são alocados na montagem.
+ * @param img imagem a ser preenchida
+ * @param arquivo arquivo aberto no modo r+ que contém um sistema de arquivos que simula EXT3.
+ * @return true se o arquivo pôde ser mapeado e tem o tamanho indicado pelo superbloco
+ */
+bool montarImagemMapeada(Imagem &img, FILE *arquivo)
+{
+  img.arquivo = arquivo;
+
+  struct stat info;
+  if (fstat(fileno(arquivo), &info) != 0 || info.st_size < 3)
+  {
+    return false;
+  }
+
+  void *mapa = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(arquivo), 0);
+  if (mapa == MAP_FAILED)
+  {
+    return false;
+  }
+  img.dados = (unsigned char *)mapa;
+  img.tamanhoDados = info.st_size;
+  img.mapeada = true;
+
+  if (!lerSuperbloco(img, img.dados, img.tamanhoDados) || (long)img.tamanhoDados < tamanhoImagem(img))
+  {
+    munmap(img.dados, img.tamanhoDados);
+    img.dados = NULL;
+    img.mapeada = false;
+    return false;
+  }
+
+  apontarVisoes(img);
+  return true;
+}
+
+/**
+ * @brief Monta a imagem com o cache de blocos: só o superbloco, o mapa de bits e os inodes são lidos agora;
+ * os blocos são lidos sob demanda e no máximo quadros deles ficam na memória.
+ * @param img imagem a ser preenchida
+ * @param arquivo arquivo aberto no modo r+ que contém um sistema de arquivos que simula EXT3.
+ * @param quadros capacidade do cache, em blocos (maior que 0)
+ * @return true se o início da imagem foi lido e o arquivo tem o tamanho indicado pelo superbloco
+ */
+bool montarImagemComCache(Imagem &img, FILE *arquivo, int quadros)
+{
+  img.arquivo = arquivo;
+
+  unsigned char superbloco[TAMANHO_SUPERBLOCO_V2];
+  ssize_t lidos = pread(fileno(arquivo), superbloco, TAMANHO_SUPERBLOCO_V2, 0);
+  struct stat info;
+  if (lidos < TAMANHO_SUPERBLOCO_V1 || !lerSuperbloco(img, superbloco, lidos) ||
+      fstat(fileno(arquivo), &info) != 0 || info.st_size < tamanhoImagem(img))
+  {
+    return false;
+  }
+
+  // Superbloco, mapa de bits, inodes e root; a área de blocos fica no arquivo.
+  img.copia.resize(offsetBlocos(img));
+  ssize_t tamanho = img.copia.size();
+  if (pread(fileno(arquivo), img.copia.data(), tamanho, 0) != tamanho)
+  {
+    return false;
+  }
+
+  img.dados = img.copia.data();
+  img.tamanhoDados = img.copia.size();
+  img.mapeada = false;
+  iniciarCache(img.cache, fileno(arquivo), offsetBlocos(img), img.blockSize, img.numBlocks, quadros);
+  apontarVisoes(img);
+  return true;
+}
+
+// Sincroniza com o arquivo o intervalo [inicio, inicio + tamanho) do mapa.
+// msync exige endereço alinhado à página, então o início é arredondado para baixo.
+void sincronizarIntervalo(Imagem &img, long inicio, long tamanho)
+{
+  long pagina = sysconf(_SC_PAGESIZE);
+  long alinhado = inicio - inicio % pagina;
+  msync(img.dados + alinhado, tamanho + (inicio - alinhado), MS_SYNC);
+}
+
+// Grava o intervalo [inicio, inicio + tamanho) da região de dados na mesma posição do arquivo. A gravação
+// é enfileirada em img.fila e só termina em concluirFila; com a imagem mapeada, é sincronizada na hora.
+void gravarIntervalo(Imagem &img, long inicio, long tamanho)
+{
+  if (img.mapeada)
+  {
+    sincronizarIntervalo(img, inicio, tamanho);
+    return;
+  }
+  iovec vetor = {img.dados + inicio, (size_t)tamanho};
+  enfileirarGravacao(img.fila, fileno(img.arquivo), inicio, &vetor, 1);
+}
+
+// Percorre os elementos marcados em um conjunto sujo como intervalos do arquivo. Os índices são
+// ordenados e os elementos vizinhos são agrupados, e funcao(inicio, tamanho) é chamada uma vez
+// por sequência contígua. inicio é o deslocamento da região no arquivo e tamanho o de cada elemento.
+template <typename Funcao>
+void percorrerIntervalos(ConjuntoSujo &conjunto, long inicio, long tamanho, Funcao funcao)
+{
+  sort(conjunto.indices.begin(), conjunto.indices.end());
+  size_t i = 0;
+  while (i < conjunto.indices.size())
+  {
+    size_t j = i + 1;
+    while (j < conjunto.indices.size() && conjunto.indices[j] == conjunto.indices[j - 1] + 1)
+    {
+      j++;
+    }
+    funcao(inicio + conjunto.indices[i] * tamanho, (long)(j - i) * tamanho);
+    i = j;
+  }
+}
+
+// Enfileira a gravação dos elementos marcados em um conjunto sujo, uma por sequência contígua.
+void gravarConjunto(Imagem &img, ConjuntoSujo &conjunto, long inicio, long tamanho)
+{
+  percorrerIntervalos(conjunto, inicio, tamanho, [&](long i, long t)
+                      { gravarIntervalo(img, i, t); });
+  conjunto.limpar();
+}
+
+// Enfileira a gravação dos blocos marcados em um conjunto sujo de blocos. Com o cache, os blocos saem dos seus quadros,
+// em sequências de blocos consecutivos; um bloco que não está mais no cache já foi gravado quando o seu
+// quadro foi despejado.
+void gravarBlocosSujos(Imagem &img, ConjuntoSujo &conjunto)
+{
+  if (img.cache.capacidade == 0)
+  {
+    gravarConjunto(img, conjunto, offsetBlocos(img), img.blockSize);
+    return;
+  }
+  sort(conjunto.indices.begin(), conjunto.indices.end());
+  gravarBlocosCache(img.cache, conjunto.indices, img.fila);
+  conjunto.limpar();
+}
+
+// Volta a marcar como alterados, em conjunto, blocos cuja gravação não chegou ao disco; com o cache,
+// os quadros deles voltam a ficar sujos.
+void remarcarBlocos(Imagem &img, ConjuntoSujo &conjunto, const vector<int> &blocos)
+{
+  for (int b : blocos)
+  {
+    conjunto.marcar(b);
+  }
+  if (img.cache.capacidade != 0)
+  {
+    sujarQuadros(img.cache, blocos);
+  }
+}
+
+// Esquece as alterações pendentes, que não serão gravadas: limpa os conjuntos sujos e, com o cache, os quadros.
+void descartarAlteracoes(Imagem &img)
+{
+  img.bitMapSujo.limpar();
+  img.inodesSujos.limpar();
+  img.blocosSujos.limpar();
+  img.diretoriosSujos.limpar();
+  if (img.cache.capacidade != 0)
+  {
+    descartarQuadros(img.cache);
+  }
+}
+
+/**
+ * @brief Grava no arquivo apenas os inodes, bytes do mapa de bits e blocos que foram alterados
+ * desde a última gravação, com escritas posicionadas enviadas juntas pela fila de gravações (filaES.hpp),
+ * ou msync, se a imagem estiver mapeada.
+ * O custo é proporcional ao tamanho da alteração, não ao tamanho da imagem.
+ * @param img imagem montada
+ */
+void gravarImagem(Imagem &img)
+{
+  TRACE_FS(TRACE_GRAVAR, -1, img.bitMapSujo.indices.size() + img.inodesSujos.indices.size() + img.blocosSujos.indices.size() + img.diretoriosSujos.indices.size(), 0);
+  gravarConjunto(img, img.bitMapSujo, offsetBitMap(img), 1);
+  gravarConjunto(img, img.inodesSujos, offsetInodes(img), img.tamanhoInodeDisco);
+  gravarBlocosSujos(img, img.blocosSujos);
+  gravarBlocosSujos(img, img.diretoriosSujos);
+  concluirFila(img.fila);
+  if (img.cache.capacidade != 0)
+  {
+    reduzirCache(img.cache);
+  }
+}
+
+/**
+ * @brief Grava as alterações pendentes, desfaz o mapeamento (se houver) e fecha o arquivo da imagem.
+ * @param img imagem montada
+ */
+void desmontarImagem(Imagem &img)
+{
+  if (img.arquivo == NULL)
+  {
+    return;
+  }
+  gravarImagem(img);
+  fecharFila(img.fila);
+  if (img.mapeada)
+  {
+    munmap(img.dados, img.tamanhoDados);
+    img.mapeada = false;
+  }
+  img.dados = NULL;
+  img.cache.quadros.clear();
+  img.cache.quadroDoBloco.clear();
+  fclose(img.arquivo);
+  img.arquivo = NULL;
+}
+
+#endif /* imagem_hpp */
@@ -0,0 +1,143 @@
+#ifndef log_hpp
+#define log_hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <atomic>
+#include <vector>
+
+using namespace std;
+
+// Log e trace do motor.
+//
+// Log: mensagens de texto com nível. FS_NIVEL_LOG (definido na compilação, ver CMakeLists.txt)
+// é o maior nível compilado: LOG_FS com um nível acima dele é descartado pelo compilador, sem
+// avaliar os argumentos. Dentro do que foi compilado, nivelLog escolhe em tempo de execução o
+// que é impresso. Com FS_NIVEL_LOG = -1 nenhuma mensagem existe no binário.
+//
+// Trace: registros binários de tamanho fixo (RegistroTrace) em um buffer circular, que guarda
+// os últimos eventos das operações e pode ser despejado em um arquivo quando preciso. Só existe
+// quando FS_TRACE é 1; senão TRACE_FS não gera código. Mesmo compilado, o buffer começa vazio
+// e só registra depois de habilitarTrace. Várias threads podem registrar ao mesmo tempo: cada
+// registro reserva a sua posição com um incremento atômico. habilitarTrace e despejarTrace devem
+// ser chamadas sem operações em andamento.
+
+const int LOG_ERRO = 0;
+const int LOG_AVISO = 1;
+const int LOG_INFO = 2;
+const int LOG_DEPURACAO = 3;
+
+#ifndef FS_NIVEL_LOG
+#define FS_NIVEL_LOG 1
+#endif
+
+#ifndef FS_TRACE
+#define FS_TRACE 0
+#endif
+
+// Nível impresso em tempo de execução (não passa de FS_NIVEL_LOG, que limita o que foi compilado).
+atomic<int> nivelLog(FS_NIVEL_LOG);
+
+#define LOG_FS(nivel, ...)                 \
+  do                                       \
+  {                                        \
+    if constexpr ((nivel) <= FS_NIVEL_LOG) \
+    {                                      \
+      if ((nivel) <= nivelLog)             \
+      {                                    \
+        printf(__VA_ARGS__);               \
+      }                                    \
+    }                                      \
+  } while (0)
+
+// Eventos do trace. Os campos a e b de cada registro dependem do evento.
+enum EventoTrace : uint32_t
+{
+  TRACE_ADICIONAR_ARQUIVO = 1, // inode do arquivo, a = tamanho, b = inode do pai
+  TRACE_ADICIONAR_DIRETORIO,   // inode do diretório, a = inode do pai
+  TRACE_REMOVER,               // inode removido, a = inodes liberados, b = blocos liberados
+  TRACE_MOVER,                 // inode movido, a = pai antigo, b = pai novo
+  TRACE_GRAVAR,                // a = intervalos gravados
+  TRACE_TRANSACAO,             // a = sequência da transação, b = bytes acrescentados ao diário
+};
+
+// Registro do trace, gravado como está (little-endian) por despejarTrace.
+struct RegistroTrace
+{
+  uint64_t tempo; // CLOCK_MONOTONIC, em nanossegundos
+  uint32_t evento;
+  int32_t inode;
+  uint64_t a;
+  uint64_t b;
+};
+
+static_assert(sizeof(RegistroTrace) == 32, "RegistroTrace precisa ter 32 bytes");
+
+// Buffer circular do trace: o registro n fica na posição n % registros.size().
+struct BufferTrace
+{
+  vector<RegistroTrace> registros;
+  atomic<uint64_t> total{0};
+};
+
+BufferTrace bufferTrace;
+
+// Habilita o trace com espaço para os últimos capacidade registros (0 desabilita), descartando os anteriores.
+void habilitarTrace(size_t capacidade)
+{
+  bufferTrace.registros.assign(capacidade, RegistroTrace());
+  bufferTrace.total = 0;
+}
+
+// Acrescenta um registro ao buffer, sobrescrevendo o mais antigo quando ele está cheio.
+void registrarTrace(uint32_t evento, int inode, uint64_t a, uint64_t b)
+{
+  if (bufferTrace.registros.empty())
+  {
+    return;
+  }
+  timespec agora;
+  clock_gettime(CLOCK_MONOTONIC, &agora);
+  uint64_t n = bufferTrace.total.fetch_add(1, memory_order_relaxed);
+  RegistroTrace &registro = bufferTrace.registros[n % bufferTrace.registros.size()];
+  registro.tempo = (uint64_t)agora.tv_sec * 1000000000ULL + agora.tv_nsec;
+  registro.evento = evento;
+  registro.inode = inode;
+  registro.a = a;
+  registro.b = b;
+}
+
+#if FS_TRACE
+#define TRACE_FS(evento, inode, a, b) registrarTrace((evento), (inode), (a), (b))
+#else
+#define TRACE_FS(evento, inode, a, b) \
+  do                                  \
+  {                                   \
+  } while (0)
+#endif
+
+/**
+ * @brief Grava no arquivo os registros guardados no buffer do trace, do mais antigo ao mais recente.
+ * @param caminho arquivo de destino (sobrescrito)
+ * @return quantidade de registros gravados, ou -1 se o arquivo não puder ser criado
+ */
+long despejarTrace(const char *caminho)
+{
+  FILE *arquivo = fopen(caminho, "wb");
+  if (arquivo == NULL)
+  {
+    return -1;
+  }
+  size_t capacidade = bufferTrace.registros.size();
+  uint64_t total = bufferTrace.total;
+  uint64_t guardados = total < capacidade ? total : capacidade;
+  for (uint64_t n = total - guardados; n < total; n++)
+  {
+    fwrite(&bufferTrace.registros[n % capacidade], sizeof(RegistroTrace), 1, arquivo);
+  }
+  fclose(arquivo);
+  return guardados;
+}
+
+#endif /* log_hpp */
@@ -0,0 +1,110 @@
+#ifndef lote_hpp
+#define lote_hpp
+
+#include <string_view>
+
+using namespace std;
+
+// Leitura do log de operações aplicado em lote por applyBatch (fsHandle.h).
+// Uma operação por linha, com os campos separados por um espaço:
+//   addFile <caminho> <conteúdo>     (o conteúdo é o resto da linha e pode conter espaços)
+//   addDir <caminho>
+//   remove <caminho>
+//   move <caminho antigo> <caminho novo>
+// Linhas vazias e linhas começadas por '#' são ignoradas.
+
+enum TipoOperacao
+{
+  OPERACAO_NENHUMA,
+  OPERACAO_ADD_FILE,
+  OPERACAO_ADD_DIR,
+  OPERACAO_REMOVE,
+  OPERACAO_MOVE,
+  OPERACAO_INVALIDA
+};
+
+// Operação lida de uma linha do log. Os campos são visões sobre a própria linha.
+struct OperacaoLote
+{
+  TipoOperacao tipo = OPERACAO_NENHUMA;
+  string_view primeiro;
+  string_view segundo;
+};
+
+// Nome da operação, como aparece no log.
+const char *nomeOperacao(TipoOperacao tipo)
+{
+  switch (tipo)
+  {
+  case OPERACAO_ADD_FILE:
+    return "addFile";
+  case OPERACAO_ADD_DIR:
+    return "addDir";
+  case OPERACAO_REMOVE:
+    return "remove";
+  case OPERACAO_MOVE:
+    return "move";
+  default:
+    return "";
+  }
+}
+
+// Separa o próximo campo da linha (até o primeiro espaço) e o retira do início da linha.
+string_view proximoCampo(string_view &linha)
+{
+  size_t espaco = linha.find(' ');
+  string_view campo = linha.substr(0, espaco);
+  linha.remove_prefix(espaco == string_view::npos ? linha.size() : espaco + 1);
+  return campo;
+}
+
+/**
+ * @brief Interpreta uma linha do log de operações.
+ * @param linha linha do log, sem o '\n' final
+ * @return operação lida; OPERACAO_NENHUMA para linhas vazias ou comentários e
+ *         OPERACAO_INVALIDA para operações desconhecidas ou com campos faltando
+ */
+OperacaoLote lerOperacao(string_view linha)
+{
+  OperacaoLote operacao;
+  if (!linha.empty() && linha.back() == '\r')
+  {
+    linha.remove_suffix(1);
+  }
+  if (linha.empty() || linha[0] == '#')
+  {
+    return operacao;
+  }
+
+  string_view nome = proximoCampo(linha);
+  operacao.tipo = OPERACAO_INVALIDA;
+  if (nome == "addFile")
+  {
+    operacao.tipo = OPERACAO_ADD_FILE;
+    operacao.primeiro = proximoCampo(linha);
+    operacao.segundo = linha;
+  }
+  else if (nome == "addDir" || nome == "remove")
+  {
+    operacao.tipo = nome == "addDir" ? OPERACAO_ADD_DIR : OPERACAO_REMOVE;
+    operacao.primeiro = proximoCampo(linha);
+  }
+  else if (nome == "move")
+  {
+    operacao.tipo = OPERACAO_MOVE;
+    operacao.primeiro = proximoCampo(linha);
+    operacao.segundo = proximoCampo(linha);
+    if (operacao.segundo.empty())
+    {
+      operacao.tipo = OPERACAO_INVALIDA;
+    }
+  }
+
+  if (operacao.primeiro.empty())
+  {
+    operacao.tipo = OPERACAO_INVALIDA;
+  }
+  return operacao;
+}
+
+#endif /* lote_hpp */
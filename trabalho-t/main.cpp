@@ -1,9 +1,15 @@
 #include "gtest/gtest.h"
 #include "fs.h"
+#include "fsHandle.h"
 #include "sha256.h"
 
 #include <fstream>
 #include <stdio.h>
+#include <vector>
+#include <iterator>
+#include <thread>
+#include <signal.h>
+#include <sys/resource.h>
 
 void duplicate(std::string fsrc, std::string fdest)
 {
@@ -13,6 +19,11 @@ void duplicate(std::string fsrc, std::string fdest)
     dst << src.rdbuf();
 }
 
+std::vector<unsigned char> readBytes(std::string fname)
+{
+    std::ifstream in(fname, std::ios::binary);
+    return std::vector<unsigned char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
 
 TEST(FsTest, init021005){
     initFs("fs2-10-5.bin.solucao", 2, 10, 5);
@@ -94,6 +105,1131 @@ TEST(FsTest, case12){
     ASSERT_EQ(printSha256("fs-case12.bin.solucao"),std::string("BC:2B:05:C8:8B:DF:02:41:3B:E3:86:8E:4C:CC:C1:FF:63:87:F9:A5:24:15:16:49:83:88:F0:75:18:D1:1B:BE"));
     }
 
+TEST(FsTest, sessao){
+    duplicate("fs-case4.bin", "fs-sessao.bin.solucao");
+
+    // Mesma sequência dos casos 4, 5 e 6 aplicada em uma única sessão.
+    FsHandle *fs = openFs("fs-sessao.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/teste.txt", "abc");
+    addDir(fs, "/dec7556");
+    addFile(fs, "/dec7556/t2.txt", "fghi");
+    closeFs(fs);
+    ASSERT_EQ(printSha256("fs-sessao.bin.solucao"),std::string("C5:D5:15:D8:2F:09:15:49:D9:A2:B5:58:36:E7:DC:28:E5:C4:14:02:1D:03:0E:A8:4E:40:EE:76:BF:05:F0:C6"));
+    }
+
+TEST(FsTest, sessaoMmap){
+    duplicate("fs-case9.bin", "fs-mmap.bin.solucao");
+
+    FsOptions options;
+    options.useMmap = true;
+    FsHandle *fs = openFs("fs-mmap.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    move(fs, "/dec7556/t2.txt", "/t2.txt");
+    closeFs(fs);
+    ASSERT_EQ(printSha256("fs-mmap.bin.solucao"),std::string("48:D0:98:B2:5F:BF:D8:4B:A6:37:1F:9A:13:8F:C0:D2:2B:6E:21:39:AB:67:15:7F:DF:AE:3E:23:6D:85:49:04"));
+    }
+
+TEST(FsTest, gravaApenasAlterado){
+    duplicate("fs-case4.bin", "fs-sujo.bin.solucao");
+
+    FsHandle *fs = openFs("fs-sujo.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/teste.txt", "abc");
+
+    // Último byte do arquivo (bloco 7) alterado por fora da sessão: como o bloco 7
+    // não foi tocado por addFile, o fechamento não pode sobrescrevê-lo.
+    FILE *f = fopen("fs-sujo.bin.solucao", "r+b");
+    fseek(f, -1, SEEK_END);
+    fputc(0x5A, f);
+    fclose(f);
+    closeFs(fs);
+
+    std::ifstream in("fs-sujo.bin.solucao", std::ios::binary);
+    in.seekg(-1, std::ios::end);
+    ASSERT_EQ(in.get(), 0x5A);
+    }
+
+TEST(FsTest, bitmapAlemDoPrimeiroByte){
+    // 20 blocos de 4 bytes: os quatro arquivos ocupam os blocos 1 a 12, que passam do primeiro byte do mapa de bits.
+    initFs("fs-bitmap.bin.solucao", 4, 20, 6);
+    FsHandle *fs = openFs("fs-bitmap.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/a.txt", "abcdefghijkl");
+    addFile(fs, "/b.txt", "mnopqrstuvwx");
+    addFile(fs, "/c.txt", "ABCDEFGHIJKL");
+    addFile(fs, "/d.txt", "MNOPQRSTUVWX");
+    closeFs(fs);
+
+    std::vector<unsigned char> bytes = readBytes("fs-bitmap.bin.solucao");
+    ASSERT_EQ(bytes[3], 0xFF);
+    ASSERT_EQ(bytes[4], 0x1F);
+    ASSERT_EQ(bytes[5], 0x00);
+    }
+
+TEST(FsTest, semBlocosLivres){
+    initFs("fs-cheio.bin.solucao", 1, 4, 4);
+    std::vector<unsigned char> antes = readBytes("fs-cheio.bin.solucao");
+
+    // Só existem 3 blocos livres: o arquivo de 4 bytes não cabe e nada é alterado.
+    addFile("fs-cheio.bin.solucao", "/grande.txt", "abcd");
+    ASSERT_EQ(readBytes("fs-cheio.bin.solucao"), antes);
+    }
+
+TEST(FsTest, semInodesLivres){
+    // Dois inodes: a raiz e um arquivo. O segundo arquivo não tem inode e não pode sobrescrever a raiz.
+    initFs("fs-inodes.bin.solucao", 2, 8, 2);
+    addFile("fs-inodes.bin.solucao", "/a.txt", "ab");
+    std::vector<unsigned char> antes = readBytes("fs-inodes.bin.solucao");
+
+    addFile("fs-inodes.bin.solucao", "/b.txt", "cd");
+    ASSERT_EQ(readBytes("fs-inodes.bin.solucao"), antes);
+    }
+
+TEST(FsTest, caminhoAninhado){
+    // Dois diretórios com um filho de mesmo nome: o caminho decide qual é o pai, não o nome global.
+    initFs("fs-aninhado.bin.solucao", 4, 16, 8);
+    FsHandle *fs = openFs("fs-aninhado.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    addDir(fs, "/a");
+    addDir(fs, "/b");
+    addDir(fs, "/a/x");
+    addDir(fs, "/b/x");
+    addFile(fs, "/b/x/f.txt", "oi");
+    remove(fs, "/a/x");
+    closeFs(fs);
+
+    // Inodes: 0 raiz, 1 /a, 2 /b, 3 /a/x (removido), 4 /b/x, 5 /b/x/f.txt
+    std::vector<unsigned char> bytes = readBytes("fs-aninhado.bin.solucao");
+    const int inodes = 3 + 2;
+    ASSERT_EQ(bytes[inodes + 22 * 3], 0x00);
+    ASSERT_EQ(bytes[inodes + 22 * 4], 0x01);
+    ASSERT_EQ(bytes[inodes + 22 * 5], 0x01);
+    ASSERT_EQ(bytes[inodes + 22 * 1 + 12], 0);
+    ASSERT_EQ(bytes[inodes + 22 * 4 + 12], 1);
+    }
+
+TEST(FsTest, caminhoInvalido){
+    // A raiz não tem nome: criá-la, removê-la ou movê-la de ou para ela não altera nada.
+    initFs("fs-invalido.bin", 4, 16, 8);
+    addFile("fs-invalido.bin", "/a.txt", "ab");
+    std::vector<unsigned char> antes = readBytes("fs-invalido.bin");
+
+    FsHandle *fs = openFs("fs-invalido.bin");
+    ASSERT_NE(fs, nullptr);
+    addDir(fs, "/");
+    addDir(fs, "//");
+    addFile(fs, "/", "cd");
+    move(fs, "/a.txt", "/");
+    move(fs, "/", "/b");
+    remove(fs, "/");
+    FsStat info;
+    ASSERT_TRUE(stat(fs, "/", &info));
+    ASSERT_EQ(info.size, 1u);
+    ASSERT_TRUE(stat(fs, "/a.txt", &info));
+    closeFs(fs);
+    ASSERT_EQ(readBytes("fs-invalido.bin"), antes);
+    std::remove("fs-invalido.bin");
+    }
+
+TEST(FsTest, lote){
+    duplicate("fs-case4.bin", "fs-lote.bin.solucao");
+
+    // Mesma sequência do teste sessao, lida de um log com comentário, linha vazia e uma operação inválida.
+    std::ofstream log("fs-lote.log");
+    log << "# casos 4, 5 e 6\n"
+        << "addFile /teste.txt abc\n"
+        << "\n"
+        << "addDir /dec7556\n"
+        << "desconhecida /x\n"
+        << "addFile /dec7556/t2.txt fghi\n";
+    log.close();
+
+    FsHandle *fs = openFs("fs-lote.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    std::vector<FsBatchEntry> entries;
+    ASSERT_EQ(applyBatch(fs, "fs-lote.log", &entries), 3);
+    closeFs(fs);
+    std::remove("fs-lote.log");
+
+    ASSERT_EQ(entries.size(), 3u);
+    ASSERT_EQ(entries[2].line, 6);
+    ASSERT_STREQ(entries[1].operation, "addDir");
+    ASSERT_EQ(printSha256("fs-lote.bin.solucao"),std::string("C5:D5:15:D8:2F:09:15:49:D9:A2:B5:58:36:E7:DC:28:E5:C4:14:02:1D:03:0E:A8:4E:40:EE:76:BF:05:F0:C6"));
+    }
+
+TEST(FsTest, diario){
+    duplicate("fs-case4.bin", "fs-diario.bin.solucao");
+
+    FsOptions options;
+    options.journal = true;
+    options.groupCommit = 1;
+    FsHandle *fs = openFs("fs-diario.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/teste.txt", "abc");
+    addDir(fs, "/dec7556");
+    addFile(fs, "/dec7556/t2.txt", "fghi");
+    closeFs(fs);
+
+    // O fechamento faz o checkpoint e apaga o diário.
+    ASSERT_EQ(fopen("fs-diario.bin.solucao.journal", "rb"), nullptr);
+    ASSERT_EQ(printSha256("fs-diario.bin.solucao"),std::string("C5:D5:15:D8:2F:09:15:49:D9:A2:B5:58:36:E7:DC:28:E5:C4:14:02:1D:03:0E:A8:4E:40:EE:76:BF:05:F0:C6"));
+    }
+
+TEST(FsTest, diarioReaplicado){
+    duplicate("fs-case4.bin", "fs-reaplicado.bin.solucao");
+    std::vector<unsigned char> antes = readBytes("fs-reaplicado.bin.solucao");
+
+    // Duas transações confirmadas no diário; o diário é guardado antes do checkpoint do fechamento.
+    FsOptions options;
+    options.journal = true;
+    FsHandle *fs = openFs("fs-reaplicado.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/teste.txt", "abc");
+    addDir(fs, "/dec7556");
+    flushFs(fs);
+    addFile(fs, "/dec7556/t2.txt", "fghi");
+    flushFs(fs);
+    std::vector<unsigned char> diario = readBytes("fs-reaplicado.bin.solucao.journal");
+    closeFs(fs);
+
+    // Queda simulada: os metadados gravados no lugar se perderam, o diário ficou, com lixo
+    // de uma terceira transação interrompida no fim. Os dados (modo ordenado) já estavam no disco.
+    std::vector<unsigned char> depois = readBytes("fs-reaplicado.bin.solucao");
+    std::vector<unsigned char> imagem = antes;
+    const int blocos = 3 + 1 + 22 * 6 + 1;
+    std::copy(depois.begin() + blocos, depois.end(), imagem.begin() + blocos);
+    std::ofstream("fs-reaplicado.bin.solucao", std::ios::binary).write((const char *)imagem.data(), imagem.size());
+    std::ofstream log("fs-reaplicado.bin.solucao.journal", std::ios::binary);
+    log.write((const char *)diario.data(), diario.size());
+    log << "EXTJ\x02";
+    log.close();
+
+    fs = openFs("fs-reaplicado.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    closeFs(fs);
+    ASSERT_EQ(printSha256("fs-reaplicado.bin.solucao"),std::string("C5:D5:15:D8:2F:09:15:49:D9:A2:B5:58:36:E7:DC:28:E5:C4:14:02:1D:03:0E:A8:4E:40:EE:76:BF:05:F0:C6"));
+    }
+
+TEST(FsTest, diarioBlocoLiberado){
+    // Blocos de 2 bytes: a raiz ocupa um e os arquivos os outros três.
+    initFs("fs-liberado.bin", 2, 4, 4);
+    FsOptions options;
+    options.journal = true;
+    FsHandle *fs = openFs("fs-liberado.bin", options);
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/a", "ab");
+    addFile(fs, "/c", "cdef");
+    ASSERT_TRUE(flushFs(fs));
+
+    // O bloco de /a só volta a ficar livre quando a remoção for confirmada: antes disso, /b não
+    // pode gravar dados por cima de um bloco que o inode confirmado de /a ainda aponta.
+    remove(fs, "/a");
+    addFile(fs, "/b", "gh");
+    FsStat info;
+    ASSERT_FALSE(stat(fs, "/b", &info));
+    ASSERT_TRUE(flushFs(fs));
+    addFile(fs, "/b", "gh");
+    ASSERT_TRUE(stat(fs, "/b", &info));
+    closeFs(fs);
+    std::remove("fs-liberado.bin");
+    }
+
+TEST(FsTest, diarioFalhaGravacao){
+    initFs("fs-falha.bin", 4, 32, 8);
+    duplicate("fs-falha.bin", "fs-falha-ref.bin");
+    FsHandle *fs = openFs("fs-falha-ref.bin");
+    ASSERT_NE(fs, nullptr);
+    addDir(fs, "/a");
+    addDir(fs, "/a/b");
+    addDir(fs, "/c");
+    closeFs(fs);
+
+    FsOptions options;
+    options.journal = true;
+    fs = openFs("fs-falha.bin", options);
+    ASSERT_NE(fs, nullptr);
+    addDir(fs, "/a");
+    addDir(fs, "/a/b");
+    addDir(fs, "/c");
+    std::vector<unsigned char> antes = readBytes("fs-falha.bin");
+
+    // Com o limite de tamanho de arquivo, o registro da transação não cabe no diário: o commit é
+    // abandonado e nada é gravado no lugar.
+    struct rlimit limite;
+    getrlimit(RLIMIT_FSIZE, &limite);
+    struct rlimit pequeno = limite;
+    pequeno.rlim_cur = 64;
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &pequeno);
+    bool confirmada = flushFs(fs);
+    setrlimit(RLIMIT_FSIZE, &limite);
+    signal(SIGXFSZ, SIG_DFL);
+    ASSERT_FALSE(confirmada);
+    ASSERT_EQ(readBytes("fs-falha.bin"), antes);
+
+    ASSERT_TRUE(flushFs(fs));
+    closeFs(fs);
+    ASSERT_EQ(readBytes("fs-falha.bin"), readBytes("fs-falha-ref.bin"));
+    std::remove("fs-falha.bin");
+    std::remove("fs-falha-ref.bin");
+    }
+
+TEST(FsTest, diarioFalhaDados){
+    std::remove("fs-falhadados.bin.journal");
+    initFs("fs-falhadados.bin", 4, 32, 8);
+    duplicate("fs-falhadados.bin", "fs-falhadados-ref.bin");
+    FsHandle *fs = openFs("fs-falhadados-ref.bin");
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/a.txt", "abcd");
+    closeFs(fs);
+
+    FsOptions options;
+    options.journal = true;
+    fs = openFs("fs-falhadados.bin", options);
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/a.txt", "abcd");
+    std::vector<unsigned char> antes = readBytes("fs-falhadados.bin");
+
+    // 3 bytes de cabeçalho, 4 do mapa de bits e 8 inodes de 22 bytes: os blocos começam em 183 e o de
+    // /a.txt (bloco 1) em 187. Com o limite em 186, a gravação dos dados falha e o commit não pode
+    // apontar para eles.
+    struct rlimit limite;
+    getrlimit(RLIMIT_FSIZE, &limite);
+    struct rlimit pequeno = limite;
+    pequeno.rlim_cur = 186;
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &pequeno);
+    bool confirmada = flushFs(fs);
+    setrlimit(RLIMIT_FSIZE, &limite);
+    signal(SIGXFSZ, SIG_DFL);
+    ASSERT_FALSE(confirmada);
+    ASSERT_EQ(readBytes("fs-falhadados.bin"), antes);
+    std::vector<unsigned char> diario = readBytes("fs-falhadados.bin.journal");
+    ASSERT_TRUE(diario.empty());
+
+    ASSERT_TRUE(flushFs(fs));
+    closeFs(fs);
+    ASSERT_EQ(readBytes("fs-falhadados.bin"), readBytes("fs-falhadados-ref.bin"));
+    std::remove("fs-falhadados.bin");
+    std::remove("fs-falhadados-ref.bin");
+    }
+
+TEST(FsTest, diarioRestanteSemOpcao){
+    std::remove("fs-restante.bin.journal");
+    duplicate("fs-case4.bin", "fs-restante.bin");
+    duplicate("fs-case4.bin", "fs-restante-ref.bin");
+    FsHandle *fs = openFs("fs-restante-ref.bin");
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/teste.txt", "abc");
+    addDir(fs, "/dec7556");
+    remove(fs, "/teste.txt");
+    closeFs(fs);
+
+    // Diário de uma sessão cujo checkpoint falhou: os metadados já estão no lugar, mas o diário ficou.
+    FsOptions options;
+    options.journal = true;
+    fs = openFs("fs-restante.bin", options);
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/teste.txt", "abc");
+    addDir(fs, "/dec7556");
+    ASSERT_TRUE(flushFs(fs));
+    std::vector<unsigned char> diario = readBytes("fs-restante.bin.journal");
+    closeFs(fs);
+    std::ofstream("fs-restante.bin.journal", std::ios::binary).write((const char *)diario.data(), diario.size());
+
+    // Se a reaplicação não chegar à imagem, a abertura falha e o diário continua inteiro.
+    struct rlimit limite;
+    getrlimit(RLIMIT_FSIZE, &limite);
+    struct rlimit pequeno = limite;
+    pequeno.rlim_cur = 1;
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &pequeno);
+    FsHandle *falha = openFs("fs-restante.bin", options);
+    setrlimit(RLIMIT_FSIZE, &limite);
+    signal(SIGXFSZ, SIG_DFL);
+    ASSERT_EQ(falha, nullptr);
+    ASSERT_EQ(readBytes("fs-restante.bin.journal"), diario);
+
+    // Uma chamada de fs.h (sem diário) reaplica e apaga o diário antes de alterar a imagem; a abertura
+    // seguinte com diário não tem mais transações antigas para gravar por cima.
+    remove("fs-restante.bin", "/teste.txt");
+    ASSERT_EQ(fopen("fs-restante.bin.journal", "rb"), nullptr);
+    fs = openFs("fs-restante.bin", options);
+    ASSERT_NE(fs, nullptr);
+    closeFs(fs);
+    ASSERT_EQ(readBytes("fs-restante.bin"), readBytes("fs-restante-ref.bin"));
+    std::remove("fs-restante.bin");
+    std::remove("fs-restante-ref.bin");
+    }
+
+TEST(FsTest, blocosIndiretos){
+    // Blocos de 2 bytes: 40 bytes ocupam 20 blocos, 3 diretos, 6 por tabelas indiretas e 11 pela duplamente indireta.
+    initFs("fs-indireto.bin.solucao", 2, 64, 4);
+    std::string conteudo = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMN";
+    addFile("fs-indireto.bin.solucao", "/grande.txt", conteudo);
+
+    // Segue o mapa de blocos do inode 1 direto nos bytes da imagem.
+    std::vector<unsigned char> bytes = readBytes("fs-indireto.bin.solucao");
+    const int inode = 3 + 8 + 22;
+    const int blocos = 3 + 8 + 22 * 4 + 1;
+    auto bloco = [&](int b) { return &bytes[blocos + 2 * b]; };
+    ASSERT_EQ(bytes[inode + 12], 40);
+
+    std::vector<int> mapa;
+    for (int i = 0; i < 3; i++)
+    {
+        mapa.push_back(bytes[inode + 13 + i]);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 2; j++)
+        {
+            mapa.push_back(bloco(bytes[inode + 16 + i])[j]);
+        }
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 2; j++)
+        {
+            for (int k = 0; k < 2 && mapa.size() < 20; k++)
+            {
+                mapa.push_back(bloco(bloco(bytes[inode + 19 + i])[j])[k]);
+            }
+        }
+    }
+
+    std::string lido;
+    for (int b : mapa)
+    {
+        lido.append((const char *)bloco(b), 2);
+    }
+    ASSERT_EQ(lido, conteudo);
+
+    // Remover libera os dados e as tabelas: só o bloco da raiz continua marcado.
+    remove("fs-indireto.bin.solucao", "/grande.txt");
+    bytes = readBytes("fs-indireto.bin.solucao");
+    ASSERT_EQ(bytes[3], 0x01);
+    for (int i = 4; i < 3 + 8; i++)
+    {
+        ASSERT_EQ(bytes[i], 0x00);
+    }
+    }
+
+TEST(FsTest, extents){
+    initFs("fs-extents.bin.solucao", 4, 32, 8);
+    FsOptions options;
+    options.extents = true;
+    FsHandle *fs = openFs("fs-extents.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/a.txt", "aaaa");
+    addFile(fs, "/b.txt", "bbbbbbbb");
+    addFile(fs, "/c.txt", "cccc");
+    remove(fs, "/b.txt");
+
+    // 40 bytes = 10 blocos: o buraco de 2 blocos deixado por b.txt é pulado em favor de uma sequência inteira.
+    addFile(fs, "/grande.txt", "0123456789012345678901234567890123456789");
+    closeFs(fs);
+
+    std::vector<unsigned char> bytes = readBytes("fs-extents.bin.solucao");
+    const int inodes = 3 + 4;
+    const int blocos = inodes + 22 * 8 + 1;
+    // Inode 2 (de b.txt) foi reaproveitado: formato com extents, um extent (bloco 5, 10 blocos).
+    ASSERT_EQ(bytes[inodes + 22 * 2 + 1], 0x02);
+    ASSERT_EQ(bytes[inodes + 22 * 2 + 13], 1);
+    ASSERT_EQ(bytes[inodes + 22 * 2 + 14], 5);
+    ASSERT_EQ(bytes[inodes + 22 * 2 + 15], 10);
+    ASSERT_EQ(std::string((const char *)&bytes[blocos + 4 * 5], 40), "0123456789012345678901234567890123456789");
+
+    // Remover libera o extent inteiro.
+    remove("fs-extents.bin.solucao", "/grande.txt");
+    bytes = readBytes("fs-extents.bin.solucao");
+    ASSERT_EQ(bytes[3], 0x13);
+    ASSERT_EQ(bytes[4], 0x00);
+    }
+
+TEST(FsTest, formatoV2){
+    // 1000 blocos e 300 inodes não cabem nos campos de um byte do v1.
+    initFsV2("fs-v2.bin.solucao", 16, 1000, 300);
+    FsHandle *fs = openFs("fs-v2.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    addDir(fs, "/d");
+
+    // 1000 bytes = 63 blocos de 16 bytes: usa os ponteiros diretos, indiretos e duplamente indiretos.
+    std::string conteudo;
+    for (int i = 0; i < 1000; i++) {
+        conteudo += (char)('a' + i % 26);
+    }
+    addFile(fs, "/d/grande.txt", conteudo);
+    closeFs(fs);
+
+    std::vector<unsigned char> bytes = readBytes("fs-v2.bin.solucao");
+    auto le32 = [&](size_t p) { return bytes[p] | bytes[p + 1] << 8 | bytes[p + 2] << 16 | (uint32_t)bytes[p + 3] << 24; };
+    const size_t inodes = 32 + 125;
+    const size_t blocos = inodes + 64 * 300;
+    ASSERT_EQ(bytes.size(), blocos + 16 * 1000);
+    ASSERT_EQ(std::string((const char *)&bytes[0], 4), std::string("\0EX3", 4));
+    ASSERT_EQ(le32(4), 2u);
+    ASSERT_EQ(le32(8), 16u);
+    ASSERT_EQ(le32(12), 1000u);
+    ASSERT_EQ(le32(16), 300u);
+
+    // Raiz -> /d (inode 1) -> grande.txt (inode 2), com SIZE de 64 bits.
+    ASSERT_EQ(le32(blocos + 16 * le32(inodes + 24)), 1u);
+    ASSERT_EQ(le32(blocos + 16 * le32(inodes + 64 + 24)), 2u);
+    ASSERT_EQ(le32(inodes + 64 + 16), 1u);
+    ASSERT_EQ(le32(inodes + 128 + 16), 1000u);
+    ASSERT_EQ(std::string((const char *)&bytes[inodes + 128 + 2]), "grande.txt");
+
+    // Conteúdo pelos três níveis do mapa: primeiro bloco direto, primeiro bloco indireto e último bloco duplamente indireto.
+    const size_t inode = inodes + 128 + 24;
+    ASSERT_EQ(std::string((const char *)&bytes[blocos + 16 * le32(inode)], 16), conteudo.substr(0, 16));
+    uint32_t indireto = le32(inode + 4 * 3);
+    ASSERT_EQ(std::string((const char *)&bytes[blocos + 16 * le32(blocos + 16 * indireto)], 16), conteudo.substr(48, 16));
+    uint32_t duplo = le32(inode + 4 * 8);
+    uint32_t tabela = le32(blocos + 16 * duplo + 4 * 3);
+    ASSERT_EQ(std::string((const char *)&bytes[blocos + 16 * le32(blocos + 16 * tabela + 4 * 3)], 8), conteudo.substr(992, 8));
+
+    // Remover libera dados e tabelas: só os blocos da raiz e de /d continuam em uso.
+    remove("fs-v2.bin.solucao", "/d/grande.txt");
+    bytes = readBytes("fs-v2.bin.solucao");
+    ASSERT_EQ(bytes[32], 0x03);
+    for (int i = 1; i < 125; i++) {
+        ASSERT_EQ(bytes[32 + i], 0x00);
+    }
+
+    // Índices de blocos e inodes são int no motor: geometrias além de INT32_MAX não são criadas nem montadas.
+    initFsV2("fs-v2-grande.bin", 16, 0x80000000u, 300);
+    ASSERT_TRUE(readBytes("fs-v2-grande.bin").empty());
+    bytes.resize(32);
+    bytes[19] = 0x80;
+    {
+        std::ofstream grande("fs-v2-grande.bin", std::ios::binary);
+        grande.write((const char *)bytes.data(), bytes.size());
+    }
+    ASSERT_EQ(openFs("fs-v2-grande.bin"), nullptr);
+    std::remove("fs-v2-grande.bin");
+    }
+
+TEST(FsTest, leitura){
+    // Blocos de 2 bytes: a leitura passa pelos ponteiros diretos, indiretos e duplamente indiretos.
+    initFs("fs-leitura.bin.solucao", 2, 64, 6);
+    std::string conteudo = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMN";
+    FsHandle *fs = openFs("fs-leitura.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    addDir(fs, "/d");
+    addFile(fs, "/d/a.txt", "xyz");
+    addFile(fs, "/d/grande.txt", conteudo);
+
+    std::string lido;
+    ASSERT_TRUE(readFile(fs, "/d/grande.txt", lido));
+    ASSERT_EQ(lido, conteudo);
+    ASSERT_TRUE(readFile(fs, "/d/a.txt", lido));
+    ASSERT_EQ(lido, "xyz");
+
+    // Leituras posicionais: começo e fim no meio de blocos, além do fim e fora do arquivo.
+    char buffer[64];
+    ASSERT_EQ(readAt(fs, "/d/grande.txt", 5, buffer, 20), 20);
+    ASSERT_EQ(std::string(buffer, 20), conteudo.substr(5, 20));
+    ASSERT_EQ(readAt(fs, "/d/grande.txt", 35, buffer, 64), 5);
+    ASSERT_EQ(std::string(buffer, 5), "JKLMN");
+    ASSERT_EQ(readAt(fs, "/d/grande.txt", 40, buffer, 64), 0);
+    ASSERT_EQ(readAt(fs, "/d", 0, buffer, 64), -1);
+    ASSERT_EQ(readAt(fs, "/d/nada.txt", 0, buffer, 64), -1);
+    ASSERT_FALSE(readFile(fs, "/nada.txt", lido));
+    closeFs(fs);
+
+    // Arquivos no formato com extents e imagens mapeadas são lidos da mesma forma.
+    FsOptions options;
+    options.useMmap = true;
+    options.extents = true;
+    fs = openFs("fs-leitura.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/b.txt", "0123456789");
+    ASSERT_EQ(readAt(fs, "/b.txt", 3, buffer, 4), 4);
+    ASSERT_EQ(std::string(buffer, 4), "3456");
+    ASSERT_TRUE(readFile(fs, "/d/grande.txt", lido));
+    ASSERT_EQ(lido, conteudo);
+    closeFs(fs);
+    }
+
+TEST(FsTest, alteracao){
+    initFs("fs-alteracao.bin.solucao", 2, 64, 6);
+    FsHandle *fs = openFs("fs-alteracao.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/a.txt", "abcdef");
+
+    // Sobrescrever no lugar não aloca blocos.
+    std::string lido;
+    ASSERT_TRUE(writeAt(fs, "/a.txt", 2, "XY", 2));
+    ASSERT_TRUE(readFile(fs, "/a.txt", lido));
+    ASSERT_EQ(lido, "abXYef");
+
+    // Acrescentar 34 bytes leva o arquivo até os ponteiros duplamente indiretos.
+    std::string resto = "ghijklmnopqrstuvwxyzABCDEFGHIJKLMN";
+    ASSERT_TRUE(append(fs, "/a.txt", resto.data(), resto.size()));
+    ASSERT_TRUE(readFile(fs, "/a.txt", lido));
+    ASSERT_EQ(lido, "abXYef" + resto);
+
+    // Encurtar devolve os blocos de dados e as tabelas: só a raiz e os dois primeiros blocos ficam em uso.
+    ASSERT_TRUE(truncate(fs, "/a.txt", 3));
+    closeFs(fs);
+    std::vector<unsigned char> bytes = readBytes("fs-alteracao.bin.solucao");
+    ASSERT_EQ(bytes[3], 0x07);
+    for (int i = 4; i < 3 + 8; i++) {
+        ASSERT_EQ(bytes[i], 0x00);
+    }
+
+    // Crescer com truncate ou gravando depois do fim preenche com 0x00, mesmo sobre restos antigos do bloco.
+    fs = openFs("fs-alteracao.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    ASSERT_TRUE(truncate(fs, "/a.txt", 6));
+    ASSERT_TRUE(writeAt(fs, "/a.txt", 9, "Z", 1));
+    ASSERT_TRUE(readFile(fs, "/a.txt", lido));
+    ASSERT_EQ(lido, std::string("abX\0\0\0\0\0\0Z", 10));
+
+    // SIZE do v1 tem um byte: o arquivo não passa de 255 bytes e não muda se a operação falhar.
+    std::string grande(300, 'g');
+    ASSERT_FALSE(append(fs, "/a.txt", grande.data(), grande.size()));
+    ASSERT_FALSE(writeAt(fs, "/nada.txt", 0, "x", 1));
+    ASSERT_FALSE(truncate(fs, "/", 0));
+    ASSERT_TRUE(readFile(fs, "/a.txt", lido));
+    ASSERT_EQ(lido.size(), 10u);
+    closeFs(fs);
+
+    // Com extents, acrescentar aumenta o último extent enquanto o bloco seguinte estiver livre.
+    FsOptions options;
+    options.extents = true;
+    initFs("fs-alteracao.bin.solucao", 2, 64, 6);
+    fs = openFs("fs-alteracao.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/e.txt", "abcd");
+    ASSERT_TRUE(append(fs, "/e.txt", "efghij", 6));
+    ASSERT_TRUE(truncate(fs, "/e.txt", 7));
+    ASSERT_TRUE(readFile(fs, "/e.txt", lido));
+    ASSERT_EQ(lido, "abcdefg");
+    closeFs(fs);
+    bytes = readBytes("fs-alteracao.bin.solucao");
+    const int inode = 3 + 8 + 22;
+    ASSERT_EQ(bytes[inode + 1], 0x02);
+    ASSERT_EQ(bytes[inode + 13], 1);
+    ASSERT_EQ(bytes[inode + 14], 1);
+    ASSERT_EQ(bytes[inode + 15], 4);
+    ASSERT_EQ(bytes[3], 0x1F);
+    }
+
+TEST(FsTest, diretorioGrande){
+    // 2000 entradas de 4 bytes em blocos de 64: o diretório ocupa 125 blocos, pelos ponteiros indiretos e duplamente indiretos.
+    initFsV2("fs-diretorio.bin.solucao", 64, 4000, 2100);
+    FsOptions options;
+    options.hashedDirs = true;
+    FsHandle *fs = openFs("fs-diretorio.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    addDir(fs, "/d");
+    for (int i = 0; i < 2000; i++) {
+        addFile(fs, "/d/f" + std::to_string(i), std::to_string(i));
+    }
+
+    // Remover as entradas pares troca cada uma pela última da lista.
+    for (int i = 0; i < 2000; i += 2) {
+        remove(fs, "/d/f" + std::to_string(i));
+    }
+    closeFs(fs);
+
+    // Reabrir reconstrói o índice a partir das entradas gravadas.
+    fs = openFs("fs-diretorio.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    std::string lido;
+    for (int i = 1; i < 2000; i += 2) {
+        ASSERT_TRUE(readFile(fs, "/d/f" + std::to_string(i), lido));
+        ASSERT_EQ(lido, std::to_string(i));
+    }
+    ASSERT_FALSE(readFile(fs, "/d/f1998", lido));
+    addFile(fs, "/d/f0", "novo");
+    ASSERT_TRUE(readFile(fs, "/d/f0", lido));
+    ASSERT_EQ(lido, "novo");
+
+    // Remover o diretório alcança as entradas guardadas pelos ponteiros indiretos.
+    remove(fs, "/d");
+    closeFs(fs);
+    std::vector<unsigned char> bytes = readBytes("fs-diretorio.bin.solucao");
+    ASSERT_EQ(bytes[32], 0x01);
+    for (int i = 1; i < 500; i++) {
+        ASSERT_EQ(bytes[32 + i], 0x00);
+    }
+    for (int i = 1; i < 2100; i++) {
+        ASSERT_EQ(bytes[32 + 500 + 64 * i], 0x00);
+    }
+    }
+
+TEST(FsTest, criacaoFalhaSemAlterarPai){
+    // Com blocos de 4 bytes (4 entradas por bloco no v1), a raiz cheia precisaria de um segundo bloco
+    // para a próxima entrada. Criações que falham por outro motivo não podem deixá-lo alocado.
+    initFs("fs-pai.bin", 4, 32, 5);
+    FsHandle *fs = openFs("fs-pai.bin");
+    ASSERT_NE(fs, nullptr);
+    addDir(fs, "/a");
+    addDir(fs, "/b");
+    addFile(fs, "/c", "x");
+    addFile(fs, "/d", "y");
+    closeFs(fs);
+    std::vector<unsigned char> antes = readBytes("fs-pai.bin");
+
+    fs = openFs("fs-pai.bin");
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/a/grande.txt", std::string(300, 'z'));
+    addDir(fs, "/e");
+    addFile(fs, "/f", "z");
+    addFile(fs, "/g", std::string(300, 'z'));
+    FsStat info;
+    ASSERT_TRUE(stat(fs, "/", &info));
+    ASSERT_EQ(info.size, 4u);
+    ASSERT_EQ(info.blocks, 1u);
+    closeFs(fs);
+    ASSERT_EQ(readBytes("fs-pai.bin"), antes);
+    std::remove("fs-pai.bin");
+    }
+
+TEST(FsTest, listagem){
+    initFs("fs-listagem.bin.solucao", 4, 32, 8);
+    FsHandle *fs = openFs("fs-listagem.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    addDir(fs, "/d");
+    addFile(fs, "/d/a.txt", "abcdefghijklmnopqrst");
+    addDir(fs, "/d/sub");
+    addFile(fs, "/b.txt", "x");
+
+    // Um buffer de uma entrada percorre a raiz em ordem, uma chamada por entrada.
+    FsStat entrada;
+    std::vector<std::string> nomes;
+    for (uint64_t offset = 0;;) {
+        long n = listDir(fs, "/", offset, &entrada, 1);
+        ASSERT_GE(n, 0);
+        if (n == 0) {
+            break;
+        }
+        nomes.push_back(entrada.name);
+        offset += n;
+    }
+    ASSERT_EQ(nomes, std::vector<std::string>({"d", "b.txt"}));
+
+    FsStat entradas[8];
+    ASSERT_EQ(listDir(fs, "/d", 0, entradas, 8), 2);
+    ASSERT_STREQ(entradas[0].name, "a.txt");
+    ASSERT_FALSE(entradas[0].isDir);
+    ASSERT_EQ(entradas[0].size, 20u);
+    // 5 blocos de dados: 3 diretos e 2 por uma tabela indireta.
+    ASSERT_EQ(entradas[0].blocks, 6u);
+    ASSERT_STREQ(entradas[1].name, "sub");
+    ASSERT_TRUE(entradas[1].isDir);
+    ASSERT_EQ(entradas[1].size, 0u);
+    ASSERT_EQ(entradas[1].blocks, 1u);
+    ASSERT_EQ(listDir(fs, "/d", 2, entradas, 8), 0);
+    ASSERT_EQ(listDir(fs, "/b.txt", 0, entradas, 8), -1);
+
+    FsStat info;
+    ASSERT_TRUE(stat(fs, "/", &info));
+    ASSERT_STREQ(info.name, "/");
+    ASSERT_EQ(info.inode, 0);
+    ASSERT_TRUE(info.isDir);
+    ASSERT_EQ(info.size, 2u);
+    ASSERT_EQ(info.blocks, 1u);
+    ASSERT_TRUE(stat(fs, "/b.txt", &info));
+    ASSERT_EQ(info.size, 1u);
+    ASSERT_EQ(info.blocks, 1u);
+    // Um caminho inexistente é só o resultado de stat, não um erro para o log.
+    testing::internal::CaptureStdout();
+    bool existe = stat(fs, "/nada", &info);
+    ASSERT_EQ(testing::internal::GetCapturedStdout(), "");
+    ASSERT_FALSE(existe);
+    closeFs(fs);
+    }
+
+TEST(FsTest, remocaoProfunda){
+    // 1000 diretórios aninhados, cada um com um arquivo que usa tabelas indiretas (6 blocos por nível).
+    initFsV2("fs-profundo.bin.solucao", 16, 6008, 2001);
+    FsHandle *fs = openFs("fs-profundo.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    std::string caminho;
+    for (int i = 0; i < 1000; i++) {
+        caminho += "/a";
+        addDir(fs, caminho);
+        addFile(fs, caminho + "/f", "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ");
+    }
+    FsStat info;
+    ASSERT_TRUE(stat(fs, caminho + "/f", &info));
+    ASSERT_EQ(info.blocks, 5u);
+
+    // A remoção percorre a árvore sem recursão e libera tudo, inclusive as tabelas indiretas.
+    remove(fs, "/a");
+    closeFs(fs);
+    std::vector<unsigned char> bytes = readBytes("fs-profundo.bin.solucao");
+    ASSERT_EQ(bytes[32], 0x01);
+    for (int i = 1; i < 751; i++) {
+        ASSERT_EQ(bytes[32 + i], 0x00);
+    }
+    for (int i = 1; i < 2001; i++) {
+        ASSERT_EQ(bytes[32 + 751 + 64 * i], 0x00);
+    }
+
+    // Os inodes e blocos liberados voltam a ser usados a partir do início.
+    fs = openFs("fs-profundo.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    addDir(fs, "/b");
+    ASSERT_TRUE(stat(fs, "/b", &info));
+    ASSERT_EQ(info.inode, 1);
+    ASSERT_TRUE(stat(fs, "/", &info));
+    ASSERT_EQ(info.size, 1u);
+    closeFs(fs);
+    }
+
+TEST(FsTest, mover){
+    initFs("fs-mover.bin.solucao", 2, 32, 10);
+    FsHandle *fs = openFs("fs-mover.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    addDir(fs, "/a");
+    addDir(fs, "/a/b");
+    addFile(fs, "/a/b/f.txt", "conteudo");
+    addDir(fs, "/c");
+    addFile(fs, "/c/g.txt", "g");
+    addFile(fs, "/c/h.txt", "h");
+    flushFs(fs);
+
+    // Mover um diretório leva a subárvore junto e altera só os dois pais e o inode movido.
+    std::vector<unsigned char> antes = readBytes("fs-mover.bin.solucao");
+    move(fs, "/a/b", "/c/b2");
+    closeFs(fs);
+    std::vector<unsigned char> depois = readBytes("fs-mover.bin.solucao");
+    const int inodes = 3 + 4;
+    const int blocos = inodes + 22 * 10 + 1;
+    for (size_t i = inodes; i < (size_t)blocos; i++) {
+        int inode = (i - inodes) / 22;
+        if (antes[i] != depois[i]) {
+            ASSERT_TRUE(inode == 1 || inode == 2 || inode == 4) << "inode " << inode;
+        }
+    }
+
+    fs = openFs("fs-mover.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+    std::string lido;
+    ASSERT_TRUE(readFile(fs, "/c/b2/f.txt", lido));
+    ASSERT_EQ(lido, "conteudo");
+    FsStat entradas[4];
+    ASSERT_EQ(listDir(fs, "/a", 0, entradas, 4), 0);
+    ASSERT_EQ(listDir(fs, "/c", 0, entradas, 4), 3);
+    ASSERT_STREQ(entradas[2].name, "b2");
+
+    // Renomear no mesmo diretório mantém a posição da entrada.
+    move(fs, "/c/g.txt", "/c/g2.txt");
+    ASSERT_EQ(listDir(fs, "/c", 0, entradas, 4), 3);
+    ASSERT_STREQ(entradas[0].name, "g2.txt");
+
+    // Destino existente, diretório para dentro de si mesmo e origem inexistente não mudam nada.
+    move(fs, "/c/h.txt", "/c/g2.txt");
+    move(fs, "/c", "/c/b2/c");
+    move(fs, "/nada", "/a/nada");
+    ASSERT_TRUE(readFile(fs, "/c/h.txt", lido));
+    ASSERT_EQ(lido, "h");
+    ASSERT_EQ(listDir(fs, "/", 0, entradas, 4), 2);
+    ASSERT_EQ(listDir(fs, "/c/b2", 0, entradas, 4), 1);
+    closeFs(fs);
+    }
+
+TEST(FsTest, logTrace){
+    initFs("fs-trace.bin.solucao", 4, 32, 8);
+    FsHandle *fs = openFs("fs-trace.bin.solucao");
+    ASSERT_NE(fs, nullptr);
+
+    // O nível escolhido em tempo de execução decide se a mensagem de erro aparece.
+    std::string lido;
+    testing::internal::CaptureStdout();
+    readFile(fs, "/nada", lido);
+    ASSERT_EQ(testing::internal::GetCapturedStdout(), "Arquivo não encontrado!\n");
+    setLogLevel(-1);
+    testing::internal::CaptureStdout();
+    readFile(fs, "/nada", lido);
+    ASSERT_EQ(testing::internal::GetCapturedStdout(), "");
+    setLogLevel(1);
+
+    // O buffer circular guarda só os últimos registros.
+    enableTrace(4);
+    addDir(fs, "/d");
+    addFile(fs, "/d/a.txt", "abcdef");
+    move(fs, "/d/a.txt", "/a.txt");
+    remove(fs, "/d");
+    flushFs(fs);
+    ASSERT_EQ(dumpTrace("fs-trace.bin.trace"), 4);
+    enableTrace(0);
+    closeFs(fs);
+
+    struct Registro { uint64_t tempo; uint32_t evento; int32_t inode; uint64_t a; uint64_t b; };
+    std::vector<unsigned char> bytes = readBytes("fs-trace.bin.trace");
+    ASSERT_EQ(bytes.size(), 4 * sizeof(Registro));
+    const Registro *registros = (const Registro *)bytes.data();
+    // addFile, move, remove e a gravação, nessa ordem.
+    ASSERT_EQ(registros[0].evento, 1u);
+    ASSERT_EQ(registros[0].inode, 2);
+    ASSERT_EQ(registros[0].a, 6u);
+    ASSERT_EQ(registros[0].b, 1u);
+    ASSERT_EQ(registros[1].evento, 4u);
+    ASSERT_EQ(registros[1].a, 1u);
+    ASSERT_EQ(registros[1].b, 0u);
+    ASSERT_EQ(registros[2].evento, 3u);
+    ASSERT_EQ(registros[2].inode, 1);
+    ASSERT_EQ(registros[2].a, 1u);
+    ASSERT_EQ(registros[3].evento, 5u);
+    for (int i = 1; i < 4; i++) {
+        ASSERT_LE(registros[i - 1].tempo, registros[i].tempo);
+    }
+    std::remove("fs-trace.bin.trace");
+    }
+
+// Operações concorrentes na mesma sessão, montada com options.
+void exercitarConcorrencia(FsOptions options){
+    initFsV2("fs-concorrente.bin.solucao", 64, 4096, 1024);
+    FsHandle *fs = openFs("fs-concorrente.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    const int threads = 4;
+    const int arquivos = 40;
+    for (int t = 0; t < threads; t++) {
+        addDir(fs, "/d" + std::to_string(t));
+    }
+    addDir(fs, "/x");
+    addDir(fs, "/y");
+    for (int i = 0; i < 20; i++) {
+        addFile(fs, "/x/m" + std::to_string(i), "m");
+    }
+    addFile(fs, "/log", "");
+
+    // Cada thread cria, lê e remove arquivos no seu diretório; ao mesmo tempo, dois movem arquivos
+    // entre /x e /y em sentidos opostos (os dois pais travados na mesma ordem) e um acrescenta a /log.
+    // O segundo às vezes chega antes do primeiro, então as mensagens de arquivo não encontrado são desligadas.
+    setLogLevel(-1);
+    auto conteudo = [](int t, int i) { return std::string(1 + (t * 37 + i * 11) % 150, (char)('a' + t)); };
+    std::vector<std::thread> grupo;
+    for (int t = 0; t < threads; t++) {
+        grupo.emplace_back([&, t]() {
+            std::string dir = "/d" + std::to_string(t) + "/f";
+            std::string lido;
+            for (int i = 0; i < arquivos; i++) {
+                addFile(fs, dir + std::to_string(i), conteudo(t, i));
+                readFile(fs, dir + std::to_string(i), lido);
+                if (lido != conteudo(t, i)) {
+                    ADD_FAILURE() << dir << i;
+                }
+                if (i % 4 == 3) {
+                    remove(fs, dir + std::to_string(i - 1));
+                }
+            }
+        });
+    }
+    grupo.emplace_back([&]() {
+        for (int i = 0; i < 20; i++) {
+            move(fs, "/x/m" + std::to_string(i), "/y/m" + std::to_string(i));
+        }
+    });
+    grupo.emplace_back([&]() {
+        for (int i = 0; i < 20; i++) {
+            move(fs, "/y/m" + std::to_string(i), "/x/n" + std::to_string(i));
+        }
+    });
+    grupo.emplace_back([&]() {
+        for (int i = 0; i < 100; i++) {
+            append(fs, "/log", "0123456789", 10);
+        }
+    });
+    for (std::thread &thread : grupo) {
+        thread.join();
+    }
+    setLogLevel(1);
+    flushFs(fs);
+
+    FsStat entradas[64];
+    std::string lido;
+    for (int t = 0; t < threads; t++) {
+        std::string dir = "/d" + std::to_string(t);
+        ASSERT_EQ(listDir(fs, dir, 0, entradas, 64), arquivos - arquivos / 4);
+        for (int i = 0; i < arquivos; i++) {
+            bool existe = readFile(fs, dir + "/f" + std::to_string(i), lido);
+            ASSERT_EQ(existe, i % 4 != 2);
+            if (existe) {
+                ASSERT_EQ(lido, conteudo(t, i));
+            }
+        }
+    }
+    // Cada arquivo de /x foi movido para /y e, às vezes, de volta (como /x/n...): nenhum se perdeu.
+    ASSERT_EQ(listDir(fs, "/x", 0, entradas, 64) + listDir(fs, "/y", 0, entradas, 64), 20);
+    ASSERT_TRUE(readFile(fs, "/log", lido));
+    ASSERT_EQ(lido.size(), 1000u);
+    closeFs(fs);
+
+    // O que foi gravado é o mesmo estado visto pela sessão.
+    fs = openFs("fs-concorrente.bin.solucao");
+    ASSERT_EQ(listDir(fs, "/d0", 0, entradas, 64), arquivos - arquivos / 4);
+    ASSERT_TRUE(readFile(fs, "/d3/f39", lido));
+    ASSERT_EQ(lido, conteudo(3, 39));
+    closeFs(fs);
+    // A ordem das alocações depende do escalonamento, então a imagem não é comparada com uma solução.
+    std::remove("fs-concorrente.bin.solucao");
+    }
+
+TEST(FsTest, concorrencia){
+    exercitarConcorrencia(FsOptions());
+    }
+
+TEST(FsTest, concorrenciaCache){
+    // Com um cache pequeno, os quadros são criados, despejados e relidos enquanto outras threads os fixam.
+    FsOptions options;
+    options.cacheBlocks = 16;
+    exercitarConcorrencia(options);
+    }
+
+TEST(FsTest, cacheBlocos){
+    // As mesmas operações com a imagem inteira na memória e com um cache de 8 blocos, sem e com o diário:
+    // o cache despeja e relê os blocos (diretório, tabelas indiretas e dados) e as imagens ficam iguais.
+    std::string grande(3000, 'g');
+    auto aplicar = [&](FsHandle *fs) {
+        addDir(fs, "/d");
+        for (int i = 0; i < 40; i++) {
+            addFile(fs, "/d/f" + std::to_string(i), std::string(1 + i * 13, 'a' + i % 26));
+        }
+        addFile(fs, "/g", grande);
+        ASSERT_TRUE(writeAt(fs, "/g", 1000, "XYZ", 3));
+        ASSERT_TRUE(append(fs, "/g", "fim", 3));
+        ASSERT_TRUE(truncate(fs, "/d/f5", 200));
+        for (int i = 0; i < 40; i += 3) {
+            remove(fs, "/d/f" + std::to_string(i));
+        }
+        addDir(fs, "/e");
+        move(fs, "/d/f1", "/e/f1");
+    };
+    std::string esperado = grande;
+    esperado.replace(1000, 3, "XYZ");
+    esperado += "fim";
+
+    initFsV2("fs-cache-ref.bin", 64, 2048, 256);
+    FsHandle *fs = openFs("fs-cache-ref.bin");
+    ASSERT_NE(fs, nullptr);
+    aplicar(fs);
+    FsCacheStats stats;
+    ASSERT_FALSE(cacheStats(fs, &stats));
+    closeFs(fs);
+    std::vector<unsigned char> referencia = readBytes("fs-cache-ref.bin");
+
+    FsOptions options;
+    options.cacheBlocks = 8;
+    initFsV2("fs-cache.bin.solucao", 64, 2048, 256);
+    fs = openFs("fs-cache.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    aplicar(fs);
+    std::string lido;
+    ASSERT_TRUE(readFile(fs, "/g", lido));
+    ASSERT_EQ(lido, esperado);
+    ASSERT_TRUE(readFile(fs, "/e/f1", lido));
+    ASSERT_EQ(lido, std::string(14, 'b'));
+    ASSERT_TRUE(cacheStats(fs, &stats));
+    ASSERT_GT(stats.hits, 0u);
+    ASSERT_GT(stats.evictions, 0u);
+    ASSERT_GT(stats.writebacks, 0u);
+    ASSERT_LE(stats.frames, 8u);
+
+    // A leitura sequencial de /g traz os blocos seguintes junto com cada falta.
+    uint64_t antecipados = stats.readahead;
+    uint64_t faltas = stats.misses;
+    ASSERT_TRUE(readFile(fs, "/g", lido));
+    ASSERT_TRUE(cacheStats(fs, &stats));
+    ASSERT_GT(stats.readahead, antecipados);
+    ASSERT_LT(stats.misses - faltas, (grande.size() + 3) / 64);
+    closeFs(fs);
+    ASSERT_TRUE(readBytes("fs-cache.bin.solucao") == referencia);
+
+    // Com o diário, os metadados ficam presos no cache até o commit de cada operação.
+    options.journal = true;
+    options.groupCommit = 1;
+    initFsV2("fs-cache-diario.bin", 64, 2048, 256);
+    fs = openFs("fs-cache-diario.bin", options);
+    ASSERT_NE(fs, nullptr);
+    aplicar(fs);
+    ASSERT_TRUE(cacheStats(fs, &stats));
+    ASSERT_LE(stats.frames, 8u);
+    closeFs(fs);
+    ASSERT_TRUE(readBytes("fs-cache-diario.bin") == referencia);
+
+    // Com groupCommit = 0 a sessão inteira seria uma só transação, e cada diretório criado prende mais
+    // blocos de metadados. A transação é confirmada antes de eles encherem o cache, que fica no limite.
+    auto criarDiretorios = [&](FsHandle *fs, bool conferirCache) {
+        for (int i = 0; i < 200; i++) {
+            addDir(fs, "/p" + std::to_string(i));
+            if (conferirCache) {
+                ASSERT_TRUE(cacheStats(fs, &stats));
+                ASSERT_LE(stats.frames, 8u);
+            }
+        }
+    };
+    initFsV2("fs-cache-ref.bin", 64, 2048, 256);
+    fs = openFs("fs-cache-ref.bin");
+    ASSERT_NE(fs, nullptr);
+    criarDiretorios(fs, false);
+    closeFs(fs);
+    options.groupCommit = 0;
+    initFsV2("fs-cache-diario.bin", 64, 2048, 256);
+    fs = openFs("fs-cache-diario.bin", options);
+    ASSERT_NE(fs, nullptr);
+    criarDiretorios(fs, true);
+    closeFs(fs);
+    ASSERT_TRUE(readBytes("fs-cache-diario.bin") == readBytes("fs-cache-ref.bin"));
+
+    // O cache não é usado junto com o mapeamento.
+    options.journal = false;
+    options.useMmap = true;
+    ASSERT_EQ(openFs("fs-cache.bin.solucao", options), nullptr);
+    std::remove("fs-cache-ref.bin");
+    std::remove("fs-cache-diario.bin");
+    }
+
+TEST(FsTest, gravacaoAnel){
+    // Com as gravações enviadas juntas pelo io_uring (ou síncronas, se ele não estiver disponível), o resultado
+    // é o mesmo da sessão comum, também com o diário e o cache de blocos.
+    duplicate("fs-case4.bin", "fs-anel.bin.solucao");
+    FsOptions options;
+    options.ioUring = true;
+    FsHandle *fs = openFs("fs-anel.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/teste.txt", "abc");
+    addDir(fs, "/dec7556");
+    addFile(fs, "/dec7556/t2.txt", "fghi");
+    flushFs(fs);
+    FsWriteStats stats;
+    writeStats(fs, &stats);
+    closeFs(fs);
+    ASSERT_EQ(printSha256("fs-anel.bin.solucao"),std::string("C5:D5:15:D8:2F:09:15:49:D9:A2:B5:58:36:E7:DC:28:E5:C4:14:02:1D:03:0E:A8:4E:40:EE:76:BF:05:F0:C6"));
+    if (stats.ioUring) {
+        // Um único io_uring_enter levou todas as gravações do flush.
+        ASSERT_GT(stats.writes, 1u);
+        ASSERT_EQ(stats.submits, 1u);
+    }
+
+    duplicate("fs-case4.bin", "fs-anel.bin.solucao");
+    options.journal = true;
+    options.groupCommit = 1;
+    options.cacheBlocks = 2;
+    fs = openFs("fs-anel.bin.solucao", options);
+    ASSERT_NE(fs, nullptr);
+    addFile(fs, "/teste.txt", "abc");
+    addDir(fs, "/dec7556");
+    addFile(fs, "/dec7556/t2.txt", "fghi");
+    closeFs(fs);
+    ASSERT_EQ(printSha256("fs-anel.bin.solucao"),std::string("C5:D5:15:D8:2F:09:15:49:D9:A2:B5:58:36:E7:DC:28:E5:C4:14:02:1D:03:0E:A8:4E:40:EE:76:BF:05:F0:C6"));
+
+    if (!stats.ioUring) {
+        GTEST_SKIP() << "io_uring indisponível (FS_IO_URING desligado ou recusado pelo kernel): só as gravações síncronas foram exercitadas";
+    }
+    }
+
+TEST(FsTest, sessaoInexistente){
+    ASSERT_EQ(openFs("nao-existe.bin"), nullptr);
+    }
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,466 @@
+#ifndef mapaBlocos_hpp
+#define mapaBlocos_hpp
+
+#include "imagem.hpp"
+#include "alocador.hpp"
+#include "extent.hpp"
+#include <string.h>
+
+using namespace std;
+
+// Mapa de blocos de um inode: tradução do bloco lógico l de um arquivo para o bloco físico.
+// Com P = ponteirosPorBloco() ponteiros por bloco de tabela (um byte cada no v1, quatro no v2):
+//   l < 3                DIRECT_BLOCKS[l]
+//   l < 3 + 3P           INDIRECT_BLOCKS[k] aponta para uma tabela de P ponteiros para dados
+//   l < 3 + 3P + 3P²     DOUBLE_INDIRECT_BLOCKS[k] aponta para uma tabela de P ponteiros para tabelas
+// O ponteiro 0 indica bloco não alocado (o bloco 0 pertence ao diretório raiz).
+// As tabelas são metadados: são marcadas como diretoriosSujos e passam pelo diário.
+//
+// Inodes no formato com extents (extent.hpp) são traduzidos pela sua lista de extents.
+//
+// Cada inode guarda em img.traducoes a última tabela de ponteiros usada, com o intervalo de
+// blocos lógicos que ela cobre. Acessos seguidos dentro desse intervalo (leitura sequencial,
+// ou aleatória dentro de uma mesma tabela) não percorrem os níveis de indireção de novo.
+
+// Maior quantidade de blocos que o mapa de um inode consegue endereçar.
+long maxBlocosArquivo(const Imagem &img)
+{
+  long p = ponteirosPorBloco(img);
+  return 3 + 3 * p + 3 * p * p;
+}
+
+// Esquece a tabela guardada para o inode.
+void esquecerTraducao(Imagem &img, int inodeIndex)
+{
+  img.traducoes[inodeIndex].store(0, memory_order_relaxed);
+}
+
+// Zera os ponteiros de um inode recém-reservado, que podem ter sobrado do uso anterior.
+void limparMapa(Imagem &img, int inodeIndex)
+{
+  for (int k = 0; k < 9; k++)
+  {
+    definirPonteiro(img, inodeIndex, k, 0);
+  }
+  marcarInodeSujo(img, inodeIndex);
+  esquecerTraducao(img, inodeIndex);
+}
+
+// Segue até uma tabela o ponteiro k, que fica no inode (se pai for -1) ou na tabela pai.
+// Se a tabela não existir e criar for true, aloca um bloco zerado para ela; retorna -1 se
+// ela não existir (ou não houver bloco livre).
+int seguirTabela(Imagem &img, int inodeIndex, int pai, long k, bool criar)
+{
+  uint32_t ponteiro = pai == -1 ? ponteiroInode(img, inodeIndex, k) : ponteiroBloco(img, pai, k);
+  if (ponteiro != 0)
+  {
+    return ponteiro;
+  }
+  if (!criar)
+  {
+    return -1;
+  }
+  int b = alocarBloco(img);
+  if (b == -1)
+  {
+    return -1;
+  }
+  BlocoFixado bloco(img, b, GRAVAR_METADADOS);
+  memset(bloco.dados, 0x00, img.blockSize);
+  marcarTabelaSuja(img, b);
+  if (pai == -1)
+  {
+    definirPonteiro(img, inodeIndex, k, b);
+    marcarInodeSujo(img, inodeIndex);
+  }
+  else
+  {
+    definirPonteiroBloco(img, pai, k, b);
+    marcarTabelaSuja(img, pai);
+  }
+  return b;
+}
+
+// Tabela de ponteiros para dados que contém o bloco lógico (l >= 3). Atualiza a tradução
+// guardada do inode. Retorna -1 se a tabela não existir e criar for false.
+int tabelaFolha(Imagem &img, int inodeIndex, long logico, bool criar)
+{
+  uint64_t traducao = img.traducoes[inodeIndex].load(memory_order_relaxed);
+  long p = ponteirosPorBloco(img);
+  long primeiro = traducao >> 32;
+  if (traducao != 0 && logico >= primeiro && logico < primeiro + p)
+  {
+    return (uint32_t)traducao - 1;
+  }
+
+  long r = logico - 3;
+  int tabela;
+  if (r < 3 * p)
+  {
+    tabela = seguirTabela(img, inodeIndex, -1, PONTEIRO_INDIRETO + r / p, criar);
+  }
+  else
+  {
+    r -= 3 * p;
+    int meio = seguirTabela(img, inodeIndex, -1, PONTEIRO_DUPLO + r / (p * p), criar);
+    if (meio == -1)
+    {
+      return -1;
+    }
+    tabela = seguirTabela(img, inodeIndex, meio, (r % (p * p)) / p, criar);
+  }
+  if (tabela == -1)
+  {
+    return -1;
+  }
+
+  // Um intervalo que não cabe em 32 bits não é guardado (só acontece com blocos muito grandes).
+  primeiro = logico - (logico - 3) % p;
+  if (primeiro <= UINT32_MAX)
+  {
+    img.traducoes[inodeIndex].store((uint64_t)primeiro << 32 | ((uint32_t)tabela + 1), memory_order_relaxed);
+  }
+  return tabela;
+}
+
+/**
+ * @brief Traduz um bloco lógico de um inode para o bloco físico.
+ * @param img imagem montada
+ * @param inodeIndex índice do inode
+ * @param logico índice do bloco dentro do arquivo
+ * @return bloco físico, ou -1 se o bloco lógico não estiver mapeado
+ */
+int blocoFisico(Imagem &img, int inodeIndex, long logico)
+{
+  if (usaExtents(img, inodeIndex))
+  {
+    int fisico;
+    return procurarExtent(img, inodeIndex, logico, fisico) == 0 ? -1 : fisico;
+  }
+  if (logico < 0 || logico >= maxBlocosArquivo(img))
+  {
+    return -1;
+  }
+  uint32_t fisico;
+  if (logico < 3)
+  {
+    fisico = ponteiroInode(img, inodeIndex, logico);
+  }
+  else
+  {
+    int tabela = tabelaFolha(img, inodeIndex, logico, false);
+    if (tabela == -1)
+    {
+      return -1;
+    }
+    fisico = ponteiroBloco(img, tabela, (logico - 3) % ponteirosPorBloco(img));
+  }
+  return fisico == 0 ? -1 : fisico;
+}
+
+/**
+ * @brief Traduz um bloco lógico e conta quantos blocos seguintes do arquivo estão em blocos físicos consecutivos,
+ * para que o trecho seja lido ou gravado de uma só vez.
+ * @param img imagem montada
+ * @param inodeIndex índice do inode
+ * @param logico índice do bloco dentro do arquivo
+ * @param maximo maior quantidade de blocos que interessa ao chamador
+ * @param fisico recebe o bloco físico de logico
+ * @return tamanho do trecho contíguo (até maximo), ou 0 se logico não estiver mapeado
+ */
+int trechoContiguo(Imagem &img, int inodeIndex, long logico, int maximo, int &fisico)
+{
+  if (usaExtents(img, inodeIndex))
+  {
+    int tamanho = procurarExtent(img, inodeIndex, logico, fisico);
+    return tamanho < maximo ? tamanho : maximo;
+  }
+  fisico = blocoFisico(img, inodeIndex, logico);
+  if (fisico == -1)
+  {
+    return 0;
+  }
+  int tamanho = 1;
+  while (tamanho < maximo && blocoFisico(img, inodeIndex, logico + tamanho) == fisico + tamanho)
+  {
+    tamanho++;
+  }
+  return tamanho;
+}
+
+/**
+ * @brief Associa o bloco lógico de um inode a um bloco físico, criando as tabelas de ponteiros que faltarem.
+ * @param img imagem montada
+ * @param inodeIndex índice do inode
+ * @param logico índice do bloco dentro do arquivo
+ * @param fisico bloco físico (já alocado)
+ * @return false se o bloco lógico estiver além do mapa ou se não houver blocos livres para as tabelas
+ */
+bool mapearBloco(Imagem &img, int inodeIndex, long logico, int fisico)
+{
+  if (logico < 0 || logico >= maxBlocosArquivo(img))
+  {
+    return false;
+  }
+  if (logico < 3)
+  {
+    definirPonteiro(img, inodeIndex, logico, fisico);
+    marcarInodeSujo(img, inodeIndex);
+    return true;
+  }
+  int tabela = tabelaFolha(img, inodeIndex, logico, true);
+  if (tabela == -1)
+  {
+    return false;
+  }
+  definirPonteiroBloco(img, tabela, (logico - 3) % ponteirosPorBloco(img), fisico);
+  marcarTabelaSuja(img, tabela);
+  return true;
+}
+
+// Acrescenta a blocos os blocos apontados por uma tabela e a própria tabela. Se nivel for 2,
+// a tabela aponta para tabelas de dados, que são percorridas no mesmo laço (sem recursão).
+void coletarTabela(Imagem &img, int tabela, int nivel, vector<int> &blocos)
+{
+  for (int i = 0; i < ponteirosPorBloco(img); i++)
+  {
+    uint32_t b = ponteiroBloco(img, tabela, i);
+    if (b == 0)
+    {
+      continue;
+    }
+    if (nivel == 2)
+    {
+      for (int j = 0; j < ponteirosPorBloco(img); j++)
+      {
+        uint32_t dado = ponteiroBloco(img, b, j);
+        if (dado != 0)
+        {
+          blocos.push_back(dado);
+        }
+      }
+    }
+    blocos.push_back(b);
+  }
+  blocos.push_back(tabela);
+}
+
+/**
+ * @brief Acrescenta a blocos todos os blocos de um inode (dados e tabelas de ponteiros), sem liberá-los.
+ * @param img imagem montada
+ * @param inodeIndex índice do inode
+ * @param blocos recebe os índices dos blocos
+ */
+void coletarMapa(Imagem &img, int inodeIndex, vector<int> &blocos)
+{
+  if (usaExtents(img, inodeIndex))
+  {
+    coletarExtents(img, inodeIndex, blocos);
+    return;
+  }
+
+  for (int i = 0; i < 3; i++)
+  {
+    if (ponteiroInode(img, inodeIndex, i) != 0)
+    {
+      blocos.push_back(ponteiroInode(img, inodeIndex, i));
+    }
+    if (ponteiroInode(img, inodeIndex, PONTEIRO_INDIRETO + i) != 0)
+    {
+      coletarTabela(img, ponteiroInode(img, inodeIndex, PONTEIRO_INDIRETO + i), 1, blocos);
+    }
+    if (ponteiroInode(img, inodeIndex, PONTEIRO_DUPLO + i) != 0)
+    {
+      coletarTabela(img, ponteiroInode(img, inodeIndex, PONTEIRO_DUPLO + i), 2, blocos);
+    }
+  }
+}
+
+/**
+ * @brief Libera todos os blocos de um inode (dados e tabelas de ponteiros). Os ponteiros continuam
+ * no inode, como acontece com os demais campos de um inode livre; quem reaproveita o inode os zera.
+ * @param img imagem montada
+ * @param inodeIndex índice do inode
+ */
+void liberarMapa(Imagem &img, int inodeIndex)
+{
+  VetoresEmprestados vetores(img);
+  vector<int> &blocos = vetores->blocos;
+  blocos.clear();
+  coletarMapa(img, inodeIndex, blocos);
+  liberarBlocos(img, blocos);
+  esquecerTraducao(img, inodeIndex);
+}
+
+// Quantidade de ponteiros diferentes de 0 em uma tabela.
+long contarPonteiros(Imagem &img, int tabela)
+{
+  long total = 0;
+  for (int i = 0; i < ponteirosPorBloco(img); i++)
+  {
+    total += ponteiroBloco(img, tabela, i) != 0;
+  }
+  return total;
+}
+
+/**
+ * @brief Conta os blocos ocupados por um inode: blocos de dados (ou de entradas de diretório) e tabelas de ponteiros.
+ * @param img imagem montada
+ * @param inodeIndex índice do inode
+ * @return quantidade de blocos; o bloco 0 da raiz, que o mapa não distingue de um ponteiro vazio, não é contado
+ */
+long contarBlocos(Imagem &img, int inodeIndex)
+{
+  long total = 0;
+  if (usaExtents(img, inodeIndex))
+  {
+    for (int e = 0; e < quantidadeExtents(img, inodeIndex); e++)
+    {
+      total += tamanhoExtent(img, inodeIndex, e);
+    }
+    return total;
+  }
+
+  for (int k = 0; k < 3; k++)
+  {
+    total += ponteiroInode(img, inodeIndex, k) != 0;
+    uint32_t tabela = ponteiroInode(img, inodeIndex, PONTEIRO_INDIRETO + k);
+    if (tabela != 0)
+    {
+      total += 1 + contarPonteiros(img, tabela);
+    }
+    uint32_t meio = ponteiroInode(img, inodeIndex, PONTEIRO_DUPLO + k);
+    if (meio != 0)
+    {
+      total++;
+      for (int j = 0; j < ponteirosPorBloco(img); j++)
+      {
+        tabela = ponteiroBloco(img, meio, j);
+        if (tabela != 0)
+        {
+          total += 1 + contarPonteiros(img, tabela);
+        }
+      }
+    }
+  }
+  return total;
+}
+
+/**
+ * @brief Libera os blocos lógicos de primeiro até blocos - 1 e as tabelas de ponteiros que passam a cobrir apenas
+ * blocos liberados. Os blocos antes de primeiro não são visitados.
+ * @param img imagem montada
+ * @param inodeIndex índice do inode
+ * @param primeiro quantidade de blocos que o arquivo mantém
+ * @param blocos quantidade atual de blocos do arquivo
+ */
+void encolherMapa(Imagem &img, int inodeIndex, long primeiro, long blocos)
+{
+  if (usaExtents(img, inodeIndex))
+  {
+    encolherExtents(img, inodeIndex, primeiro);
+    return;
+  }
+
+  long p = ponteirosPorBloco(img);
+  for (long l = primeiro; l < blocos; l++)
+  {
+    int fisico = blocoFisico(img, inodeIndex, l);
+    if (fisico == -1)
+    {
+      continue;
+    }
+    liberarBloco(img, fisico);
+    if (l < 3)
+    {
+      definirPonteiro(img, inodeIndex, l, 0);
+      marcarInodeSujo(img, inodeIndex);
+    }
+    else
+    {
+      int tabela = tabelaFolha(img, inodeIndex, l, false);
+      definirPonteiroBloco(img, tabela, (l - 3) % p, 0);
+      marcarTabelaSuja(img, tabela);
+    }
+  }
+
+  for (int k = 0; k < 3; k++)
+  {
+    uint32_t tabela = ponteiroInode(img, inodeIndex, PONTEIRO_INDIRETO + k);
+    if (tabela != 0 && 3 + k * p >= primeiro)
+    {
+      liberarBloco(img, tabela);
+      definirPonteiro(img, inodeIndex, PONTEIRO_INDIRETO + k, 0);
+      marcarInodeSujo(img, inodeIndex);
+    }
+  }
+  for (int k = 0; k < 3; k++)
+  {
+    long inicio = 3 + 3 * p + k * p * p;
+    uint32_t meio = ponteiroInode(img, inodeIndex, PONTEIRO_DUPLO + k);
+    if (meio == 0 || inicio + p * p <= primeiro)
+    {
+      continue;
+    }
+    for (long j = 0; j < p; j++)
+    {
+      uint32_t tabela = ponteiroBloco(img, meio, j);
+      if (tabela != 0 && inicio + j * p >= primeiro)
+      {
+        liberarBloco(img, tabela);
+        definirPonteiroBloco(img, meio, j, 0);
+        marcarTabelaSuja(img, meio);
+      }
+    }
+    if (inicio >= primeiro)
+    {
+      liberarBloco(img, meio);
+      definirPonteiro(img, inodeIndex, PONTEIRO_DUPLO + k, 0);
+      marcarInodeSujo(img, inodeIndex);
+    }
+  }
+  esquecerTraducao(img, inodeIndex);
+}
+
+/**
+ * @brief Aloca, zera e mapeia os blocos lógicos de primeiro até blocos - 1, que ainda não podem estar mapeados.
+ * @param img imagem montada
+ * @param inodeIndex índice do inode
+ * @param primeiro quantidade atual de blocos do arquivo
+ * @param blocos nova quantidade de blocos do arquivo
+ * @return false se faltarem blocos livres (o arquivo volta a ter primeiro blocos nesse caso)
+ */
+bool crescerMapa(Imagem &img, int inodeIndex, long primeiro, long blocos)
+{
+  if (usaExtents(img, inodeIndex))
+  {
+    if (!crescerExtents(img, inodeIndex, blocos))
+    {
+      return false;
+    }
+  }
+  else
+  {
+    for (long l = primeiro; l < blocos; l++)
+    {
+      int b = alocarBloco(img);
+      if (b == -1 || !mapearBloco(img, inodeIndex, l, b))
+      {
+        if (b != -1)
+        {
+          liberarBloco(img, b);
+        }
+        encolherMapa(img, inodeIndex, primeiro, l);
+        return false;
+      }
+    }
+  }
+
+  for (long l = primeiro; l < blocos; l++)
+  {
+    gravarBlocos(img, blocoFisico(img, inodeIndex, l), 0, NULL, img.blockSize);
+  }
+  return true;
+}
+
+#endif /* mapaBlocos_hpp */
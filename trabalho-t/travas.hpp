@@ -0,0 +1,134 @@
+#ifndef travas_hpp
+#define travas_hpp
+
+#include "imagem.hpp"
+#include "caminho.hpp"
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+
+using namespace std;
+
+// Uso da imagem montada por várias threads ao mesmo tempo.
+//
+// img.travaArvore protege a forma da árvore de diretórios. As operações que só mexem no conteúdo
+// de diretórios e arquivos (criar, ler, gravar, renomear dentro do mesmo diretório, remover ou mudar
+// de diretório um arquivo) a travam para leitura e rodam juntas; as que tiram um diretório do lugar
+// (remover ou mudar de pai um diretório) e a gravação das alterações a travam com exclusividade.
+// Com a árvore travada para leitura, nenhum diretório deixa de existir nem muda de pai.
+//
+// img.travasInodes tem um leitor/escritor por inode. O de um diretório protege a sua lista de
+// entradas e o nome dos filhos; o de um arquivo protege o conteúdo, o tamanho e o mapa de blocos.
+// Quem lê trava para leitura e quem altera, com exclusividade. A resolução de um caminho trava
+// cada diretório até travar o filho (resolverCaminho), então um arquivo só é removido depois que
+// quem o encontrou terminou de usá-lo.
+//
+// Ordem de travamento, para que duas operações nunca esperem uma pela outra:
+//   1. img.travaArvore;
+//   2. os inodes, por profundidade na árvore e, na mesma profundidade, por índice (o pai sempre
+//      antes dos filhos; os dois pais de mover, por essa ordem em travarPais);
+//   3. por último e sem esperar por nenhuma outra: travaDentries, as travas dos grupos de blocos
+//      (uma por vez, ou todas em ordem crescente), travaInodesLivres, travaVetores, as travas dos
+//      conjuntos sujos e a do cache de blocos.
+// Com a árvore travada com exclusividade nenhuma outra operação roda, e os inodes podem ser lidos sem travá-los.
+
+// Quantidade de componentes de um caminho (a profundidade do que ele indica; 0 para a raiz).
+int profundidade(string_view caminho)
+{
+  int componentes = 0;
+  size_t inicio = 0;
+  while (inicio < caminho.size())
+  {
+    size_t fim = caminho.find('/', inicio);
+    if (fim == string_view::npos)
+    {
+      fim = caminho.size();
+    }
+    componentes += fim > inicio;
+    inicio = fim + 1;
+  }
+  return componentes;
+}
+
+/**
+ * @brief Trava com exclusividade dois diretórios (que podem ser o mesmo) na ordem de travamento.
+ * @param img imagem montada
+ * @param a primeiro diretório
+ * @param profundidadeA profundidade de a
+ * @param b segundo diretório
+ * @param profundidadeB profundidade de b
+ * @param primeira recebe a trava do diretório que vem antes na ordem
+ * @param segunda recebe a trava do outro diretório (vazia se forem o mesmo)
+ */
+void travarPais(Imagem &img, int a, int profundidadeA, int b, int profundidadeB,
+                unique_lock<shared_mutex> &primeira, unique_lock<shared_mutex> &segunda)
+{
+  if (profundidadeB < profundidadeA || (profundidadeB == profundidadeA && b < a))
+  {
+    swap(a, b);
+  }
+  primeira = unique_lock<shared_mutex>(img.travasInodes[a]);
+  if (b != a)
+  {
+    segunda = unique_lock<shared_mutex>(img.travasInodes[b]);
+  }
+}
+
+// Travas de uma operação sobre um inode achado pelo caminho (ver acessarInode), soltas no fim do escopo.
+struct AcessoInode
+{
+  shared_lock<shared_mutex> arvore;
+  shared_lock<shared_mutex> pai;
+  shared_lock<shared_mutex> leitura;
+  unique_lock<shared_mutex> escrita;
+};
+
+/**
+ * @brief Trava a árvore para leitura, acha o inode de um caminho e o trava para leitura ou escrita.
+ * @param img imagem montada
+ * @param caminho caminho completo
+ * @param escrever trava o inode com exclusividade em vez de para leitura
+ * @param manterPai mantém o pai travado para leitura, para que o nome do inode não mude durante o acesso
+ * @param acesso recebe as travas
+ * @return inode do caminho, ou -1 se ele não existir (as travas ficam soltas nesse caso)
+ */
+int acessarInode(Imagem &img, string_view caminho, bool escrever, bool manterPai, AcessoInode &acesso)
+{
+  acesso.arvore = shared_lock<shared_mutex>(img.travaArvore);
+
+  int alvo = img.root;
+  if (profundidade(caminho) > 0)
+  {
+    string_view nome;
+    int pai = resolverPai(img, caminho, nome);
+    if (pai == -1)
+    {
+      acesso.arvore.unlock();
+      return -1;
+    }
+    acesso.pai = shared_lock<shared_mutex>(img.travasInodes[pai]);
+    alvo = procurarFilho(img, pai, nome.data(), nome.size());
+    if (alvo == -1)
+    {
+      acesso.pai.unlock();
+      acesso.arvore.unlock();
+      return -1;
+    }
+  }
+
+  if (escrever)
+  {
+    acesso.escrita = unique_lock<shared_mutex>(img.travasInodes[alvo]);
+  }
+  else
+  {
+    acesso.leitura = shared_lock<shared_mutex>(img.travasInodes[alvo]);
+  }
+  if (!manterPai && acesso.pai.owns_lock())
+  {
+    acesso.pai.unlock();
+  }
+  return alvo;
+}
+
+#endif /* travas_hpp */